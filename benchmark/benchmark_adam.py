@@ -7,6 +7,7 @@ from tqdm import tqdm
 from transformers import GPT2Config, GPT2LMHeadModel
 
 from tensornvme import DiskOffloader
+from tensornvme._C import PrefetchIterator
 
 N_WARMUP = 2
 N_ACTIVATE = 4
@@ -55,12 +56,13 @@ def adam(step, lr, param, grad, exp_avg, exp_avg_sq, beta1=0.9, beta2=0.999, eps
 
 
 class Adam(torch.optim.Optimizer):
-    def __init__(self, params, lr, betas=(0.9, 0.999), offloader: Optional[DiskOffloader] = None, prefetch: int = 0, vecio: bool = False) -> None:
+    def __init__(self, params, lr, betas=(0.9, 0.999), offloader: Optional[DiskOffloader] = None, prefetch: int = 0, vecio: bool = False, iterator: bool = False) -> None:
         default = dict(lr=lr, betas=betas)
         super().__init__(params, default)
         self.offloader = offloader
         self.prefetch = prefetch
         self.vecio = vecio
+        self.iterator = iterator
         self.param_to_group = {}
         # init states
         for group in self.param_groups:
@@ -73,7 +75,7 @@ class Adam(torch.optim.Optimizer):
                     state['exp_avg_sq'] = torch.zeros_like(p)
                     if self.offloader is None:
                         continue
-                    if vecio:
+                    if vecio and not iterator:
                         self.offloader.sync_writev(
                             [state['exp_avg'], state['exp_avg_sq']])
                     else:
@@ -88,6 +90,18 @@ class Adam(torch.optim.Optimizer):
 
         params = [
             p for group in self.param_groups for p in group['params'] if p.grad is not None]
+        if self.offloader is not None and self.iterator:
+            # the iterator keeps the reads of the next params in flight and writes back the previous ones
+            groups = [[self.state[p]['exp_avg'], self.state[p]['exp_avg_sq']] for p in params]
+            it = PrefetchIterator(self.offloader, groups, max(self.prefetch, 1))
+            for p, (exp_avg, exp_avg_sq) in zip(params, it):
+                state = self.state[p]
+                group = self.param_to_group[p]
+                state['step'] += 1
+                beta1, beta2 = group['betas']
+                adam(state['step'], group['lr'], p, p.grad, exp_avg, exp_avg_sq, beta1=beta1, beta2=beta2)
+            it.close()
+            return loss
         if self.offloader is not None and self.prefetch > 0:
             for p in params[:self.prefetch]:
                 state = self.state[p]
@@ -158,12 +172,13 @@ class Adam(torch.optim.Optimizer):
                 self.offloader.sync_write(state['exp_avg_sq'])
 
 
-def run_adam(model: torch.nn.Module, nvme_offload: bool, backend: str, prefetch: int, vecio: bool):
+def run_adam(model: torch.nn.Module, nvme_offload: bool, backend: str, prefetch: int, vecio: bool,
+             iterator: bool = False):
     offloader = None
     if nvme_offload:
         offloader = DiskOffloader('.', 8, backend=backend)
     optimizer = Adam(model.parameters(), 1e-3,
-                     offloader=offloader, prefetch=prefetch, vecio=vecio)
+                     offloader=offloader, prefetch=prefetch, vecio=vecio, iterator=iterator)
     for p in model.parameters():
         p.grad = torch.rand_like(p)
     for _ in range(N_WARMUP):
@@ -173,7 +188,7 @@ def run_adam(model: torch.nn.Module, nvme_offload: bool, backend: str, prefetch:
         postfix = None
     else:
         desc = 'NVME'
-        postfix = {'backend': backend, 'prefetch': prefetch, 'vecio': vecio}
+        postfix = {'backend': backend, 'prefetch': prefetch, 'vecio': vecio, 'iterator': iterator}
     for _ in tqdm(range(N_ACTIVATE), desc=desc, postfix=postfix):
         optimizer.step()
 
@@ -190,3 +205,4 @@ if __name__ == '__main__':
         run_adam(model, True, 'uring', 2, True)
         run_adam(model, True, 'uring', 4, False)
         run_adam(model, True, 'uring', 4, True)
+        run_adam(model, True, 'uring', 2, False, iterator=True)
@@ -0,0 +1,53 @@
+import os
+import time
+
+import torch
+
+from tensornvme._C import AsyncFileWriter, IOArbiter, Offloader
+
+N_READS = 256
+READ_BYTES = 256 << 10
+CHECKPOINT_BYTES = 4 << 20
+N_CHECKPOINT_WRITES = 8
+N_ENTRIES = 64
+
+
+def bench(backend: str, arbitrated: bool):
+    of = Offloader('./offload-bench-arbiter', N_ENTRIES, backend, retain=True)
+    fd = os.open('./offload-bench-arbiter.ckpt', os.O_RDWR | os.O_CREAT, 0o600)
+    writer = AsyncFileWriter(fd, N_ENTRIES, backend)
+    arbiter = IOArbiter(max_inflight=N_ENTRIES)
+    if arbitrated:
+        arbiter.add_class('train', weight=8)
+        arbiter.add_class('checkpoint', weight=1, bytes_per_sec=256 << 20)
+        of.set_io_class(arbiter, 'train')
+        writer.set_io_class(arbiter, 'checkpoint')
+    target = torch.rand(READ_BYTES // 4)
+    of.sync_write(target, 'target')
+    checkpoint = torch.rand(CHECKPOINT_BYTES // 4)
+    latencies = []
+    for step in range(N_READS):
+        # a checkpoint burst is in flight when the optimizer reads its states
+        for i in range(N_CHECKPOINT_WRITES):
+            writer.write(checkpoint.data_ptr(), CHECKPOINT_BYTES, i * CHECKPOINT_BYTES)
+        done = []
+        start = time.perf_counter()
+        of.async_read(target, 'target', lambda: done.append(time.perf_counter()))
+        of.sync_read_events()
+        latencies.append(done[0] - start)
+        writer.synchronize()
+    latencies.sort()
+    stats = arbiter.stats()
+    os.close(fd)
+    os.remove('./offload-bench-arbiter.ckpt')
+    return [latencies[int(q * (len(latencies) - 1))] * 1e3 for q in (0.5, 0.99)], stats
+
+
+if __name__ == '__main__':
+    for backend in ('uring', 'aio', 'pthread'):
+        for arbitrated in (False, True):
+            (p50, p99), stats = bench(backend, arbitrated)
+            print(f'[{backend}] arbitrated={arbitrated}: read p50 {p50:.2f} ms, p99 {p99:.2f} ms')
+            for name, counters in stats.items():
+                print(f'    {name}: {counters["bytes_per_sec"] / (1 << 20):.0f} MB/s, '
+                      f'avg latency {counters["avg_latency_us"]} us, throttled {counters["throttled"]}')
@@ -0,0 +1,39 @@
+import time
+
+import torch
+
+from tensornvme._C import Offloader
+
+N_ENTRIES = 128
+# a mix of small and large tensors, as in optimizer states of layers of different widths
+SIZES = [16 << 10, 256 << 10, 4 << 20]
+N_TENSORS = 96
+N_STEPS = 8
+
+
+def bench(backend: str, depth: int, autotune: bool):
+    of = Offloader('./offload-bench-autotune', depth, backend)
+    if autotune:
+        of.set_autotune()
+    tensors = [torch.rand(SIZES[i % len(SIZES)] // 4) for i in range(N_TENSORS)]
+    n_bytes = sum(t.numel() * t.element_size() for t in tensors)
+    start = time.perf_counter()
+    for _ in range(N_STEPS):
+        for i, tensor in enumerate(tensors):
+            of.async_write(tensor, f'tensor{i}')
+        of.synchronize()
+        for i, tensor in enumerate(tensors):
+            of.async_read(tensor, f'tensor{i}')
+        of.synchronize()
+    elapsed = time.perf_counter() - start
+    return 2 * N_STEPS * n_bytes / elapsed / (1 << 20), of.autotune_stats()
+
+
+if __name__ == '__main__':
+    for backend in ('uring', 'aio', 'pthread'):
+        for depth in (4, 16, 64, N_ENTRIES):
+            throughput, _ = bench(backend, depth, False)
+            print(f'[{backend}] fixed depth {depth}: {throughput:.0f} MB/s')
+        throughput, stats = bench(backend, N_ENTRIES, True)
+        print(f'[{backend}] autotuned: {throughput:.0f} MB/s, depth {stats["depth"]}, batch {stats["batch"]}, '
+              f'{stats["increases"]} increases, {stats["decreases"]} decreases')
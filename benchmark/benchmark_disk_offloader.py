@@ -0,0 +1,59 @@
+import os
+import time
+import uuid
+
+import torch
+
+from tensornvme import DiskOffloader
+from tensornvme._C import Offloader
+
+N_TENSORS = 100000
+N_ENTRIES = 64
+
+
+class PyDiskOffloader(Offloader):
+    # the former pure Python wrapper: keys, storage resizing and callbacks in the interpreter
+    def __init__(self, dir_name: str, n_entries: int, backend: str) -> None:
+        super().__init__(os.path.join(dir_name, f'offload-{uuid.uuid4().hex}'), n_entries, backend)
+
+    def async_write(self, tensor: torch.Tensor) -> None:
+        def callback_fn():
+            tensor.storage().resize_(0)
+        super().async_write(tensor, str(id(tensor)), callback_fn)
+
+    def async_read(self, tensor: torch.Tensor) -> None:
+        if tensor.storage().size() == 0:
+            tensor.storage().resize_(tensor.numel())
+        super().async_read(tensor, str(id(tensor)))
+
+
+class BatchDiskOffloader(DiskOffloader):
+    # the whole list is offloaded with one call
+    def async_write(self, tensors) -> None:
+        self.async_write_batch(tensors)
+
+    def async_read(self, tensors) -> None:
+        self.async_read_batch(tensors)
+
+
+def bench(offloader, tensors):
+    start = time.time()
+    for tensor in tensors:
+        offloader.async_write(tensor)
+    offloader.synchronize()
+    write_dur = time.time() - start
+    start = time.time()
+    for tensor in tensors:
+        offloader.async_read(tensor)
+    offloader.synchronize()
+    read_dur = time.time() - start
+    return write_dur, read_dur
+
+
+if __name__ == '__main__':
+    tensors = [torch.rand(64) for _ in range(N_TENSORS)]
+    for backend in ('uring', 'aio', 'pthread'):
+        for name, cls in (('python', PyDiskOffloader), ('native', DiskOffloader), ('batch', BatchDiskOffloader)):
+            write_dur, read_dur = bench(cls('.', N_ENTRIES, backend), [tensors] if name == 'batch' else tensors)
+            print(f'[{backend}] {name}: write {write_dur / N_TENSORS * 1e6:.2f} us/tensor, '
+                  f'read {read_dur / N_TENSORS * 1e6:.2f} us/tensor')
@@ -0,0 +1,57 @@
+import os
+import time
+import uuid
+
+import torch
+
+from tensornvme._C import Offloader
+
+N_TENSORS = 100000
+N_ENTRIES = 64
+
+
+def new_offloader(backend: str) -> Offloader:
+    return Offloader(os.path.join('.', f'offload-{uuid.uuid4().hex}'), N_ENTRIES, backend)
+
+
+def bench_keys(backend: str, tensors):
+    offloader = new_offloader(backend)
+    start = time.time()
+    for tensor in tensors:
+        offloader.async_write(tensor, str(id(tensor)))
+    offloader.synchronize()
+    write_dur = time.time() - start
+    metadata_bytes = offloader.metadata_bytes()
+    start = time.time()
+    for tensor in tensors:
+        offloader.async_read(tensor, str(id(tensor)))
+    offloader.synchronize()
+    read_dur = time.time() - start
+    return write_dur, read_dur, metadata_bytes
+
+
+def bench_handles(backend: str, tensors):
+    offloader = new_offloader(backend)
+    handles = [offloader.register(tensor) for tensor in tensors]
+    start = time.time()
+    for tensor, handle in zip(tensors, handles):
+        offloader.async_write(tensor, handle)
+    offloader.synchronize()
+    write_dur = time.time() - start
+    metadata_bytes = offloader.metadata_bytes()
+    start = time.time()
+    for tensor, handle in zip(tensors, handles):
+        offloader.async_read(tensor, handle)
+    offloader.synchronize()
+    read_dur = time.time() - start
+    return write_dur, read_dur, metadata_bytes
+
+
+if __name__ == '__main__':
+    tensors = [torch.rand(16) for _ in range(N_TENSORS)]
+    for backend in ('uring', 'aio', 'pthread'):
+        for name, fn in (('str keys', bench_keys), ('handles', bench_handles)):
+            write_dur, read_dur, metadata_bytes = fn(backend, tensors)
+            print(f'[{backend}] {name}: write {write_dur / N_TENSORS * 1e6:.2f} us/tensor, '
+                  f'read {read_dur / N_TENSORS * 1e6:.2f} us/tensor, '
+                  f'metadata {metadata_bytes / N_TENSORS:.1f} B/tensor')
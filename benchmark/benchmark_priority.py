@@ -0,0 +1,44 @@
+import time
+
+import torch
+
+from tensornvme._C import Offloader
+
+N_READS = 256
+READ_BYTES = 256 << 10
+WRITE_BYTES = 4 << 20
+N_WRITES = 8
+N_ENTRIES = 64
+
+
+def bench(backend: str, read_priority: str, write_priority: str, max_writes: int):
+    of = Offloader('./offload-bench-priority', N_ENTRIES, backend, retain=True)
+    of.set_io_priority(read_priority, write_priority, max_writes)
+    target = torch.rand(READ_BYTES // 4)
+    of.sync_write(target, 'target')
+    writes = [torch.rand(WRITE_BYTES // 4) for _ in range(N_WRITES)]
+    latencies = []
+    for _ in range(N_READS):
+        # write-back is in flight before the critical read and keeps arriving after it
+        half = N_WRITES // 2
+        for i, tensor in enumerate(writes[:half]):
+            of.async_write(tensor, f'write{i}')
+        done = []
+        start = time.perf_counter()
+        of.async_read(target, 'target', lambda: done.append(time.perf_counter()))
+        for i, tensor in enumerate(writes[half:], half):
+            of.async_write(tensor, f'write{i}')
+        of.sync_read_events()
+        latencies.append(done[0] - start)
+        of.synchronize()
+    latencies.sort()
+    return [latencies[int(q * (len(latencies) - 1))] * 1e3 for q in (0.5, 0.99)]
+
+
+if __name__ == '__main__':
+    configs = [('normal', 'normal', 0), ('critical', 'bulk', 0), ('critical', 'bulk', 1)]
+    for backend in ('uring', 'aio', 'pthread'):
+        for read_priority, write_priority, max_writes in configs:
+            p50, p99 = bench(backend, read_priority, write_priority, max_writes)
+            print(f'[{backend}] read={read_priority} write={write_priority} max_writes={max_writes}: '
+                  f'p50 {p50:.2f} ms, p99 {p99:.2f} ms')
@@ -0,0 +1,45 @@
+import time
+
+import torch
+
+from tensornvme._C import Offloader
+
+N_TENSORS = 4096
+TENSOR_BYTES = 4 << 10
+N_ENTRIES = 128
+N_STEPS = 5
+
+
+def bench(backend: str, replay: bool):
+    of = Offloader('./offload-bench-replay', N_ENTRIES, backend, retain=True)
+    tensors = [torch.rand(TENSOR_BYTES // 4) for _ in range(N_TENSORS)]
+    keys = [f'tensor{i}' for i in range(N_TENSORS)]
+
+    def step():
+        # time spent in the submitting calls, the wait for the device is excluded
+        start = time.perf_counter()
+        for tensor, key in zip(tensors, keys):
+            of.async_write(tensor, key)
+        submit = time.perf_counter() - start
+        of.synchronize()
+        start = time.perf_counter()
+        for tensor, key in zip(tensors, keys):
+            of.async_read(tensor, key)
+        submit += time.perf_counter() - start
+        of.synchronize()
+        return submit
+
+    if replay:
+        of.start_capture()
+    step()
+    if replay:
+        of.stop_capture()
+    submit = min(step() for _ in range(N_STEPS))
+    return submit / (2 * N_TENSORS) * 1e6
+
+
+if __name__ == '__main__':
+    for backend in ('uring', 'aio'):
+        normal = bench(backend, False)
+        replayed = bench(backend, True)
+        print(f'[{backend}] submission per request: normal {normal:.2f} us, replay {replayed:.2f} us')
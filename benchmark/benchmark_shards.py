@@ -0,0 +1,31 @@
+import time
+
+import torch
+
+from tensornvme._C import ShardedOffloader
+
+TOTAL_BYTES = 2 << 30
+TENSOR_BYTES = 64 << 10
+N_ENTRIES = 32
+
+
+def bench(backend: str, n_shards: int):
+    of = ShardedOffloader('./offload-bench-shards', n_shards, N_ENTRIES, backend)
+    n_tensors = TOTAL_BYTES // TENSOR_BYTES
+    tensors = [torch.rand(TENSOR_BYTES // 4) for _ in range(n_tensors)]
+    keys = [f'tensor{i}' for i in range(n_tensors)]
+    durs = []
+    for fn in (of.async_write, of.async_read):
+        start = time.time()
+        for tensor, key in zip(tensors, keys):
+            fn(tensor, key)
+        of.synchronize()
+        durs.append(time.time() - start)
+    return [TOTAL_BYTES / dur / 1024**3 for dur in durs]
+
+
+if __name__ == '__main__':
+    for backend in ('uring', 'aio'):
+        for n_shards in (1, 2, 4, 8, 16):
+            write_bw, read_bw = bench(backend, n_shards)
+            print(f'[{backend}] {n_shards:2d} shards: write {write_bw:.2f} GB/s, read {read_bw:.2f} GB/s')
@@ -0,0 +1,40 @@
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import torch
+
+from tensornvme import DiskOffloader
+
+TOTAL_BYTES = 4 << 30
+TENSOR_BYTES = 4 << 20
+N_ENTRIES = 32
+
+
+def bench(backend: str, n_threads: int):
+    of = DiskOffloader('.', N_ENTRIES, backend, thread_safe=True)
+    n_tensors = TOTAL_BYTES // TENSOR_BYTES // n_threads
+    groups = [[torch.rand(TENSOR_BYTES // 4) for _ in range(n_tensors)] for _ in range(n_threads)]
+
+    def write(tensors):
+        for tensor in tensors:
+            of.sync_write(tensor)
+
+    def read(tensors):
+        for tensor in tensors:
+            of.sync_read(tensor)
+
+    durs = []
+    with ThreadPoolExecutor(n_threads) as pool:
+        for fn in (write, read):
+            start = time.time()
+            list(pool.map(fn, groups))
+            durs.append(time.time() - start)
+    n_bytes = n_tensors * n_threads * TENSOR_BYTES
+    return [n_bytes / dur / 1024**3 for dur in durs]
+
+
+if __name__ == '__main__':
+    for backend in ('uring', 'aio', 'pthread'):
+        for n_threads in (1, 2, 4, 8, 16, 32):
+            write_bw, read_bw = bench(backend, n_threads)
+            print(f'[{backend}] {n_threads:2d} threads: write {write_bw:.2f} GB/s, read {read_bw:.2f} GB/s')
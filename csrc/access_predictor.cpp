@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <stdexcept>
+#include "access_predictor.h"
+
+AccessPredictor::AccessPredictor(size_t match_window) : match_window(match_window), period(0.0), next(0), is_recording(false)
+{
+}
+
+void AccessPredictor::start_recording()
+{
+    clear();
+    this->is_recording = true;
+}
+
+void AccessPredictor::record(const std::string &key, ull bytes, double time)
+{
+    if (!this->is_recording)
+        throw std::runtime_error("AccessPredictor is not recording");
+    this->positions[key].push_back(this->pattern.size());
+    this->pattern.push_back(Access{key, bytes, time});
+}
+
+void AccessPredictor::stop_recording()
+{
+    this->is_recording = false;
+    this->next = 0;
+    if (this->pattern.empty())
+        return;
+    // the next step starts one mean gap after the last access
+    double span = this->pattern.back().time - this->pattern.front().time;
+    double gap = this->pattern.size() > 1 ? span / (this->pattern.size() - 1) : 0.0;
+    this->period = span + gap;
+}
+
+void AccessPredictor::clear()
+{
+    this->pattern.clear();
+    this->positions.clear();
+    this->period = 0.0;
+    this->next = 0;
+    this->is_recording = false;
+}
+
+bool AccessPredictor::recording() const
+{
+    return this->is_recording;
+}
+
+bool AccessPredictor::ready() const
+{
+    return !this->is_recording && !this->pattern.empty();
+}
+
+size_t AccessPredictor::size() const
+{
+    return this->pattern.size();
+}
+
+const std::string &AccessPredictor::key(size_t index) const
+{
+    return this->pattern.at(index).key;
+}
+
+ull AccessPredictor::bytes(size_t index) const
+{
+    return this->pattern.at(index).bytes;
+}
+
+size_t AccessPredictor::position() const
+{
+    return this->next;
+}
+
+long AccessPredictor::observe(const std::string &key)
+{
+    auto iter = this->positions.find(key);
+    if (!ready() || iter == this->positions.end())
+        return -1;
+    const vector<size_t> &indices = iter->second;
+    size_t n = this->pattern.size();
+    // the first occurrence at or after the expected position, wrapping into the next step
+    auto found = std::lower_bound(indices.begin(), indices.end(), this->next);
+    size_t index = found != indices.end() ? *found : indices.front();
+    size_t distance = (index + n - this->next) % n;
+    if (distance > this->match_window)
+    {
+        // a repeated access of a key which was just passed does not move the position
+        size_t behind = n;
+        for (size_t candidate : indices)
+            behind = std::min(behind, (this->next + n - 1 - candidate) % n);
+        if (behind < this->match_window)
+            return static_cast<long>((this->next + n - 1 - behind) % n);
+    }
+    this->next = (index + 1) % n;
+    return static_cast<long>(index);
+}
+
+vector<size_t> AccessPredictor::upcoming(double lead, size_t max_count) const
+{
+    vector<size_t> result;
+    size_t n = this->pattern.size();
+    if (!ready())
+        return result;
+    size_t last = (this->next + n - 1) % n;
+    double base = this->pattern[last].time;
+    for (size_t k = 0; k < n && result.size() < max_count; k++)
+    {
+        size_t index = (this->next + k) % n;
+        double time = this->pattern[index].time;
+        if (index <= last)
+            time += this->period;
+        if (!result.empty() && time - base > lead)
+            break;
+        result.push_back(index);
+    }
+    return result;
+}
+
+bool AccessPredictor::between(size_t index, size_t from, size_t to) const
+{
+    size_t n = this->pattern.size();
+    if (n == 0)
+        return false;
+    return (index + n - from) % n < (to + n - from) % n;
+}
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include "adaptive_depth.h"
+
+AdaptiveAsyncIO::AdaptiveAsyncIO(AsyncIO *inner, unsigned int max_depth, unsigned int min_depth, double latency_tolerance) : QueuedAsyncIO(inner), controller(max_depth, min_depth, latency_tolerance), plugged(false) {}
+
+AdaptiveAsyncIO::~AdaptiveAsyncIO()
+{
+    synchronize();
+}
+
+void AdaptiveAsyncIO::enqueue(Request request)
+{
+    this->queue.push_back(Pending{std::move(request), clock::time_point()});
+    if (this->n_inflight >= this->controller.depth())
+        this->controller.saturated();
+    dispatch(false);
+}
+
+void AdaptiveAsyncIO::dispatch(bool waiting)
+{
+    while (!this->queue.empty())
+    {
+        unsigned int depth = this->controller.depth();
+        if (this->n_inflight >= depth)
+            return;
+        unsigned int n = static_cast<unsigned int>(std::min<size_t>(depth - this->n_inflight, this->queue.size()));
+        // the device is busy, so a short batch waits for more requests or free slots
+        if (this->n_inflight > 0 && n < this->controller.batch() && !waiting)
+            return;
+        bool batched = n > 1 && !this->plugged;
+        if (batched)
+            this->inner->plug();
+        try
+        {
+            for (unsigned int i = 0; i < n; i++)
+            {
+                auto request = std::make_shared<Pending>(std::move(this->queue.front()));
+                this->queue.pop_front();
+                request->submitted_at = clock::now();
+                submit(request, [this, request]()
+                       {
+                           this->controller.completed(request->bytes, clock::now() - request->submitted_at);
+                           dispatch(false); });
+            }
+        }
+        catch (...)
+        {
+            if (batched)
+                this->inner->unplug();
+            throw;
+        }
+        if (batched)
+            this->inner->unplug();
+    }
+}
+
+void AdaptiveAsyncIO::wait()
+{
+    // the caller issues nothing more for now, so short batches are not held back
+    dispatch(true);
+    if (this->n_inflight > 0)
+        this->inner->get_event(WAIT);
+}
+
+void AdaptiveAsyncIO::drop(unsigned long long tag, std::vector<callback_t> &dropped)
+{
+    drop_queued(this->queue, tag, dropped);
+}
+
+void AdaptiveAsyncIO::plug()
+{
+    this->plugged = true;
+    this->inner->plug();
+}
+
+void AdaptiveAsyncIO::unplug()
+{
+    this->plugged = false;
+    this->inner->unplug();
+}
+
+std::unordered_map<std::string, unsigned long long> AdaptiveAsyncIO::stats() const
+{
+    return this->controller.stats();
+}
@@ -1,3 +1,4 @@
+#include <exception>
 #include "aio.h"
 
 AIOAsyncIO::AIOAsyncIO(unsigned int n_entries, unsigned int n_tasks)
@@ -28,52 +29,209 @@ void AIOAsyncIO::get_event(WaitType wt)
     else
         num_events = io_getevents(io_ctx, 0, this->max_nr, events.get(), &(this->timeout)); /* 获得异步I/O event个数 */
 
+    // every reaped event is finished, a failed one does not strand the others of the batch
+    std::exception_ptr error;
     for (int i = 0; i < num_events; i++) /* 开始获取每一个event并且做相应处理 */
     {
-        struct io_event event = events.get()[i];
-        std::unique_ptr<IOData> data(static_cast<IOData *>(event.data));
-        if (data->type == WRITE)
-            this->n_write_events--;
-        else if (data->type == READ)
-            this->n_read_events--;
-        else
-            throw std::runtime_error("Unknown IO event type");
-        if (data->callback != nullptr)
-            data->callback();
-        // printf("%d tasks to be done\n", this->n_write_events);
+        try
+        {
+            finish_event(events.get()[i]);
+        }
+        catch (...)
+        {
+            if (error == nullptr)
+                error = std::current_exception();
+        }
     }
+    if (error != nullptr)
+        std::rethrow_exception(error);
 }
 
-void AIOAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+void AIOAsyncIO::finish_event(struct io_event &event)
 {
-    struct iocb iocb
+    this->submitted.erase(event.obj);
+    delete event.obj;
+    std::unique_ptr<IOData> data(static_cast<IOData *>(event.data));
+    bool done = true;
+    try
+    {
+        done = data->advance(static_cast<long>(event.res));
+    }
+    catch (...)
     {
-    }; // 建立一个异步I/O需求
-    struct iocb *iocbs = &iocb;
-    auto *data = new IOData(WRITE, callback);
+        done_event(data->type);
+        throw;
+    }
+    if (!done)
+    {
+        // short transfer, the event stays in flight; a failed resubmission drops it
+        submit(data.release());
+        return;
+    }
+    done_event(data->type);
+    if (data->callback != nullptr)
+        data->callback();
+}
 
-    io_prep_pwrite(&iocb, fd, buffer, n_bytes, (long long)offset); // 初始化这个异步I/O需求 counter为偏移量
+void AIOAsyncIO::done_event(IOType type)
+{
+    if (type == WRITE)
+        this->n_write_events--;
+    else if (type == READ)
+        this->n_read_events--;
+    else
+        throw std::runtime_error("Unknown IO event type");
+}
 
-    iocb.data = data;
-    io_submit(this->io_ctx, 1, &iocbs); // 提交这个I/O不会堵塞
+void AIOAsyncIO::submit(IOData *data)
+{
+    struct iocb *iocb = new struct iocb();
+    if (data->type == WRITE)
+        io_prep_pwrite(iocb, data->fd, data->buffer, data->n_bytes, (long long)data->offset);
+    else
+        io_prep_pread(iocb, data->fd, data->buffer, data->n_bytes, (long long)data->offset);
+    set_ioprio(*iocb, data->type);
+    iocb->data = data;
+    enqueue(iocb);
+}
 
-    this->n_write_events++;
+void AIOAsyncIO::set_ioprio(struct iocb &iocb, IOType type)
+{
+    unsigned short ioprio = ioprio_value(this->priorities[type]);
+    if (ioprio == 0 || !this->ioprio_supported)
+        return;
+    iocb.aio_reqprio = ioprio;
+    iocb.u.c.flags |= IOCB_FLAG_IOPRIO;
 }
 
-void AIOAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+void AIOAsyncIO::enqueue(struct iocb *iocb)
 {
-    struct iocb iocb
+    if (this->plugged)
     {
-    }; // 建立一个异步I/O需求
-    struct iocb *iocbs = &iocb;
-    auto *data = new IOData(READ, callback);
+        this->pending.push_back(iocb);
+        return;
+    }
+    submit_iocbs(&iocb, 1);
+}
 
-    io_prep_pread(&iocb, fd, buffer, n_bytes, (long long)offset);
+void AIOAsyncIO::submit_iocbs(struct iocb **iocbs, size_t n)
+{
+    size_t n_submitted = 0;
+    while (n_submitted < n)
+    {
+        long nr = std::min(n - n_submitted, static_cast<size_t>(this->max_nr));
+        int ret = io_submit(this->io_ctx, nr, iocbs + n_submitted);
+        if (ret > 0)
+        {
+            this->submitted.insert(iocbs + n_submitted, iocbs + n_submitted + ret);
+            n_submitted += ret;
+        }
+        else if (ret == -EAGAIN || ret == 0)
+            get_event(WAIT); // the context is full, reap before submitting the rest
+        else if (ret == -EINVAL && (iocbs[n_submitted]->u.c.flags & IOCB_FLAG_IOPRIO))
+        {
+            // the kernel predates per-request priorities, they are not set from now on
+            this->ioprio_supported = false;
+            for (size_t i = n_submitted; i < n; i++)
+            {
+                iocbs[i]->u.c.flags &= ~IOCB_FLAG_IOPRIO;
+                iocbs[i]->aio_reqprio = 0;
+            }
+        }
+        else
+        {
+            // the failed iocb and the ones after it are not submitted
+            for (size_t i = n_submitted; i < n; i++)
+                drop(iocbs[i]);
+            throw std::runtime_error("Submit error: " + std::string(strerror(-ret)));
+        }
+    }
+}
 
-    iocb.data = data;
-    io_submit(this->io_ctx, 1, &iocbs); /* 提交这个I/O不会堵塞 */
+void AIOAsyncIO::drop(struct iocb *iocb)
+{
+    IOData *data = static_cast<IOData *>(iocb->data);
+    done_event(data->type);
+    delete data;
+    delete iocb;
+}
+
+void AIOAsyncIO::plug()
+{
+    this->plugged = true;
+}
 
+void AIOAsyncIO::unplug()
+{
+    this->plugged = false;
+    std::vector<struct iocb *> iocbs;
+    iocbs.swap(this->pending);
+    submit_iocbs(iocbs.data(), iocbs.size());
+}
+
+void AIOAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    IOData *data = new IOData(WRITE, callback, fd, buffer, n_bytes, offset);
+    data->tag = this->tag;
+    // counted first, a failed submission undoes it
+    this->n_write_events++;
+    submit(data);
+}
+
+void AIOAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    IOData *data = new IOData(READ, callback, fd, buffer, n_bytes, offset);
+    data->tag = this->tag;
     this->n_read_events++;
+    submit(data);
+}
+
+void AIOAsyncIO::cancel(unsigned long long tag)
+{
+    auto matches = [tag](struct iocb *iocb)
+    {
+        IOData *data = static_cast<IOData *>(iocb->data);
+        return !data->cancelled && (tag == 0 || data->tag == tag);
+    };
+    // queued requests never reach the kernel, they complete right away
+    std::vector<struct iocb *> dropped, kept;
+    for (struct iocb *iocb : this->pending)
+        (matches(iocb) ? dropped : kept).push_back(iocb);
+    this->pending.swap(kept);
+    std::vector<struct iocb *> targets;
+    for (struct iocb *iocb : this->submitted)
+    {
+        if (matches(iocb))
+            targets.push_back(iocb);
+    }
+    std::vector<struct io_event> events;
+    for (struct iocb *iocb : targets)
+    {
+        static_cast<IOData *>(iocb->data)->cancelled = true;
+        // most file systems cannot cancel, the request then completes normally; newer kernels deliver
+        // the completion of a cancelled request through io_getevents(), older ones return it here
+        struct io_event event
+        {
+        };
+        if (io_cancel(this->io_ctx, iocb, &event) == 0)
+        {
+            event.data = iocb->data;
+            event.obj = iocb;
+            events.push_back(event);
+        }
+    }
+    for (struct iocb *iocb : dropped)
+    {
+        static_cast<IOData *>(iocb->data)->cancelled = true;
+        struct io_event event
+        {
+        };
+        event.data = iocb->data;
+        event.obj = iocb;
+        events.push_back(event);
+    }
+    for (struct io_event &event : events)
+        finish_event(event);
 }
 
 void AIOAsyncIO::sync_write_events()
@@ -96,34 +254,30 @@ void AIOAsyncIO::synchronize()
 
 void AIOAsyncIO::writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
-    struct iocb iocb
-    {
-    }; // 建立一个异步I/O需求
-    struct iocb *iocbs = &iocb;
+    struct iocb *iocb = new struct iocb(); // 建立一个异步I/O需求
     auto *data = new IOData(WRITE, callback, iov);
+    data->tag = this->tag;
 
-    io_prep_pwritev(&iocb, fd, iov, iovcnt, (long long)offset); // 初始化这个异步I/O需求 counter为偏移量
-
-    iocb.data = data;
-    io_submit(this->io_ctx, 1, &iocbs); // 提交这个I/O不会堵塞
+    io_prep_pwritev(iocb, fd, iov, iovcnt, (long long)offset); // 初始化这个异步I/O需求 counter为偏移量
+    set_ioprio(*iocb, WRITE);
 
+    iocb->data = data;
     this->n_write_events++;
+    enqueue(iocb); // 提交这个I/O不会堵塞
 }
 
 void AIOAsyncIO::readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
-    struct iocb iocb
-    {
-    }; // 建立一个异步I/O需求
-    struct iocb *iocbs = &iocb;
+    struct iocb *iocb = new struct iocb(); // 建立一个异步I/O需求
     auto *data = new IOData(READ, callback, iov);
+    data->tag = this->tag;
 
-    io_prep_preadv(&iocb, fd, iov, iovcnt, (long long)offset);
-
-    iocb.data = data;
-    io_submit(this->io_ctx, 1, &iocbs); /* 提交这个I/O不会堵塞 */
+    io_prep_preadv(iocb, fd, iov, iovcnt, (long long)offset);
+    set_ioprio(*iocb, READ);
 
+    iocb->data = data;
     this->n_read_events++;
+    enqueue(iocb); /* 提交这个I/O不会堵塞 */
 }
 
 void AIOAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned)
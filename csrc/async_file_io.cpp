@@ -1,6 +1,6 @@
 #include "async_file_io.h"
 
-AsyncFileWriter::AsyncFileWriter(int fd, unsigned int n_entries, const std::string &backend, unsigned int n_tasks) : fd(fd), aio(create_asyncio(n_entries, backend, n_tasks)) {}
+AsyncFileWriter::AsyncFileWriter(int fd, unsigned int n_entries, const std::string &backend, unsigned int n_tasks, std::shared_ptr<SharedEngine> shared_engine) : fd(fd), aio(shared_engine != nullptr ? shared_engine->attach() : create_asyncio(n_entries, backend, n_tasks, "/proc/self/fd/" + std::to_string(fd))), arbitrated(false) {}
 
 void AsyncFileWriter::write(size_t buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
 {
@@ -23,6 +23,20 @@ void AsyncFileWriter::sync_h2d()
     this->aio->sync_h2d();
 }
 
+void AsyncFileWriter::set_priority(const std::string &priority)
+{
+    this->aio->set_priority(WRITE, get_priority(priority));
+}
+
+void AsyncFileWriter::set_io_class(std::shared_ptr<IOArbiter> arbiter, const std::string &io_class)
+{
+    if (this->arbitrated)
+        throw std::runtime_error("The I/O class is already set");
+    this->aio->synchronize();
+    this->aio = new ArbitratedAsyncIO(this->aio, arbiter, io_class);
+    this->arbitrated = true;
+}
+
 void AsyncFileWriter::synchronize()
 {
     this->aio->synchronize();
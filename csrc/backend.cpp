@@ -4,6 +4,9 @@
 #include <cstring>
 #include <cassert>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "io_profile.h"
 
 #ifndef DISABLE_URING
 #include "uring.h"
@@ -110,20 +113,34 @@ void probe_asyncio(const std::string &backend)
     }
 }
 
-bool probe_backend(const std::string &backend)
+bool probe_backend(const std::string &backend, bool cached)
 {
     std::unordered_set<std::string> backends = get_backends();
     if (backends.find(backend) == backends.end())
         return false;
+    // every engine used to probe its backend with a tmpfile round trip, now only the first one does
+    static std::mutex mtx;
+    static std::unordered_map<std::string, bool> probed;
+    if (cached)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = probed.find(backend);
+        if (it != probed.end())
+            return it->second;
+    }
+    bool ok;
     try
     {
         probe_asyncio(backend);
-        return true;
+        ok = true;
     }
     catch (...)
     {
-        return false;
+        ok = false;
     }
+    std::lock_guard<std::mutex> lock(mtx);
+    probed[backend] = ok;
+    return ok;
 }
 
 std::string get_default_backend()
@@ -136,6 +153,17 @@ std::string get_default_backend()
     return std::string(env);
 }
 
+IOPriority get_priority(const std::string &name)
+{
+    if (name == "normal")
+        return PRIO_NORMAL;
+    if (name == "critical")
+        return PRIO_CRITICAL;
+    if (name == "bulk")
+        return PRIO_BULK;
+    throw std::runtime_error("Unknown priority: " + name);
+}
+
 bool get_debug_flag()
 {
     const char *env_ = getenv("TENSORNVME_DEBUG");
@@ -160,7 +188,15 @@ std::string get_debug_log()
     return std::string(env_);
 }
 
-AsyncIO *create_asyncio(unsigned int n_entries, std::string backend, unsigned int n_tasks)
+unsigned int get_n_entries(unsigned int n_entries, const std::string &path)
+{
+    if (n_entries > 0)
+        return n_entries;
+    std::optional<IOProfile> profile = find_io_profile(path);
+    return profile.has_value() ? profile->n_entries : default_n_entries;
+}
+
+AsyncIO *create_asyncio(unsigned int n_entries, std::string backend, unsigned int n_tasks, const std::string &path)
 {
     std::unordered_set<std::string> backends = get_backends();
     std::string default_backend = get_default_backend();
@@ -177,12 +213,38 @@ AsyncIO *create_asyncio(unsigned int n_entries, std::string backend, unsigned in
         }
         backend = default_backend;
     }
-    else if (backend.size() > 0)
+    if (backend.size() > 0 && backend != "auto")
     { // priority 2: backend is set
         if (backends.find(backend) == backends.end())
             throw std::runtime_error("Unsupported backend: " + backend);
     }
+    else
+    { // priority 3: backend of the device profile, or the first working one
+        std::optional<IOProfile> profile = find_io_profile(path);
+        if (profile.has_value() && probe_backend(profile->backend))
+            backend = profile->backend;
+        else
+        {
+            backend = "";
+            for (const char *candidate : {"uring", "aio", "pthread"})
+            {
+                if (probe_backend(candidate))
+                {
+                    backend = candidate;
+                    break;
+                }
+            }
+            if (backend.empty())
+                throw std::runtime_error("No asyncio backend works");
+        }
+        if (is_debugging)
+            std::cout << "[backend] auto backend is " << backend << std::endl;
+    }
+    return create_engine(backend, get_n_entries(n_entries, path), n_tasks);
+}
 
+AsyncIO *create_engine(const std::string &backend, unsigned int n_entries, unsigned int n_tasks)
+{
     if (!probe_backend(backend))
         throw std::runtime_error("Backend \"" + backend + "\" is not install correctly");
 
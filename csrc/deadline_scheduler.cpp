@@ -0,0 +1,72 @@
+#include <algorithm>
+#include "deadline_scheduler.h"
+
+DeadlineAsyncIO::DeadlineAsyncIO(AsyncIO *inner, unsigned int depth, double slack) : QueuedAsyncIO(inner), depth(std::max(depth, 1u)), slack(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(slack))), seq(0), n_deadlines(0), n_misses(0), max_lateness(0), total_lateness(0) {}
+
+DeadlineAsyncIO::~DeadlineAsyncIO()
+{
+    synchronize();
+}
+
+bool DeadlineAsyncIO::later(const Pending &a, const Pending &b)
+{
+    return a.due > b.due || (a.due == b.due && a.seq > b.seq);
+}
+
+void DeadlineAsyncIO::enqueue(Request request)
+{
+    clock::time_point due = request.has_deadline ? request.deadline : clock::now() + this->slack;
+    if (request.has_deadline)
+        this->n_deadlines++;
+    this->queue.push_back(Pending{std::move(request), due, this->seq++});
+    std::push_heap(this->queue.begin(), this->queue.end(), later);
+    dispatch();
+}
+
+void DeadlineAsyncIO::dispatch()
+{
+    while (this->n_inflight < this->depth && !this->queue.empty())
+    {
+        std::pop_heap(this->queue.begin(), this->queue.end(), later);
+        auto request = std::make_shared<Pending>(std::move(this->queue.back()));
+        this->queue.pop_back();
+        submit(request, [this, request]()
+               {
+                   finished(*request);
+                   dispatch(); });
+    }
+}
+
+void DeadlineAsyncIO::finished(const Pending &request)
+{
+    if (!request.has_deadline)
+        return;
+    clock::duration lateness = clock::now() - request.due;
+    if (lateness <= clock::duration::zero())
+        return;
+    this->n_misses++;
+    this->total_lateness += lateness;
+    this->max_lateness = std::max(this->max_lateness, lateness);
+}
+
+void DeadlineAsyncIO::wait()
+{
+    // a failed request leaves queued ones without a completion to submit them
+    if (this->n_inflight == 0)
+        dispatch();
+    this->inner->get_event(WAIT);
+}
+
+void DeadlineAsyncIO::drop(unsigned long long tag, std::vector<callback_t> &dropped)
+{
+    // a dropped request never misses its deadline
+    drop_queued(this->queue, tag, dropped);
+    std::make_heap(this->queue.begin(), this->queue.end(), later);
+}
+
+std::unordered_map<std::string, unsigned long long> DeadlineAsyncIO::stats() const
+{
+    auto us = [](clock::duration d)
+    { return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::microseconds>(d).count()); };
+    return {{"deadlines", this->n_deadlines}, {"misses", this->n_misses}, {"max_lateness_us", us(this->max_lateness)}, {"total_lateness_us", us(this->total_lateness)}};
+}
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include "depth_controller.h"
+
+// an epoch lasts at least this long and sees at least twice the depth in completions
+static const DepthController::clock::duration min_epoch = std::chrono::milliseconds(10);
+static const unsigned long long min_epoch_ops = 8;
+// an increase is kept while the throughput stays within this fraction of the last epoch
+static const double throughput_slack = 0.95;
+
+DepthController::DepthController(unsigned int max_depth, unsigned int min_depth, double latency_tolerance) : max_depth(std::max(max_depth, 1u)), min_depth(std::min(std::max(min_depth, 1u), std::max(max_depth, 1u))), latency_tolerance(std::max(latency_tolerance, 1.0)), cur_depth(std::max(this->min_depth, this->max_depth / 2)), cur_batch(1), base_latency(), last_throughput(0.0), last_latency(0.0), last_ratio(0.0), epoch_start(clock::now()), epoch_ops(0), epoch_bytes(0), epoch_latency(), epoch_count(), epoch_saturated(false), n_epochs(0), n_increases(0), n_decreases(0) {}
+
+unsigned int DepthController::depth() const
+{
+    return this->cur_depth;
+}
+
+unsigned int DepthController::batch() const
+{
+    return this->cur_batch;
+}
+
+void DepthController::saturated()
+{
+    this->epoch_saturated = true;
+}
+
+int DepthController::bucket(unsigned long long bytes)
+{
+    int b = 0;
+    while (bytes > 1 && b < n_buckets - 1)
+    {
+        bytes >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void DepthController::completed(unsigned long long bytes, clock::duration latency, clock::time_point now)
+{
+    int b = bucket(bytes);
+    this->epoch_ops++;
+    this->epoch_bytes += bytes;
+    this->epoch_latency[b] += std::chrono::duration<double>(latency).count();
+    this->epoch_count[b]++;
+    if (this->epoch_ops >= std::max(min_epoch_ops, 2ULL * this->cur_depth) && now - this->epoch_start >= min_epoch)
+        adjust(now);
+}
+
+void DepthController::adjust(clock::time_point now)
+{
+    double throughput = this->epoch_bytes / std::chrono::duration<double>(now - this->epoch_start).count();
+    double total_latency = 0.0, total_ratio = 0.0;
+    for (int b = 0; b < n_buckets; b++)
+    {
+        if (this->epoch_count[b] == 0)
+            continue;
+        double latency = this->epoch_latency[b] / this->epoch_count[b];
+        double &base = this->base_latency[b];
+        if (base <= 0.0 || latency < base)
+            base = latency;
+        else
+            base += (latency - base) / 32;
+        total_latency += this->epoch_latency[b];
+        total_ratio += this->epoch_count[b] * (base > 0.0 ? latency / base : 1.0);
+    }
+    // how much slower than usual the requests of the epoch were for their sizes
+    double ratio = total_ratio / this->epoch_ops;
+    this->n_epochs++;
+    if (ratio > this->latency_tolerance)
+    {
+        // requests queue in the device instead of being served faster
+        unsigned int cut = std::max(1u, this->cur_depth / 4);
+        this->cur_depth = this->cur_depth > this->min_depth + cut ? this->cur_depth - cut : this->min_depth;
+        this->cur_batch = std::max(1u, this->cur_batch / 2);
+        this->n_decreases++;
+    }
+    else if (this->epoch_saturated && throughput >= this->last_throughput * throughput_slack)
+    {
+        if (this->cur_depth < this->max_depth)
+        {
+            this->cur_depth++;
+            this->n_increases++;
+        }
+        this->cur_batch++;
+    }
+    // half of the slots stay free for single submissions between batches
+    this->cur_batch = std::min(this->cur_batch, std::max(1u, this->cur_depth / 2));
+    this->last_throughput = throughput;
+    this->last_latency = total_latency / this->epoch_ops;
+    this->last_ratio = ratio;
+    this->epoch_start = now;
+    this->epoch_ops = 0;
+    this->epoch_bytes = 0;
+    std::fill(this->epoch_latency, this->epoch_latency + n_buckets, 0.0);
+    std::fill(this->epoch_count, this->epoch_count + n_buckets, 0ULL);
+    this->epoch_saturated = false;
+}
+
+std::unordered_map<std::string, unsigned long long> DepthController::stats() const
+{
+    auto us = [](double seconds)
+    { return static_cast<unsigned long long>(seconds * 1e6); };
+    return {{"depth", this->cur_depth}, {"batch", this->cur_batch}, {"min_depth", this->min_depth}, {"max_depth", this->max_depth}, {"epochs", this->n_epochs}, {"increases", this->n_increases}, {"decreases", this->n_decreases}, {"bytes_per_sec", static_cast<unsigned long long>(this->last_throughput)}, {"latency_us", us(this->last_latency)}, {"latency_ratio_pct", static_cast<unsigned long long>(this->last_ratio * 100)}};
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdexcept>
+#include "disk_offloader.h"
+
+DiskOffloader::DiskOffloader(const std::string &filename, unsigned int n_entries, const std::string &backend, bool retain, std::shared_ptr<HostArena> arena, bool thread_safe, std::shared_ptr<SharedEngine> shared_engine) : Offloader(filename, n_entries, backend, false, retain, thread_safe, shared_engine), arena(arena)
+{
+    this->prefetch_alloc = [this](const at::Tensor &tensor)
+    { allocate(tensor); };
+    this->prefetch_free = &DiskOffloader::release;
+}
+
+std::string DiskOffloader::key(const at::Tensor &tensor)
+{
+    char buf[20];
+    snprintf(buf, sizeof(buf), "%p", static_cast<void *>(tensor.storage().unsafeGetStorageImpl()));
+    return std::string(buf);
+}
+
+std::string DiskOffloader::key(const std::vector<at::Tensor> &tensors)
+{
+    std::string result;
+    for (const at::Tensor &tensor : tensors)
+    {
+        if (!result.empty())
+            result.push_back(',');
+        result += key(tensor);
+    }
+    return result;
+}
+
+std::vector<std::string> DiskOffloader::keys(const std::vector<at::Tensor> &tensors)
+{
+    std::vector<std::string> result;
+    result.reserve(tensors.size());
+    for (const at::Tensor &tensor : tensors)
+        result.push_back(key(tensor));
+    return result;
+}
+
+void DiskOffloader::allocate(const at::Tensor &tensor)
+{
+    allocate(tensor, this->arena.get());
+}
+
+void DiskOffloader::allocate(const at::Tensor &tensor, HostArena *arena)
+{
+    at::Storage storage = tensor.storage();
+    if (storage.nbytes() != 0)
+        return;
+    if (arena != nullptr)
+    {
+        arena->acquire(tensor);
+        return;
+    }
+    size_t bytes = tensor.numel() * tensor.element_size();
+    storage.set_data_ptr(c10::GetCPUAllocator()->allocate(bytes));
+    storage.set_nbytes(bytes);
+}
+
+void DiskOffloader::check_allocated(const at::Tensor &tensor)
+{
+    if (tensor.storage().nbytes() == 0)
+        throw std::runtime_error("Write error, storage of the tensor is empty");
+}
+
+void DiskOffloader::release(const at::Tensor &tensor)
+{
+    // arena buffers go back to their arena through the deleter of the old data pointer
+    at::Storage storage = tensor.storage();
+    storage.set_data_ptr(at::DataPtr(nullptr, at::Device(at::kCPU)));
+    storage.set_nbytes(0);
+}
+
+callback_t DiskOffloader::release_callback(const at::Tensor &tensor, callback_t callback)
+{
+    return [tensor, callback]()
+    {
+        release(tensor);
+        if (callback != nullptr)
+            callback();
+    };
+}
+
+callback_t DiskOffloader::release_callback(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    return [tensors, callback]()
+    {
+        for (const at::Tensor &tensor : tensors)
+            release(tensor);
+        if (callback != nullptr)
+            callback();
+    };
+}
+
+void DiskOffloader::async_write(const at::Tensor &tensor, callback_t callback)
+{
+    check_allocated(tensor);
+    Offloader::async_write(tensor, key(tensor), release_callback(tensor, callback));
+}
+
+void DiskOffloader::async_read(const at::Tensor &tensor, callback_t callback)
+{
+    allocate(tensor);
+    Offloader::async_read(tensor, key(tensor), callback);
+}
+
+void DiskOffloader::sync_write(const at::Tensor &tensor)
+{
+    check_allocated(tensor);
+    Offloader::sync_write(tensor, key(tensor));
+    release(tensor);
+}
+
+void DiskOffloader::sync_read(const at::Tensor &tensor)
+{
+    allocate(tensor);
+    Offloader::sync_read(tensor, key(tensor));
+}
+
+void DiskOffloader::async_writev(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    for (const at::Tensor &tensor : tensors)
+        check_allocated(tensor);
+    Offloader::async_writev(tensors, key(tensors), release_callback(tensors, callback));
+}
+
+void DiskOffloader::async_readv(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    for (const at::Tensor &tensor : tensors)
+        allocate(tensor);
+    Offloader::async_readv(tensors, key(tensors), callback);
+}
+
+void DiskOffloader::sync_writev(const std::vector<at::Tensor> &tensors)
+{
+    for (const at::Tensor &tensor : tensors)
+        check_allocated(tensor);
+    Offloader::sync_writev(tensors, key(tensors));
+    for (const at::Tensor &tensor : tensors)
+        release(tensor);
+}
+
+void DiskOffloader::sync_readv(const std::vector<at::Tensor> &tensors)
+{
+    for (const at::Tensor &tensor : tensors)
+        allocate(tensor);
+    Offloader::sync_readv(tensors, key(tensors));
+}
+
+bool DiskOffloader::drop(const at::Tensor &tensor, callback_t callback)
+{
+    check_allocated(tensor);
+    return Offloader::drop(tensor, key(tensor), release_callback(tensor, callback));
+}
+
+bool DiskOffloader::dropv(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    for (const at::Tensor &tensor : tensors)
+        check_allocated(tensor);
+    return Offloader::dropv(tensors, key(tensors), release_callback(tensors, callback));
+}
+
+at::Tensor DiskOffloader::map(const at::Tensor &tensor, const std::string &advice, bool prefault)
+{
+    return Offloader::map(tensor, key(tensor), advice, prefault);
+}
+
+void DiskOffloader::erase(const at::Tensor &tensor)
+{
+    Offloader::erase(key(tensor));
+}
+
+std::vector<handle_t> DiskOffloader::async_write_batch(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    for (const at::Tensor &tensor : tensors)
+        check_allocated(tensor);
+    return Offloader::async_write_batch(tensors, keys(tensors), release_callback(tensors, callback));
+}
+
+void DiskOffloader::async_read_batch(const std::vector<at::Tensor> &tensors, callback_t callback)
+{
+    for (const at::Tensor &tensor : tensors)
+        allocate(tensor);
+    Offloader::async_read_batch(tensors, keys(tensors), callback);
+}
+
+std::vector<handle_t> DiskOffloader::sync_write_batch(const std::vector<at::Tensor> &tensors)
+{
+    for (const at::Tensor &tensor : tensors)
+        check_allocated(tensor);
+    std::vector<handle_t> handles = Offloader::sync_write_batch(tensors, keys(tensors));
+    for (const at::Tensor &tensor : tensors)
+        release(tensor);
+    return handles;
+}
+
+void DiskOffloader::sync_read_batch(const std::vector<at::Tensor> &tensors)
+{
+    for (const at::Tensor &tensor : tensors)
+        allocate(tensor);
+    Offloader::sync_read_batch(tensors, keys(tensors));
+}
@@ -0,0 +1,91 @@
+#include <stdexcept>
+#include "handle_table.h"
+
+HandleTable::HandleTable()
+{
+}
+
+HandleTable::~HandleTable()
+{
+}
+
+static inline uint32_t handle_index(handle_t handle)
+{
+    return static_cast<uint32_t>(handle & 0xffffffffULL);
+}
+
+static inline ull handle_generation(handle_t handle)
+{
+    return handle >> 32;
+}
+
+handle_t HandleTable::create(ull bytes)
+{
+    if (bytes > max_bytes)
+        throw std::runtime_error("Tensor is too large for a handle");
+    uint32_t index;
+    if (this->free_slots.empty())
+    {
+        if (this->entries.size() > 0xffffffffULL)
+            throw std::runtime_error("Too many handles");
+        index = static_cast<uint32_t>(this->entries.size());
+        this->entries.push_back(TensorEntry{0, 0, 0, 0});
+    }
+    else
+    {
+        index = this->free_slots.back();
+        this->free_slots.pop_back();
+    }
+    TensorEntry &entry = this->entries[index];
+    entry.offset = 0;
+    entry.bytes = bytes;
+    entry.flags = ENTRY_USED;
+    return slot_handle(index);
+}
+
+void HandleTable::remove(handle_t handle)
+{
+    TensorEntry &entry = get(handle);
+    // stale handles of this slot become invalid
+    entry.generation = (entry.generation + 1) & 0xffff;
+    entry.flags = 0;
+    this->free_slots.push_back(handle_index(handle));
+}
+
+bool HandleTable::contains(handle_t handle) const
+{
+    uint32_t index = handle_index(handle);
+    return index < this->entries.size() && (this->entries[index].flags & ENTRY_USED) && this->entries[index].generation == handle_generation(handle);
+}
+
+TensorEntry &HandleTable::get(handle_t handle)
+{
+    if (!contains(handle))
+        throw std::runtime_error("Invalid handle");
+    return this->entries[handle_index(handle)];
+}
+
+size_t HandleTable::size() const
+{
+    return this->entries.size() - this->free_slots.size();
+}
+
+size_t HandleTable::capacity() const
+{
+    return this->entries.size();
+}
+
+TensorEntry &HandleTable::slot(size_t index)
+{
+    return this->entries[index];
+}
+
+handle_t HandleTable::slot_handle(size_t index) const
+{
+    return (static_cast<ull>(this->entries[index].generation) << 32) | index;
+}
+
+size_t HandleTable::memory_bytes() const
+{
+    return this->entries.capacity() * sizeof(TensorEntry) + this->free_slots.capacity() * sizeof(uint32_t);
+}
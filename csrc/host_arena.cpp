@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <stdexcept>
+#include <string>
+#include "host_arena.h"
+
+HostArena::HostArena(size_t max_cached_bytes, bool hugepage, bool lock) : max_cached_bytes(max_cached_bytes), hugepage(hugepage), lock(lock), allocated(0), cached(0), hits(0), misses(0), lock_warned(false)
+{
+}
+
+HostArena::~HostArena()
+{
+    // blocks in use hold a reference to the arena, so only idle blocks are left here
+    for (auto &item : this->free_blocks)
+        for (Block *block : item.second)
+            unmap(block);
+}
+
+size_t HostArena::round_up(size_t bytes) const
+{
+    const size_t align = this->hugepage ? (2UL << 20) : 4096;
+    return (bytes + align - 1) / align * align;
+}
+
+HostArena::Block *HostArena::get(size_t bytes)
+{
+    size_t capacity = round_up(bytes);
+    {
+        std::lock_guard<std::mutex> guard(this->mtx);
+        auto iter = this->free_blocks.find(capacity);
+        if (iter != this->free_blocks.end() && !iter->second.empty())
+        {
+            Block *block = iter->second.back();
+            iter->second.pop_back();
+            this->cached -= capacity;
+            this->hits++;
+            return block;
+        }
+        this->misses++;
+    }
+    // pages are populated here, so that a recycled block never faults
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+    void *ptr = MAP_FAILED;
+    if (this->hugepage)
+        ptr = mmap(nullptr, capacity, prot, flags | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        // no reserved huge pages, fall back to transparent huge pages
+        ptr = mmap(nullptr, capacity, prot, flags, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw std::runtime_error("Arena error, mmap failed: " + std::string(strerror(errno)));
+        if (this->hugepage)
+            madvise(ptr, capacity, MADV_HUGEPAGE);
+    }
+    if (this->lock && mlock(ptr, capacity) != 0)
+    {
+        std::lock_guard<std::mutex> guard(this->mtx);
+        if (!this->lock_warned)
+            printf("Arena mlock error(%d): %s, buffers are not pinned, raise RLIMIT_MEMLOCK to fix it\n", errno, strerror(errno));
+        this->lock_warned = true;
+    }
+    std::lock_guard<std::mutex> guard(this->mtx);
+    this->allocated += capacity;
+    return new Block{ptr, capacity, nullptr};
+}
+
+void HostArena::put(Block *block)
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    if (this->max_cached_bytes > 0 && this->cached + block->capacity > this->max_cached_bytes)
+    {
+        this->allocated -= block->capacity;
+        unmap(block);
+        return;
+    }
+    this->free_blocks[block->capacity].push_back(block);
+    this->cached += block->capacity;
+}
+
+void HostArena::unmap(Block *block)
+{
+    munmap(block->ptr, block->capacity);
+    delete block;
+}
+
+void HostArena::deleter(void *ctx)
+{
+    Block *block = static_cast<Block *>(ctx);
+    // the arena may be destroyed when the last block comes back
+    std::shared_ptr<HostArena> owner = std::move(block->owner);
+    owner->put(block);
+}
+
+void HostArena::acquire(const at::Tensor &tensor)
+{
+    if (!tensor.is_cpu())
+        throw std::runtime_error("Tensor must be on cpu");
+    at::Storage storage = tensor.storage();
+    if (storage.nbytes() != 0)
+        throw std::runtime_error("Arena error, storage of the tensor is not empty");
+    size_t bytes = tensor.numel() * tensor.element_size();
+    if (bytes == 0)
+        return;
+    Block *block = get(bytes);
+    block->owner = shared_from_this();
+    storage.set_data_ptr(at::DataPtr(block->ptr, block, &HostArena::deleter, at::Device(at::kCPU)));
+    storage.set_nbytes(bytes);
+}
+
+void HostArena::release(const at::Tensor &tensor)
+{
+    at::Storage storage = tensor.storage();
+    // the old data pointer is dropped here, which returns its block through deleter()
+    storage.set_data_ptr(at::DataPtr(nullptr, at::Device(at::kCPU)));
+    storage.set_nbytes(0);
+}
+
+void HostArena::trim()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    for (auto &item : this->free_blocks)
+    {
+        for (Block *block : item.second)
+        {
+            this->allocated -= block->capacity;
+            unmap(block);
+        }
+    }
+    this->free_blocks.clear();
+    this->cached = 0;
+}
+
+size_t HostArena::allocated_bytes()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    return this->allocated;
+}
+
+size_t HostArena::cached_bytes()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    return this->cached;
+}
+
+unsigned long long HostArena::n_hits()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    return this->hits;
+}
+
+unsigned long long HostArena::n_misses()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    return this->misses;
+}
@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include "io_arbiter.h"
+
+// a bucket holds at most this much of its rate, so an idle class cannot save up a long burst
+static const double burst_seconds = 0.05;
+// a waiting class which did not ask again within this window is not waited for
+static const std::chrono::milliseconds active_window(10);
+static const std::chrono::microseconds min_retry(50), max_retry(10000);
+
+IOArbiter::TokenBucket::TokenBucket(double rate) : rate(rate), tokens(std::max(rate * burst_seconds, 1.0)), last(clock::now()) {}
+
+void IOArbiter::TokenBucket::refill(clock::time_point now)
+{
+    if (this->rate > 0)
+        this->tokens = std::min(this->tokens + std::chrono::duration<double>(now - this->last).count() * this->rate, std::max(this->rate * burst_seconds, 1.0));
+    this->last = now;
+}
+
+bool IOArbiter::TokenBucket::ready() const
+{
+    return this->rate == 0 || this->tokens > 0;
+}
+
+void IOArbiter::TokenBucket::take(double n)
+{
+    if (this->rate > 0)
+        this->tokens -= n;
+}
+
+IOArbiter::clock::duration IOArbiter::TokenBucket::until_ready() const
+{
+    if (ready())
+        return clock::duration::zero();
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-this->tokens / this->rate));
+}
+
+IOArbiter::IOArbiter(unsigned long long bytes_per_sec, unsigned long long iops, unsigned int max_inflight) : bytes(bytes_per_sec), ops(iops), max_inflight(max_inflight), n_inflight(0) {}
+
+void IOArbiter::add_class(const std::string &name, double weight, unsigned long long bytes_per_sec, unsigned long long iops)
+{
+    if (weight <= 0)
+        throw std::runtime_error("The weight of an I/O class must be positive");
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (const IOClass &cls : this->classes)
+    {
+        if (cls.name == name)
+            throw std::runtime_error("I/O class already exists: " + name);
+    }
+    this->classes.push_back(IOClass{name, weight, TokenBucket(bytes_per_sec), TokenBucket(iops), 0.0, false, clock::now(), 0, 0, 0, 0, clock::duration::zero(), clock::duration::zero(), clock::time_point(), clock::time_point()});
+}
+
+unsigned int IOArbiter::class_id(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    for (size_t i = 0; i < this->classes.size(); i++)
+    {
+        if (this->classes[i].name == name)
+            return i;
+    }
+    throw std::runtime_error("Unknown I/O class: " + name);
+}
+
+void IOArbiter::refill(IOClass &cls, clock::time_point now)
+{
+    this->bytes.refill(now);
+    this->ops.refill(now);
+    cls.bytes.refill(now);
+    cls.ops.refill(now);
+}
+
+bool IOArbiter::admit(unsigned int id, unsigned long long n_bytes)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    clock::time_point now = clock::now();
+    IOClass &cls = this->classes.at(id);
+    refill(cls, now);
+    if (cls.n_inflight == 0 && !cls.waiting)
+    {
+        // a class which was idle starts where the busy ones are, it did not save credit meanwhile
+        for (const IOClass &other : this->classes)
+        {
+            if (&other != &cls && (other.n_inflight > 0 || other.waiting))
+                cls.vtime = std::max(cls.vtime, other.vtime);
+        }
+    }
+    cls.last_seen = now;
+    bool ok = cls.bytes.ready() && cls.ops.ready() && this->bytes.ready() && this->ops.ready() && (this->max_inflight == 0 || this->n_inflight < this->max_inflight);
+    for (size_t i = 0; ok && i < this->classes.size(); i++)
+    {
+        // a class which waits for the device and got less than its share goes first
+        const IOClass &other = this->classes[i];
+        if (&other != &cls && other.waiting && now - other.last_seen < active_window && other.bytes.ready() && other.ops.ready() && other.vtime < cls.vtime)
+            ok = false;
+    }
+    cls.waiting = !ok;
+    if (!ok)
+        return false;
+    this->bytes.take(n_bytes);
+    this->ops.take(1);
+    cls.bytes.take(n_bytes);
+    cls.ops.take(1);
+    cls.vtime += n_bytes / cls.weight;
+    this->n_inflight++;
+    cls.n_inflight++;
+    if (cls.first_admit == clock::time_point())
+        cls.first_admit = now;
+    return true;
+}
+
+void IOArbiter::done(unsigned int id, unsigned long long n_bytes, clock::duration latency, bool throttled)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    IOClass &cls = this->classes.at(id);
+    this->n_inflight--;
+    cls.n_inflight--;
+    if (n_bytes == 0)
+        return;
+    cls.n_ops++;
+    cls.n_bytes += n_bytes;
+    if (throttled)
+        cls.n_throttled++;
+    cls.total_latency += latency;
+    cls.max_latency = std::max(cls.max_latency, latency);
+    cls.last_done = clock::now();
+}
+
+IOArbiter::clock::duration IOArbiter::retry_after(unsigned int id)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    IOClass &cls = this->classes.at(id);
+    refill(cls, clock::now());
+    clock::duration wait = std::max({this->bytes.until_ready(), this->ops.until_ready(), cls.bytes.until_ready(), cls.ops.until_ready()});
+    // slots and the fair share are given back by completions of other engines, which are not seen here
+    return std::min(std::max(wait, std::chrono::duration_cast<clock::duration>(min_retry)), std::chrono::duration_cast<clock::duration>(max_retry));
+}
+
+std::unordered_map<std::string, std::unordered_map<std::string, unsigned long long>> IOArbiter::stats()
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto us = [](clock::duration d)
+    { return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::microseconds>(d).count()); };
+    std::unordered_map<std::string, std::unordered_map<std::string, unsigned long long>> stats;
+    for (const IOClass &cls : this->classes)
+    {
+        double seconds = std::chrono::duration<double>(cls.last_done - cls.first_admit).count();
+        stats[cls.name] = {
+            {"ops", cls.n_ops},
+            {"bytes", cls.n_bytes},
+            {"throttled", cls.n_throttled},
+            {"inflight", cls.n_inflight},
+            {"bytes_per_sec", seconds > 0 ? static_cast<unsigned long long>(cls.n_bytes / seconds) : 0},
+            {"avg_latency_us", cls.n_ops > 0 ? us(cls.total_latency) / cls.n_ops : 0},
+            {"max_latency_us", us(cls.max_latency)},
+        };
+    }
+    return stats;
+}
+
+ArbitratedAsyncIO::ArbitratedAsyncIO(AsyncIO *inner, std::shared_ptr<IOArbiter> arbiter, const std::string &io_class) : QueuedAsyncIO(inner), arbiter(arbiter), id(arbiter->class_id(io_class)) {}
+
+ArbitratedAsyncIO::~ArbitratedAsyncIO()
+{
+    synchronize();
+}
+
+void ArbitratedAsyncIO::enqueue(Request request)
+{
+    this->queue.push_back(Pending{std::move(request), clock::now(), false});
+    pump();
+}
+
+void ArbitratedAsyncIO::pump()
+{
+    while (!this->queue.empty())
+    {
+        if (!this->arbiter->admit(this->id, this->queue.front().bytes))
+        {
+            this->queue.front().throttled = true;
+            return;
+        }
+        auto request = std::make_shared<Pending>(std::move(this->queue.front()));
+        this->queue.pop_front();
+        start(request);
+    }
+}
+
+void ArbitratedAsyncIO::start(std::shared_ptr<Pending> request)
+{
+    submit(request, [this, request]()
+           {
+               this->arbiter->done(this->id, request->bytes, clock::now() - request->issued_at, request->throttled);
+               pump(); });
+}
+
+void ArbitratedAsyncIO::settle(const Request &request, bool landed)
+{
+    QueuedAsyncIO::settle(request, landed);
+    if (!landed)
+        this->arbiter->done(this->id, 0, clock::duration::zero(), false);
+}
+
+void ArbitratedAsyncIO::wait()
+{
+    pump();
+    if (this->n_inflight > 0)
+    {
+        this->inner->get_event(WAIT);
+        return;
+    }
+    if (this->queue.empty())
+        return;
+    std::this_thread::sleep_for(this->arbiter->retry_after(this->id));
+    pump();
+}
+
+void ArbitratedAsyncIO::drop(unsigned long long tag, std::vector<callback_t> &dropped)
+{
+    drop_queued(this->queue, tag, dropped);
+}
+
+void ArbitratedAsyncIO::get_event(WaitType wt)
+{
+    if (wt == WAIT)
+    {
+        wait();
+        return;
+    }
+    pump();
+    this->inner->get_event(NOWAIT);
+}
+
+void ArbitratedAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned)
+{
+    // host-to-device bookkeeping happens when the engine takes the tensor, so it is not left in the queue
+    while (!this->queue.empty())
+        wait();
+    Request tensor_write = make_request(
+        WRITE, static_cast<unsigned long long>(t.numel() * t.element_size()), nullptr, [this, fd, t, offset, pinned](callback_t done)
+        { this->inner->write_tensor(fd, t, offset, done, pinned); },
+        callback);
+    auto request = std::make_shared<Pending>(Pending{std::move(tensor_write), clock::now(), false});
+    while (!this->arbiter->admit(this->id, request->bytes))
+    {
+        request->throttled = true;
+        wait();
+    }
+    this->n_writes++;
+    start(request);
+}
@@ -0,0 +1,75 @@
+#include "io_lanes.h"
+
+LanedAsyncIO::LanedAsyncIO(AsyncIO *inner, unsigned int max_writes) : QueuedAsyncIO(inner), max_writes(max_writes), n_critical_reads(0), n_held(0) {}
+
+LanedAsyncIO::~LanedAsyncIO()
+{
+    synchronize();
+}
+
+bool LanedAsyncIO::critical(const Request &request)
+{
+    return request.type == READ && request.priority != PRIO_BULK;
+}
+
+void LanedAsyncIO::enqueue(Request request)
+{
+    if (request.type == READ)
+    {
+        if (critical(request))
+            this->n_critical_reads++;
+        submit(std::make_shared<Request>(std::move(request)), [this]()
+               { release_writes(); });
+        return;
+    }
+    // reads are never held, so the other requests in flight are writes
+    if (!this->held.empty() || (this->max_writes > 0 && this->n_critical_reads > 0 && this->n_inflight - this->n_reads >= this->max_writes))
+    {
+        this->held.push_back(std::move(request));
+        this->n_held++;
+        return;
+    }
+    submit(std::make_shared<Request>(std::move(request)), [this]()
+           { release_writes(); });
+}
+
+void LanedAsyncIO::settle(const Request &request, bool landed)
+{
+    QueuedAsyncIO::settle(request, landed);
+    if (critical(request))
+        this->n_critical_reads--;
+}
+
+void LanedAsyncIO::wait()
+{
+    // a failed request leaves held writes without a completion to release them
+    release_writes();
+    this->inner->get_event(WAIT);
+}
+
+void LanedAsyncIO::release_writes()
+{
+    while (!this->held.empty() && (this->max_writes == 0 || this->n_critical_reads == 0 || this->n_inflight - this->n_reads < this->max_writes))
+    {
+        auto write = std::make_shared<Request>(std::move(this->held.front()));
+        this->held.pop_front();
+        submit(write, [this]()
+               { release_writes(); });
+    }
+}
+
+void LanedAsyncIO::drop(unsigned long long tag, std::vector<callback_t> &dropped)
+{
+    drop_queued(this->held, tag, dropped);
+}
+
+void LanedAsyncIO::set_max_writes(unsigned int max_writes)
+{
+    this->max_writes = max_writes;
+    release_writes();
+}
+
+unsigned long long LanedAsyncIO::held_writes() const
+{
+    return this->n_held;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include "backend.h"
+#include "io_profile.h"
+
+std::string get_profile_path()
+{
+    const char *env = getenv("TENSORNVME_PROFILE");
+    if (env != nullptr && env[0] != '\0')
+        return std::string(env);
+    const char *cache = getenv("XDG_CACHE_HOME");
+    if (cache != nullptr && cache[0] != '\0')
+        return std::string(cache) + "/tensornvme/profile";
+    const char *home = getenv("HOME");
+    return std::string(home != nullptr ? home : ".") + "/.cache/tensornvme/profile";
+}
+
+// "major:minor" of the device holding path, or of the directory path will be created in
+static bool device_of(const std::string &path, std::string &device)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        size_t pos = path.rfind('/');
+        std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+        if (stat(dir.c_str(), &st) != 0)
+            return false;
+    }
+    device = std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+    return true;
+}
+
+// one line per device: "device <major:minor> backend=<b> n_entries=<n> chunk_bytes=<n> write_bytes_per_sec=<x>
+// read_bytes_per_sec=<x> path=<path>", the path is last as it may hold spaces
+static std::unordered_map<std::string, IOProfile> read_profiles(const std::string &file)
+{
+    std::unordered_map<std::string, IOProfile> profiles;
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string word, device;
+        if (!(fields >> word) || word != "device" || !(fields >> device))
+            continue;
+        IOProfile profile{"", "", 0, 0, 0.0, 0.0};
+        while (fields >> word)
+        {
+            size_t eq = word.find('=');
+            if (eq == std::string::npos)
+                continue;
+            std::string key = word.substr(0, eq), value = word.substr(eq + 1);
+            if (key == "path")
+            {
+                std::string rest;
+                std::getline(fields, rest);
+                profile.path = value + rest;
+                break;
+            }
+            if (key == "backend")
+                profile.backend = value;
+            else if (key == "n_entries")
+                profile.n_entries = std::stoul(value);
+            else if (key == "chunk_bytes")
+                profile.chunk_bytes = std::stoull(value);
+            else if (key == "write_bytes_per_sec")
+                profile.write_bytes_per_sec = std::stod(value);
+            else if (key == "read_bytes_per_sec")
+                profile.read_bytes_per_sec = std::stod(value);
+        }
+        // a line which is cut short or names no backend is ignored
+        if (profile.backend.empty() || profile.n_entries == 0)
+            continue;
+        profiles[device] = profile;
+    }
+    return profiles;
+}
+
+static std::mutex profiles_mtx;
+static bool profiles_loaded = false;
+static std::string profiles_file;
+static std::unordered_map<std::string, IOProfile> profiles;
+
+std::optional<IOProfile> find_io_profile(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(profiles_mtx);
+    std::string file = get_profile_path();
+    if (!profiles_loaded || file != profiles_file)
+    {
+        profiles = read_profiles(file);
+        profiles_file = file;
+        profiles_loaded = true;
+    }
+    if (path.empty())
+    {
+        if (profiles.size() == 1)
+            return profiles.begin()->second;
+        return std::nullopt;
+    }
+    std::string device;
+    if (!device_of(path, device))
+        return std::nullopt;
+    auto it = profiles.find(device);
+    if (it == profiles.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void save_io_profile(const IOProfile &profile)
+{
+    std::string device;
+    if (!device_of(profile.path, device))
+        throw std::runtime_error("Cannot stat " + profile.path + ": " + strerror(errno));
+    std::lock_guard<std::mutex> lock(profiles_mtx);
+    std::string file = get_profile_path();
+    std::unordered_map<std::string, IOProfile> saved = read_profiles(file);
+    saved[device] = profile;
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out)
+            throw std::runtime_error("Cannot write the profile " + tmp);
+        out << "# written by tensornvme tune\n";
+        for (const auto &item : saved)
+        {
+            const IOProfile &p = item.second;
+            out << "device " << item.first << " backend=" << p.backend << " n_entries=" << p.n_entries
+                << " chunk_bytes=" << p.chunk_bytes << " write_bytes_per_sec=" << static_cast<unsigned long long>(p.write_bytes_per_sec)
+                << " read_bytes_per_sec=" << static_cast<unsigned long long>(p.read_bytes_per_sec) << " path=" << p.path << "\n";
+        }
+        if (!out.flush())
+            throw std::runtime_error("Cannot write the profile " + tmp);
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+        throw std::runtime_error("Cannot write the profile " + file + ": " + strerror(errno));
+    // the next lookup reads the new file
+    profiles_loaded = false;
+}
+
+std::unordered_map<std::string, double> measure_engine(const std::string &path, const std::string &backend, unsigned int n_entries, unsigned long long request_bytes, unsigned long long total_bytes)
+{
+    if (n_entries == 0 || request_bytes == 0 || request_bytes % 4096 != 0)
+        throw std::runtime_error("request_bytes must be a positive multiple of 4096 and n_entries positive");
+    unsigned long long n_requests = std::max(1ULL, total_bytes / request_bytes);
+    std::string file = path + "/.tensornvme-tune";
+    // measure the device rather than the page cache where the file system allows it
+    bool direct = true;
+    int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0600);
+    if (fd < 0 && errno == EINVAL)
+    {
+        direct = false;
+        fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    }
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + file + ": " + strerror(errno));
+    void *buffer = nullptr;
+    if (posix_memalign(&buffer, 4096, request_bytes) != 0)
+    {
+        close(fd);
+        unlink(file.c_str());
+        throw std::runtime_error("Cannot allocate " + std::to_string(request_bytes) + " bytes");
+    }
+    memset(buffer, 0x5a, request_bytes);
+    std::unordered_map<std::string, double> result;
+    std::unique_ptr<AsyncIO> aio;
+    unsigned long long n_submitted = 0, n_done = 0;
+    auto fn = [&n_done]()
+    { n_done++; };
+    auto run = [&](IOType type)
+    {
+        n_submitted = n_done = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned long long i = 0; i < n_requests; i++)
+        {
+            while (n_submitted - n_done >= n_entries)
+                aio->get_event(WAIT);
+            if (type == WRITE)
+                aio->write(fd, buffer, request_bytes, i * request_bytes, fn);
+            else
+                aio->read(fd, buffer, request_bytes, i * request_bytes, fn);
+            n_submitted++;
+        }
+        while (n_done < n_submitted)
+            aio->get_event(WAIT);
+        if (type == WRITE)
+            fdatasync(fd);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return n_requests * request_bytes / std::max(elapsed.count(), 1e-9);
+    };
+    try
+    {
+        // the backend under test, whatever TENSORNVME_BACKEND says
+        aio.reset(create_engine(backend, n_entries, 0));
+        aio->register_file(fd);
+        result["write_bytes_per_sec"] = run(WRITE);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        result["read_bytes_per_sec"] = run(READ);
+    }
+    catch (...)
+    {
+        // callbacks refer to this frame, so every request must be reaped before the error is raised
+        while (aio != nullptr)
+        {
+            try
+            {
+                aio->synchronize();
+                break;
+            }
+            catch (const std::exception &e)
+            {
+                printf("%s\n", e.what());
+            }
+        }
+        aio.reset();
+        free(buffer);
+        close(fd);
+        unlink(file.c_str());
+        throw;
+    }
+    aio.reset();
+    free(buffer);
+    close(fd);
+    unlink(file.c_str());
+    result["direct"] = direct ? 1.0 : 0.0;
+    return result;
+}
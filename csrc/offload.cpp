@@ -11,10 +11,38 @@
 #include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <sys/uio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
 #include "backend.h"
+#include "io_profile.h"
 #include "offload.h"
 #include "space_mgr.h"
 
+// smallest chunk of a sync request, smaller requests are submitted as a whole
+static const ull sync_chunk_min_bytes = 256 << 10;
+// requests of a captured step which are issued closer than this are replayed as one group
+static const std::chrono::microseconds replay_batch_gap(50);
+
+// deadline of the requests which are issued while it lives
+struct DeadlineScope
+{
+    AsyncIO *aio;
+
+    DeadlineScope(AsyncIO *aio, double deadline) : aio(deadline >= 0 ? aio : nullptr)
+    {
+        if (this->aio != nullptr)
+            this->aio->set_deadline(deadline);
+    }
+    ~DeadlineScope()
+    {
+        if (this->aio != nullptr)
+            this->aio->set_deadline(-1);
+    }
+};
+
 iovec *tensors_to_iovec(const std::vector<at::Tensor> &tensors)
 {
     iovec *iovs = static_cast<iovec *>(calloc(tensors.size(), sizeof(iovec)));
@@ -26,96 +54,1562 @@ iovec *tensors_to_iovec(const std::vector<at::Tensor> &tensors)
     return iovs;
 }
 
-Offloader::Offloader(const std::string &filename, unsigned int n_entries, const std::string &backend) : filename(filename), space_mgr(SpaceManager(0))
+static ull tuned_chunk_bytes(const std::string &filename)
+{
+    std::optional<IOProfile> profile = find_io_profile(filename);
+    return profile.has_value() ? profile->chunk_bytes : 0;
+}
+
+// identifies offloaders in per-thread engine caches, addresses may be reused
+static std::atomic<unsigned long long> next_instance_id(1);
+
+Offloader::Offloader(const std::string &filename, unsigned int n_entries, const std::string &backend, bool persistent, bool retain, bool thread_safe, std::shared_ptr<SharedEngine> shared_engine) : filename(filename), persistent(persistent), retain(retain), n_entries(get_n_entries(n_entries, filename)), sync_chunk_bytes(tuned_chunk_bytes(filename)), thread_safe(thread_safe), backend(backend), shared_engine(shared_engine), instance_id(next_instance_id++), space_mgr(SpaceManager(0)), static_bytes(0), n_pending(0), epoch(0), mapped(std::make_shared<MappedExtents>()), prefault_busy(false), prefault_stop(false), compactor_stop(false), n_forwarded(0), n_merged(0), n_superseded(0), prefetch_budget(0), prefetch_bytes(0), prefetch_latency(0.0), n_prefetch_issued(0), n_prefetch_hits(0), n_prefetch_late(0), n_prefetch_wasted(0), layout_epoch(0), capturing(false), schedule_layout(0), replay_next(0), replay_plugged(false), n_replay_inflight(0), n_replayed(0), n_replay_fallbacks(0), n_replay_batches(0), read_priority(PRIO_NORMAL), write_priority(PRIO_NORMAL), lane_writes(0), lanes(nullptr), deadline_depth(0), deadline_slack(0), scheduler(nullptr), autotune_min_depth(0), autotune_tolerance(0), tuner(nullptr), next_tag(1), n_cancelled(0)
 {
-    this->aio = create_asyncio(n_entries, backend, 0);
     this->fd = open(filename.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    this->aio->register_file(fd);
+    // in thread-safe mode engines are created by the first call of each thread
+    this->aio = thread_safe ? nullptr : (shared_engine != nullptr ? shared_engine->attach() : create_asyncio(this->n_entries, backend, 0, filename));
+    if (this->aio != nullptr)
+        this->aio->register_file(fd);
+    if (persistent)
+        open_index();
+}
+
+void Offloader::open_index()
+{
+    this->index.reset(new OffloadIndex(this->filename + ".index"));
+    std::unordered_map<std::string, IndexEntry> entries;
+    if (!this->index->load(this->space_mgr, entries))
+    {
+        // data without an index is useless
+        if (ftruncate(this->fd, 0) != 0)
+            throw std::runtime_error("Open error, ftruncate failed: " + std::string(strerror(errno)));
+        this->index->checkpoint(this->space_mgr, entries);
+        return;
+    }
+    for (const auto &item : entries)
+    {
+        handle_t handle = this->handles.create(item.second.space_info.second);
+        TensorEntry &entry = this->handles.get(handle);
+        entry.offset = item.second.space_info.first;
+        entry.flags |= ENTRY_STORED;
+        this->tensors_info[item.first] = handle;
+        this->tensors_meta[item.first] = item.second.meta;
+    }
 }
 
 SpaceInfo Offloader::prepare_write(const at::Tensor &tensor, const std::string &key)
+{
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    SpaceInfo space_info = write_space(key, tensor.storage().nbytes(), tensor._version());
+    if (this->persistent)
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        this->tensors_meta[key] = TensorMeta{static_cast<int8_t>(tensor.scalar_type()), std::vector<int64_t>(tensor.sizes().begin(), tensor.sizes().end())};
+    }
+    return space_info;
+}
+
+SpaceInfo Offloader::prepare_read(const at::Tensor &tensor, const std::string &key)
+{
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    return read_space(key, tensor.storage().nbytes(), tensor._version());
+}
+
+void Offloader::async_write(const at::Tensor &tensor, const std::string &key, callback_t callback, double deadline)
+{
+    // a write which waits in the in-flight table is submitted later without the deadline
+    DeadlineScope scope(engine(), deadline);
+    if (this->thread_safe)
+    {
+        SpaceInfo space_info = prepare_write(tensor, key);
+        submit_write(tensor, space_info, persist_callback(key, space_info, callback));
+        return;
+    }
+    if (replay(WRITE, tensor, key, callback))
+        return;
+    invalidate_prefetch(key);
+    auto iter = this->inflight.find(key);
+    if (iter == this->inflight.end())
+    {
+        start_write(tensor, key, callback);
+        capture(WRITE, tensor, key, false);
+        return;
+    }
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    // overlapping writes of one extent may land in any order, wait for the requests in flight
+    InFlight &slot = iter->second;
+    callback_t superseded = slot.has_held ? slot.held_callback : nullptr;
+    if (slot.has_held)
+        this->n_superseded++;
+    slot.held = tensor;
+    slot.held_callback = callback;
+    slot.has_held = true;
+    if (superseded != nullptr)
+        superseded();
+    capture(WRITE, tensor, key, false);
+}
+
+void Offloader::async_read(const at::Tensor &tensor, const std::string &key, callback_t callback, double deadline)
+{
+    {
+        DeadlineScope scope(engine(), deadline);
+        if (this->thread_safe)
+        {
+            submit_read(tensor, prepare_read(tensor, key), callback);
+            return;
+        }
+        if (replay(READ, tensor, key, callback))
+            return;
+        if (!take_prefetch(tensor, key, callback) && !forward_read(tensor, key, callback) && !merge_read(tensor, key, callback))
+            start_read(tensor, key, callback);
+    }
+    // prefetches are not due with this read
+    learn(tensor, key);
+    capture(READ, tensor, key, false);
+}
+
+void Offloader::sync_write(const at::Tensor &tensor, const std::string &key)
+{
+    bool done = false;
+    // a key in flight takes the async path, which tries the schedule itself
+    if (!this->thread_safe && !this->inflight.count(key) && replay(WRITE, tensor, key, [&done]()
+                                                                   { done = true; }))
+    {
+        wait_until(done);
+        return;
+    }
+    if (!this->thread_safe)
+        invalidate_prefetch(key);
+    if (!this->thread_safe && this->inflight.count(key))
+    {
+        // captured as an async write followed by a wait
+        async_write(tensor, key, [&done]()
+                    { done = true; });
+        wait_until(done);
+        return;
+    }
+    SpaceInfo space_info = prepare_write(tensor, key);
+    write_now(tensor, space_info, persist_callback(key, space_info));
+    if (!this->thread_safe)
+        capture(WRITE, tensor, key, true);
+}
+
+void Offloader::sync_read(const at::Tensor &tensor, const std::string &key)
+{
+    if (this->thread_safe)
+    {
+        read_now(tensor, prepare_read(tensor, key));
+        return;
+    }
+    bool done = false;
+    if (replay(READ, tensor, key, [&done]()
+               { done = true; }))
+    {
+        wait_until(done);
+        return;
+    }
+    if (take_prefetch(tensor, key, [&done]()
+                      { done = true; }))
+        wait_until(done);
+    else if (!forward_read(tensor, key, nullptr))
+        read_now(tensor, prepare_read(tensor, key));
+    learn(tensor, key);
+    capture(READ, tensor, key, true);
+}
+
+void Offloader::start_write(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    SpaceInfo space_info = prepare_write(tensor, key);
+    // marked before the submission, which may reap the completion right away
+    this->inflight[key].writing = tensor;
+    try
+    {
+        submit_write(tensor, space_info, persist_callback(key, space_info, [this, key, callback]()
+                                                           { write_landed(key, callback); }),
+                     tag_request(WRITE, &key, 0, space_info));
+    }
+    catch (...)
+    {
+        this->inflight[key].writing = at::Tensor();
+        settle(key);
+        throw;
+    }
+}
+
+void Offloader::start_read(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    SpaceInfo space_info = prepare_read(tensor, key);
+    this->inflight[key].reading = tensor;
+    try
+    {
+        submit_read(tensor, space_info, [this, key, callback]()
+                    { read_landed(key, callback); },
+                    tag_request(READ, &key, 0, space_info, &tensor));
+    }
+    catch (...)
+    {
+        this->inflight[key].reading = at::Tensor();
+        settle(key);
+        throw;
+    }
+}
+
+void Offloader::write_landed(const std::string &key, callback_t callback)
+{
+    InFlight &slot = this->inflight.at(key);
+    slot.writing = at::Tensor();
+    std::vector<callback_t> after_write;
+    after_write.swap(slot.after_write);
+    for (callback_t &fn : after_write)
+        fn();
+    if (callback != nullptr)
+        callback();
+    settle(key);
+}
+
+void Offloader::read_landed(const std::string &key, callback_t callback)
+{
+    InFlight &slot = this->inflight.at(key);
+    at::Tensor source = slot.reading;
+    slot.reading = at::Tensor();
+    std::vector<std::pair<at::Tensor, callback_t>> after_read;
+    after_read.swap(slot.after_read);
+    for (auto &item : after_read)
+    {
+        memcpy(item.first.data_ptr(), source.data_ptr(), source.storage().nbytes());
+        complete(item.second);
+    }
+    if (callback != nullptr)
+        callback();
+    settle(key);
+}
+
+bool Offloader::forward_read(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    auto iter = this->inflight.find(key);
+    if (iter == this->inflight.end())
+        return false;
+    InFlight &slot = iter->second;
+    // the newest data of the key is the waiting write, else the write in flight
+    at::Tensor source = slot.has_held ? slot.held : slot.writing;
+    if (!source.defined())
+        return false;
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    if (tensor.storage().nbytes() != source.storage().nbytes())
+        throw std::runtime_error("Read error, tensor shape mismatch");
+    memcpy(tensor.data_ptr(), source.data_ptr(), source.storage().nbytes());
+    this->n_forwarded++;
+    callback_t dropped = nullptr;
+    if (slot.has_held && !this->retain)
+    {
+        // the read consumes the key, the waiting write is not needed anymore
+        dropped = slot.held_callback;
+        slot.held = at::Tensor();
+        slot.held_callback = nullptr;
+        slot.has_held = false;
+    }
+    if (!slot.has_held && slot.writing.defined())
+    {
+        // consume the key or record the clean version, a consumed extent is freed once the write lands
+        SpaceInfo space_info = read_space(key, slot.writing.storage().nbytes(), tensor._version());
+        if (this->retain)
+            complete();
+        else
+            slot.after_write.push_back([this, space_info]()
+                                       { release(space_info.first, space_info.second); });
+    }
+    if (callback != nullptr)
+        callback();
+    if (dropped != nullptr)
+        dropped();
+    return true;
+}
+
+bool Offloader::merge_read(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    // without retain the read in flight has consumed the key
+    if (!this->retain)
+        return false;
+    auto iter = this->inflight.find(key);
+    if (iter == this->inflight.end() || !iter->second.reading.defined())
+        return false;
+    prepare_read(tensor, key);
+    this->inflight.at(key).after_read.emplace_back(tensor, callback);
+    this->n_merged++;
+    return true;
+}
+
+void Offloader::settle(const std::string &key)
+{
+    auto iter = this->inflight.find(key);
+    if (iter == this->inflight.end())
+        return;
+    InFlight &slot = iter->second;
+    if (slot.writing.defined() || slot.reading.defined())
+        return;
+    if (!slot.has_held)
+    {
+        this->inflight.erase(iter);
+        return;
+    }
+    at::Tensor tensor = slot.held;
+    callback_t callback = slot.held_callback;
+    slot.held = at::Tensor();
+    slot.held_callback = nullptr;
+    slot.has_held = false;
+    start_write(tensor, key, callback);
+}
+
+void Offloader::start_recording()
+{
+    if (this->thread_safe)
+        throw std::runtime_error("Recording is not supported in thread-safe mode");
+    stop_prefetching();
+    this->predictor.start_recording();
+    this->record_start = std::chrono::steady_clock::now();
+}
+
+void Offloader::stop_recording(ull budget_bytes)
+{
+    this->predictor.stop_recording();
+    this->prefetch_budget = budget_bytes;
+}
+
+void Offloader::stop_prefetching()
+{
+    std::vector<std::string> keys;
+    for (const auto &item : this->prefetches)
+        keys.push_back(item.first);
+    for (const std::string &key : keys)
+    {
+        auto iter = this->prefetches.find(key);
+        if (iter != this->prefetches.end() && iter->second.waiters.empty())
+            waste_prefetch(key);
+    }
+    // reads waiting for prefetches and wasted buffers are settled by the completions
+    while (!this->prefetches.empty())
+        poll(true);
+    this->predictor.clear();
+    this->pattern_tensors.clear();
+}
+
+void Offloader::learn(const at::Tensor &tensor, const std::string &key)
+{
+    if (this->predictor.recording())
+    {
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->record_start).count();
+        this->predictor.record(key, tensor.storage().nbytes(), time);
+        this->pattern_tensors.push_back(tensor);
+        return;
+    }
+    if (!this->predictor.ready() || this->prefetch_alloc == nullptr)
+        return;
+    size_t expected = this->predictor.position();
+    long index = this->predictor.observe(key);
+    if (index < 0)
+        return;
+    // prefetches of accesses which were skipped over are wasted
+    std::vector<std::string> skipped;
+    for (const auto &item : this->prefetches)
+        if (!item.second.wasted && item.second.waiters.empty() && item.first != key && this->predictor.between(item.second.index, expected, index))
+            skipped.push_back(item.first);
+    for (const std::string &skipped_key : skipped)
+        waste_prefetch(skipped_key);
+    // read ahead far enough to cover the read time, twice for the variance
+    for (size_t next : this->predictor.upcoming(2 * this->prefetch_latency, 64))
+        if (!issue_prefetch(next))
+            break;
+}
+
+bool Offloader::peek_space(const std::string &key, ull bytes, SpaceInfo &space_info)
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    auto iter = this->tensors_info.find(key);
+    if (iter == this->tensors_info.end())
+        return false;
+    TensorEntry &entry = this->handles.get(iter->second);
+    if (!(entry.flags & ENTRY_STORED) || entry.bytes != bytes)
+        return false;
+    // the key is not consumed, the extent is kept in place until the read completes
+    space_info = SpaceInfo(entry.offset, static_cast<ull>(entry.bytes));
+    this->n_pending++;
+    return true;
+}
+
+bool Offloader::issue_prefetch(size_t index)
+{
+    const std::string &key = this->predictor.key(index);
+    const at::Tensor &tensor = this->pattern_tensors[index];
+    // only storages which are released can be filled without racing the caller
+    if (this->prefetches.count(key) || this->inflight.count(key) || tensor.storage().nbytes() != 0)
+        return true;
+    ull bytes = tensor.numel() * tensor.element_size();
+    if (this->prefetch_bytes + bytes > this->prefetch_budget)
+        return false;
+    SpaceInfo space_info;
+    if (!peek_space(key, bytes, space_info))
+        return true;
+    this->prefetch_alloc(tensor);
+    this->prefetches[key] = Prefetch{tensor, index, false, false, {}, std::chrono::steady_clock::now()};
+    this->prefetch_bytes += bytes;
+    this->n_prefetch_issued++;
+    ull tag = tag_request(READ, &key, 0, space_info);
+    // a prefetch leaves the key on disk until it is used
+    this->tagged[tag].consumed = false;
+    engine()->set_tag(tag);
+    engine()->read(this->fd, tensor.data_ptr(), space_info.second, space_info.first, [this, key, tag]()
+                   { untag(tag);
+                     prefetch_done(key); });
+    engine()->set_tag(0);
+    engine()->get_event(NOWAIT);
+    return true;
+}
+
+void Offloader::prefetch_done(const std::string &key)
+{
+    complete();
+    Prefetch &prefetch = this->prefetches.at(key);
+    prefetch.done = true;
+    double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - prefetch.issued_at).count();
+    this->prefetch_latency = this->prefetch_latency == 0.0 ? latency : 0.75 * this->prefetch_latency + 0.25 * latency;
+    if (prefetch.wasted)
+    {
+        at::Tensor tensor = prefetch.tensor;
+        this->prefetch_bytes -= tensor.storage().nbytes();
+        this->prefetches.erase(key);
+        this->prefetch_free(tensor);
+        return;
+    }
+    if (prefetch.waiters.empty())
+        return;
+    std::vector<callback_t> waiters;
+    waiters.swap(prefetch.waiters);
+    this->prefetch_bytes -= prefetch.tensor.storage().nbytes();
+    this->prefetches.erase(key);
+    for (callback_t &waiter : waiters)
+        waiter();
+}
+
+bool Offloader::take_prefetch(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    auto iter = this->prefetches.find(key);
+    if (iter == this->prefetches.end())
+        return false;
+    Prefetch &prefetch = iter->second;
+    if (prefetch.tensor.storage().unsafeGetStorageImpl() != tensor.storage().unsafeGetStorageImpl())
+    {
+        // read into another tensor, the recorded one is not used this time
+        if (!prefetch.wasted && prefetch.waiters.empty())
+            waste_prefetch(key);
+        return false;
+    }
+    if (prefetch.wasted)
+    {
+        // skipped over, but accessed before the read completed
+        prefetch.wasted = false;
+        this->n_prefetch_wasted--;
+    }
+    // consume the key or record the clean version like a plain read
+    SpaceInfo space_info = prepare_read(tensor, key);
+    if (prefetch.done)
+    {
+        this->n_prefetch_hits++;
+        this->prefetch_bytes -= prefetch.tensor.storage().nbytes();
+        this->prefetches.erase(iter);
+        read_done(space_info, callback);
+        return true;
+    }
+    // the extent of a consumed key is freed once the prefetch lands
+    this->n_prefetch_late++;
+    prefetch.waiters.push_back([this, space_info, callback]()
+                               { read_done(space_info, callback); });
+    return true;
+}
+
+void Offloader::waste_prefetch(const std::string &key)
+{
+    Prefetch &prefetch = this->prefetches.at(key);
+    this->n_prefetch_wasted++;
+    if (!prefetch.done)
+    {
+        prefetch.wasted = true;
+        return;
+    }
+    at::Tensor tensor = prefetch.tensor;
+    this->prefetch_bytes -= tensor.storage().nbytes();
+    this->prefetches.erase(key);
+    this->prefetch_free(tensor);
+}
+
+void Offloader::invalidate_prefetch(const std::string &key)
+{
+    if (this->prefetches.empty())
+        return;
+    // a write must not race the prefetch into its source
+    while (this->prefetches.count(key) && !this->prefetches.at(key).done)
+        poll(true);
+    auto iter = this->prefetches.find(key);
+    if (iter == this->prefetches.end())
+        return;
+    // the caller filled the buffer itself, it is not released
+    this->n_prefetch_wasted++;
+    this->prefetch_bytes -= iter->second.tensor.storage().nbytes();
+    this->prefetches.erase(iter);
+}
+
+std::unordered_map<std::string, ull> Offloader::prefetch_stats()
+{
+    return {
+        {"issued", this->n_prefetch_issued},
+        {"hits", this->n_prefetch_hits},
+        {"late", this->n_prefetch_late},
+        {"wasted", this->n_prefetch_wasted},
+        {"bytes", this->prefetch_bytes},
+    };
+}
+
+std::unordered_map<std::string, ull> Offloader::inflight_stats()
+{
+    return {
+        {"forwarded_reads", this->n_forwarded},
+        {"merged_reads", this->n_merged},
+        {"superseded_writes", this->n_superseded},
+        {"cancelled_requests", this->n_cancelled},
+    };
+}
+
+void Offloader::start_capture()
+{
+    if (this->thread_safe)
+        throw std::runtime_error("Capture is not supported in thread-safe mode");
+    if (!this->retain)
+        throw std::runtime_error("Capture requires retain mode, reads would free the captured extents");
+    stop_replay();
+    this->captured.clear();
+    this->capturing = true;
+}
+
+void Offloader::stop_capture()
+{
+    if (!this->capturing)
+        throw std::runtime_error("Capture is not started");
+    this->capturing = false;
+    std::vector<ReplayOp> ops;
+    ops.swap(this->captured);
+    if (ops.empty())
+        return;
+    std::unordered_map<std::string, size_t> last;
+    for (size_t i = 0; i < ops.size(); i++)
+        last[ops[i].key] = i;
+    {
+        // extents are resolved at the end, a key may have moved while the step was captured
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            ReplayOp &op = ops[i];
+            auto iter = this->tensors_info.find(op.key);
+            if (iter == this->tensors_info.end() || !(this->handles.get(iter->second).flags & ENTRY_STORED))
+                throw std::runtime_error("Capture error, tensor not found: " + op.key);
+            const TensorEntry &entry = this->handles.get(iter->second);
+            if (entry.bytes != op.space_info.second)
+                throw std::runtime_error("Capture error, tensor size changed: " + op.key);
+            op.space_info.first = entry.offset;
+            // the first request of a key depends on the last one of the previous step
+            op.after = last[op.key];
+            last[op.key] = i;
+        }
+        this->schedule_layout = this->layout_epoch;
+    }
+    ops.back().batch_end = true;
+    this->schedule.swap(ops);
+    this->replay_next = 0;
+}
+
+void Offloader::stop_replay()
+{
+    drain_replay();
+    this->schedule.clear();
+    this->replay_next = 0;
+}
+
+void Offloader::capture(IOType type, const at::Tensor &tensor, const std::string &key, bool sync)
+{
+    if (!this->capturing)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    // the caller computed between the two requests, the group ends here
+    if (!this->captured.empty() && now - this->capture_last > replay_batch_gap)
+        this->captured.back().batch_end = true;
+    this->captured.push_back(ReplayOp{type, key, SpaceInfo(0, tensor.storage().nbytes()), 0, sync, true});
+    this->capture_last = now;
+}
+
+void Offloader::capture_wait()
+{
+    if (this->capturing && !this->captured.empty())
+        this->captured.back().batch_end = true;
+}
+
+bool Offloader::replay(IOType type, const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    if (this->schedule.empty() || this->capturing)
+        return false;
+    if (this->layout_epoch != this->schedule_layout)
+    {
+        // an extent of the schedule moved or was freed, a new capture is needed
+        stop_replay();
+        this->n_replay_fallbacks++;
+        return false;
+    }
+    auto matches = [&](const ReplayOp &op)
+    {
+        return op.type == type && op.space_info.second == tensor.storage().nbytes() && op.key == key;
+    };
+    size_t n = this->schedule.size(), index = n;
+    if (this->replay_next < n && matches(this->schedule[this->replay_next]))
+        index = this->replay_next;
+    else if (matches(this->schedule[0]))
+        index = 0;
+    bool busy = this->inflight.count(key) || this->prefetches.count(key) || this->compactor.joinable() ||
+                (type == READ && (this->predictor.recording() || this->predictor.ready()));
+    if (index == n || busy)
+    {
+        // the normal path does not know the replayed requests in flight, they are finished first
+        drain_replay();
+        this->replay_next = index == n ? n : (index + 1) % n;
+        this->n_replay_fallbacks++;
+        return false;
+    }
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    ReplayOp &op = this->schedule[index];
+    if (!this->schedule[op.after].landed)
+        wait_until(this->schedule[op.after].landed);
+    AsyncIO *aio = engine();
+    if (!this->replay_plugged)
+    {
+        aio->plug();
+        this->replay_plugged = true;
+        this->n_replay_batches++;
+    }
+    op.landed = false;
+    this->n_pending++;
+    this->n_replay_inflight++;
+    ull tag = tag_request(type, &key, 0, op.space_info);
+    auto fn = [this, index, callback, tag]()
+    {
+        untag(tag);
+        this->schedule[index].landed = true;
+        this->n_replay_inflight--;
+        complete(callback);
+    };
+    aio->set_tag(tag);
+    try
+    {
+        if (type == WRITE)
+            aio->write(this->fd, tensor.data_ptr(), op.space_info.second, op.space_info.first, fn);
+        else
+            aio->read(this->fd, tensor.data_ptr(), op.space_info.second, op.space_info.first, fn);
+    }
+    catch (...)
+    {
+        aio->set_tag(0);
+        this->tagged.erase(tag);
+        op.landed = true;
+        this->n_pending--;
+        this->n_replay_inflight--;
+        throw;
+    }
+    aio->set_tag(0);
+    this->n_replayed++;
+    this->replay_next = (index + 1) % n;
+    if (op.batch_end)
+        flush_replay();
+    return true;
+}
+
+void Offloader::flush_replay()
+{
+    if (!this->replay_plugged)
+        return;
+    this->replay_plugged = false;
+    AsyncIO *aio = engine();
+    aio->unplug();
+    aio->get_event(NOWAIT);
+}
+
+void Offloader::drain_replay()
+{
+    flush_replay();
+    while (this->n_replay_inflight > 0)
+        engine()->get_event(WAIT);
+}
+
+std::unordered_map<std::string, ull> Offloader::replay_stats()
+{
+    return {{"replayed", this->n_replayed}, {"fallbacks", this->n_replay_fallbacks}, {"batches", this->n_replay_batches}, {"ops", this->schedule.size()}};
+}
+
+void Offloader::set_io_priority(const std::string &read_priority, const std::string &write_priority, unsigned int max_writes)
+{
+    IOPriority read = get_priority(read_priority), write = get_priority(write_priority);
+    if (this->thread_safe)
+    {
+        std::lock_guard<std::mutex> lock(this->engines_mtx);
+        if (!this->engines.empty())
+            throw std::runtime_error("Priorities must be set before the first request in thread-safe mode");
+        this->read_priority = read;
+        this->write_priority = write;
+        this->lane_writes = max_writes;
+        return;
+    }
+    if (max_writes > 0 && this->lanes == nullptr)
+    {
+        // the wrappers stack in the order of thread-safe mode, the lanes sit under the scheduler and the arbiter
+        if (this->scheduler != nullptr || this->arbiter != nullptr)
+            throw std::runtime_error("The lanes must be set before the deadline scheduler and the I/O class");
+        // the engine is wrapped while it is idle
+        flush_replay();
+        this->aio->synchronize();
+        this->lanes = new LanedAsyncIO(this->aio, max_writes);
+        this->aio = this->lanes;
+    }
+    this->read_priority = read;
+    this->write_priority = write;
+    this->lane_writes = max_writes;
+    this->aio->set_priority(READ, read);
+    this->aio->set_priority(WRITE, write);
+    if (this->lanes != nullptr)
+        this->lanes->set_max_writes(max_writes);
+}
+
+ull Offloader::held_writes()
+{
+    return this->lanes != nullptr ? this->lanes->held_writes() : 0;
+}
+
+void Offloader::set_deadline_scheduler(unsigned int depth, double slack)
+{
+    if (depth == 0)
+        depth = this->n_entries;
+    if (this->thread_safe)
+    {
+        std::lock_guard<std::mutex> lock(this->engines_mtx);
+        if (!this->engines.empty())
+            throw std::runtime_error("The deadline scheduler must be set before the first request in thread-safe mode");
+        this->deadline_depth = depth;
+        this->deadline_slack = slack;
+        return;
+    }
+    if (this->scheduler != nullptr)
+        throw std::runtime_error("The deadline scheduler is already set");
+    if (this->arbiter != nullptr)
+        throw std::runtime_error("The deadline scheduler must be set before the I/O class");
+    // the engine is wrapped while it is idle
+    flush_replay();
+    this->aio->synchronize();
+    this->scheduler = new DeadlineAsyncIO(this->aio, depth, slack);
+    this->aio = this->scheduler;
+    this->deadline_depth = depth;
+    this->deadline_slack = slack;
+}
+
+void Offloader::set_autotune(unsigned int min_depth, double latency_tolerance)
+{
+    min_depth = std::max(min_depth, 1u);
+    if (this->thread_safe)
+    {
+        std::lock_guard<std::mutex> lock(this->engines_mtx);
+        if (!this->engines.empty())
+            throw std::runtime_error("Autotuning must be set before the first request in thread-safe mode");
+        this->autotune_min_depth = min_depth;
+        this->autotune_tolerance = latency_tolerance;
+        return;
+    }
+    if (this->tuner != nullptr)
+        throw std::runtime_error("Autotuning is already set");
+    if (this->lanes != nullptr || this->scheduler != nullptr || this->arbiter != nullptr)
+        throw std::runtime_error("Autotuning must be set before the lanes, the deadline scheduler and the I/O class");
+    // the engine is wrapped while it is idle
+    flush_replay();
+    this->aio->synchronize();
+    this->tuner = new AdaptiveAsyncIO(this->aio, this->n_entries, min_depth, latency_tolerance);
+    this->aio = this->tuner;
+    this->autotune_min_depth = min_depth;
+    this->autotune_tolerance = latency_tolerance;
+}
+
+std::unordered_map<std::string, ull> Offloader::autotune_stats()
+{
+    if (this->tuner == nullptr)
+        return {};
+    return this->tuner->stats();
+}
+
+void Offloader::set_io_class(std::shared_ptr<IOArbiter> arbiter, const std::string &io_class)
+{
+    // fails early on an unknown class
+    arbiter->class_id(io_class);
+    if (this->thread_safe)
+    {
+        std::lock_guard<std::mutex> lock(this->engines_mtx);
+        if (!this->engines.empty())
+            throw std::runtime_error("The I/O class must be set before the first request in thread-safe mode");
+        this->arbiter = arbiter;
+        this->io_class = io_class;
+        return;
+    }
+    if (this->arbiter != nullptr)
+        throw std::runtime_error("The I/O class is already set");
+    // the engine is wrapped while it is idle
+    flush_replay();
+    this->aio->synchronize();
+    this->aio = new ArbitratedAsyncIO(this->aio, arbiter, io_class);
+    this->arbiter = arbiter;
+    this->io_class = io_class;
+}
+
+std::unordered_map<std::string, ull> Offloader::deadline_stats()
+{
+    if (this->scheduler == nullptr)
+        return {{"deadlines", 0}, {"misses", 0}, {"max_lateness_us", 0}, {"total_lateness_us", 0}};
+    return this->scheduler->stats();
+}
+
+ull Offloader::tag_request(IOType type, const std::string *key, handle_t handle, SpaceInfo space_info, const at::Tensor *tensor)
+{
+    if (this->thread_safe)
+        return 0;
+    ull tag = this->next_tag++;
+    TensorMeta meta{-1, {}};
+    if (tensor != nullptr)
+        meta = TensorMeta{static_cast<int8_t>(tensor->scalar_type()), std::vector<int64_t>(tensor->sizes().begin(), tensor->sizes().end())};
+    this->tagged[tag] = TaggedRequest{type, key != nullptr ? *key : std::string(), handle, key != nullptr, space_info, false, type == READ && !this->retain, std::move(meta)};
+    return tag;
+}
+
+bool Offloader::untag(ull tag)
+{
+    auto iter = this->tagged.find(tag);
+    if (iter == this->tagged.end())
+        return false;
+    TaggedRequest request = std::move(iter->second);
+    this->tagged.erase(iter);
+    if (!request.cancelled)
+        return false;
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    if (request.consumed)
+        return restore_read(request);
+    handle_t handle = request.handle;
+    if (request.by_key)
+    {
+        auto key_iter = this->tensors_info.find(request.key);
+        if (key_iter == this->tensors_info.end())
+            return false;
+        handle = key_iter->second;
+    }
+    else if (!this->handles.contains(handle))
+        return false;
+    if (request.type == READ)
+    {
+        // the tensor may differ from the on-disk copy
+        this->clean_versions.erase(handle);
+        return false;
+    }
+    // the extent holds a part of the data, unless the tensor was written elsewhere since
+    TensorEntry &entry = this->handles.get(handle);
+    if (!(entry.flags & ENTRY_STORED) || entry.offset != request.space_info.first || this->mapped->contains(entry.offset))
+        return false;
+    if (entry.offset >= this->static_bytes)
+        this->space_mgr.free(entry.offset, entry.bytes);
+    this->clean_versions.erase(handle);
+    if (request.by_key)
+    {
+        this->handles.remove(handle);
+        this->tensors_info.erase(request.key);
+        if (this->persistent)
+        {
+            this->tensors_meta.erase(request.key);
+            journal_del(request.key);
+        }
+    }
+    else
+        entry.flags &= ~static_cast<ull>(ENTRY_STORED);
+    this->epoch++;
+    this->layout_epoch++;
+    return false;
+}
+
+bool Offloader::restore_read(const TaggedRequest &request)
+{
+    // the destination was not filled, so the on-disk copy is the only one; it is given back to the key or the
+    // handle unless they were written again in the meantime, the extent is still held by the read
+    const SpaceInfo &space_info = request.space_info;
+    if (request.by_key)
+    {
+        if (this->tensors_info.count(request.key))
+            return false;
+        handle_t handle = this->handles.create(space_info.second);
+        TensorEntry &entry = this->handles.get(handle);
+        entry.offset = space_info.first;
+        entry.flags |= ENTRY_STORED;
+        this->tensors_info[request.key] = handle;
+        if (this->persistent)
+        {
+            this->tensors_meta[request.key] = request.meta;
+            journal_put(request.key, space_info);
+        }
+    }
+    else
+    {
+        if (!this->handles.contains(request.handle))
+            return false;
+        TensorEntry &entry = this->handles.get(request.handle);
+        if (entry.flags & ENTRY_STORED)
+            return false;
+        entry.offset = space_info.first;
+        entry.flags |= ENTRY_STORED;
+    }
+    this->epoch++;
+    return true;
+}
+
+unsigned int Offloader::cancel_tags(const std::function<bool(const TaggedRequest &)> &matches)
+{
+    if (this->thread_safe)
+        throw std::runtime_error("Cancellation is not supported in thread-safe mode");
+    // requests of an open replay group are handed to the kernel first
+    flush_replay();
+    std::vector<ull> tags;
+    for (auto &item : this->tagged)
+    {
+        if (!item.second.cancelled && matches(item.second))
+        {
+            item.second.cancelled = true;
+            tags.push_back(item.first);
+        }
+    }
+    this->n_cancelled += tags.size();
+    // requests which never reached the device complete here, their callbacks untag them
+    for (ull tag : tags)
+        engine()->cancel(tag);
+    return tags.size();
+}
+
+unsigned int Offloader::cancel(const std::string &key)
+{
+    if (this->thread_safe)
+        throw std::runtime_error("Cancellation is not supported in thread-safe mode");
+    unsigned int n_cancelled = 0;
+    auto prefetch = this->prefetches.find(key);
+    if (prefetch != this->prefetches.end() && !prefetch->second.wasted && prefetch->second.waiters.empty())
+        waste_prefetch(key);
+    callback_t dropped = nullptr;
+    auto slot = this->inflight.find(key);
+    if (slot != this->inflight.end() && slot->second.has_held)
+    {
+        dropped = slot->second.held_callback;
+        slot->second.held = at::Tensor();
+        slot->second.held_callback = nullptr;
+        slot->second.has_held = false;
+        this->n_cancelled++;
+        n_cancelled++;
+    }
+    n_cancelled += cancel_tags([&key](const TaggedRequest &request)
+                               { return request.by_key && request.key == key; });
+    if (dropped != nullptr)
+        dropped();
+    return n_cancelled;
+}
+
+unsigned int Offloader::cancel(handle_t handle)
+{
+    return cancel_tags([handle](const TaggedRequest &request)
+                       { return !request.by_key && request.handle == handle; });
+}
+
+unsigned int Offloader::cancel_all()
+{
+    if (this->thread_safe)
+        throw std::runtime_error("Cancellation is not supported in thread-safe mode");
+    std::vector<std::string> keys;
+    for (const auto &item : this->prefetches)
+        keys.push_back(item.first);
+    for (const auto &item : this->inflight)
+    {
+        if (item.second.has_held)
+            keys.push_back(item.first);
+    }
+    unsigned int n_cancelled = 0;
+    for (const std::string &key : keys)
+        n_cancelled += cancel(key);
+    return n_cancelled + cancel_tags([](const TaggedRequest &)
+                                     { return true; });
+}
+
+handle_t Offloader::register_tensor(const at::Tensor &tensor)
+{
+    return register_size(tensor.storage().nbytes());
+}
+
+handle_t Offloader::register_size(ull bytes)
+{
+    if (bytes == 0)
+        throw std::runtime_error("Invalid tensor size (0)");
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    return this->handles.create(bytes);
+}
+
+void Offloader::unregister(handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    TensorEntry &entry = this->handles.get(handle);
+    check_unmapped(entry, "Unregister");
+    if ((entry.flags & ENTRY_STORED) && entry.offset >= this->static_bytes)
+        this->space_mgr.free(entry.offset, entry.bytes);
+    this->handles.remove(handle);
+    this->clean_versions.erase(handle);
+    this->epoch++;
+    this->layout_epoch++;
+}
+
+SpaceInfo Offloader::prepare_write(const at::Tensor &tensor, handle_t handle)
 {
     if (!tensor.is_contiguous() || !tensor.is_cpu())
         throw std::runtime_error("Tensor must be contiguous and on cpu");
     ull bytes = tensor.storage().nbytes();
-    ull offset = this->space_mgr.alloc(bytes);
-    SpaceInfo space_info(offset, bytes);
-    this->tensors_info[key] = space_info;
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    if (bytes != this->handles.get(handle).bytes)
+        throw std::runtime_error("Write error, tensor size does not match the handle");
+    return place(handle, bytes, nullptr, tensor._version());
+}
+
+SpaceInfo Offloader::prepare_read(const at::Tensor &tensor, handle_t handle)
+{
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    ull bytes = tensor.storage().nbytes();
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    TensorEntry &entry = this->handles.get(handle);
+    if (!(entry.flags & ENTRY_STORED))
+        throw std::runtime_error("Read error, tensor not found");
+    if (bytes != entry.bytes)
+        throw std::runtime_error("Read error, tensor shape mismatch");
+    SpaceInfo space_info(entry.offset, static_cast<ull>(entry.bytes));
+    if (this->retain)
+        this->clean_versions[handle] = tensor._version();
+    else
+    {
+        // the handle stays registered, its extent is freed when the read is done
+        check_unmapped(entry, "Read");
+        entry.flags &= ~static_cast<ull>(ENTRY_STORED);
+    }
+    this->epoch++;
+    this->n_pending++;
     return space_info;
 }
 
-SpaceInfo Offloader::prepare_read(const at::Tensor &tensor, const std::string &key)
+void Offloader::async_write(const at::Tensor &tensor, handle_t handle, callback_t callback)
+{
+    SpaceInfo space_info = prepare_write(tensor, handle);
+    submit_write(tensor, space_info, callback, tag_request(WRITE, nullptr, handle, space_info));
+}
+
+void Offloader::async_read(const at::Tensor &tensor, handle_t handle, callback_t callback)
+{
+    SpaceInfo space_info = prepare_read(tensor, handle);
+    submit_read(tensor, space_info, callback, tag_request(READ, nullptr, handle, space_info, &tensor));
+}
+
+void Offloader::sync_write(const at::Tensor &tensor, handle_t handle)
+{
+    write_now(tensor, prepare_write(tensor, handle));
+}
+
+void Offloader::sync_read(const at::Tensor &tensor, handle_t handle)
+{
+    read_now(tensor, prepare_read(tensor, handle));
+}
+
+size_t Offloader::metadata_bytes()
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    // approximate size of the key map: buckets and nodes (next pointer, cached hash, key and handle)
+    size_t key_bytes = this->tensors_info.bucket_count() * sizeof(void *) + this->tensors_info.size() * (sizeof(std::pair<const std::string, handle_t>) + 2 * sizeof(void *));
+    for (const auto &item : this->tensors_info)
+    {
+        // keys longer than the small string buffer live on the heap
+        if (item.first.capacity() > 15)
+            key_bytes += item.first.capacity() + 1;
+    }
+    return key_bytes + this->handles.memory_bytes();
+}
+
+void Offloader::submit_write(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback, ull tag)
+{
+    callback_t fn = std::bind(&Offloader::complete, this, callback);
+    if (tag != 0)
+        // the tensor is discarded before the callbacks if the write was cancelled
+        fn = [this, tag, fn]()
+        { untag(tag);
+          fn(); };
+    AsyncIO *aio = engine();
+    aio->set_tag(tag);
+    try
+    {
+        aio->write(this->fd, tensor.data_ptr(), space_info.second, space_info.first, fn);
+    }
+    catch (...)
+    {
+        aio->set_tag(0);
+        this->tagged.erase(tag);
+        throw;
+    }
+    aio->set_tag(0);
+
+    aio->get_event(NOWAIT);
+}
+
+void Offloader::submit_read(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback, ull tag)
+{
+    callback_t fn = std::bind(&Offloader::read_done, this, space_info, callback);
+    if (tag != 0)
+        // a cancelled read gives its extent back to the key instead of releasing it
+        fn = [this, tag, fn, callback]()
+        {
+            if (untag(tag))
+                complete(callback);
+            else
+                fn();
+        };
+    AsyncIO *aio = engine();
+    aio->set_tag(tag);
+    try
+    {
+        aio->read(this->fd, tensor.data_ptr(), space_info.second, space_info.first, fn);
+    }
+    catch (...)
+    {
+        aio->set_tag(0);
+        this->tagged.erase(tag);
+        throw;
+    }
+    aio->set_tag(0);
+
+    aio->get_event(NOWAIT);
+}
+
+void Offloader::write_now(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback)
+{
+    iovec iov{tensor.data_ptr(), space_info.second};
+    transfer_now(WRITE, &iov, 1, space_info.first);
+    complete(callback);
+}
+
+void Offloader::read_now(const at::Tensor &tensor, SpaceInfo space_info)
+{
+    iovec iov{tensor.data_ptr(), space_info.second};
+    transfer_now(READ, &iov, 1, space_info.first);
+    read_done(space_info);
+}
+
+void Offloader::transfer_now(IOType type, const iovec *iov, unsigned int iovcnt, ull offset)
+{
+    // split the request into chunks which keep the whole queue busy, then wait for all of them
+    ull bytes = 0;
+    for (unsigned int i = 0; i < iovcnt; i++)
+        bytes += iov[i].iov_len;
+    ull chunk_bytes = (bytes + this->n_entries - 1) / this->n_entries;
+    chunk_bytes = std::max(sync_chunk_min_bytes, (chunk_bytes + 4095) / 4096 * 4096);
+    // larger requests are split by the block layer, and smaller ones leave the device idle between them
+    if (this->sync_chunk_bytes > 0)
+        chunk_bytes = this->sync_chunk_bytes;
+    flush_replay();
+    AsyncIO *aio = engine();
+    unsigned int n_submitted = 0, n_done = 0;
+    auto fn = [&n_done]()
+    { n_done++; };
+    try
+    {
+        for (unsigned int i = 0; i < iovcnt; i++)
+        {
+            char *buffer = static_cast<char *>(iov[i].iov_base);
+            for (ull done = 0; done < iov[i].iov_len; done += chunk_bytes)
+            {
+                while (n_submitted - n_done >= this->n_entries)
+                    aio->get_event(WAIT);
+                ull n_bytes = std::min(chunk_bytes, static_cast<ull>(iov[i].iov_len) - done);
+                if (type == WRITE)
+                    aio->write(this->fd, buffer + done, n_bytes, offset, fn);
+                else
+                    aio->read(this->fd, buffer + done, n_bytes, offset, fn);
+                offset += n_bytes;
+                n_submitted++;
+            }
+        }
+        while (n_done < n_submitted)
+            aio->get_event(WAIT);
+    }
+    catch (...)
+    {
+        // callbacks refer to this frame, so every chunk must be reaped before the error is raised
+        drain(aio);
+        throw;
+    }
+}
+
+static const int max_drain_attempts = 16;
+
+void Offloader::drain(AsyncIO *aio)
+{
+    // a failed synchronize still finishes what it reaped, so a few attempts settle every request; the errors
+    // are those of other requests of the failed transfer, which is reported by the caller
+    std::string error;
+    for (int attempt = 0; attempt < max_drain_attempts; attempt++)
+    {
+        try
+        {
+            aio->synchronize();
+            return;
+        }
+        catch (const std::exception &e)
+        {
+            error = e.what();
+        }
+    }
+    fprintf(stderr, "tensornvme: requests are still in flight after %d failed attempts to drain the engine: %s\n", max_drain_attempts, error.c_str());
+}
+
+void Offloader::submit_vec(IOType type, const std::vector<at::Tensor> &tensors, ull offset, callback_t callback)
+{
+    // a vector request takes at most IOV_MAX buffers, longer vectors are split into several requests
+    size_t n_parts = (tensors.size() + IOV_MAX - 1) / IOV_MAX;
+    callback_t fn = n_parts > 1 ? countdown(n_parts, callback) : callback;
+    AsyncIO *aio = engine();
+    aio->plug();
+    for (size_t begin = 0; begin < tensors.size(); begin += IOV_MAX)
+    {
+        size_t end = std::min(tensors.size(), begin + IOV_MAX);
+        iovec *iov = n_parts > 1 ? tensors_to_iovec(std::vector<at::Tensor>(tensors.begin() + begin, tensors.begin() + end)) : tensors_to_iovec(tensors);
+        if (type == WRITE)
+            aio->writev(this->fd, iov, end - begin, offset, fn);
+        else
+            aio->readv(this->fd, iov, end - begin, offset, fn);
+        for (size_t i = begin; i < end; i++)
+            offset += tensors[i].storage().nbytes();
+    }
+    aio->unplug();
+    aio->get_event(NOWAIT);
+}
+
+callback_t Offloader::countdown(size_t n, callback_t callback)
+{
+    // completions of one batch are reaped by the thread which submitted it, no atomics are needed
+    auto remaining = std::make_shared<size_t>(n);
+    return [remaining, callback]()
+    {
+        if (--*remaining == 0 && callback != nullptr)
+            callback();
+    };
+}
+
+std::vector<handle_t> Offloader::prepare_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, std::vector<SpaceInfo> &infos)
+{
+    if (tensors.size() != keys.size())
+        throw std::runtime_error("Batch error, tensors and keys have different lengths");
+    if (!this->thread_safe)
+        for (const std::string &key : keys)
+            invalidate_prefetch(key);
+    size_t n = tensors.size();
+    std::vector<ull> bytes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!tensors[i].is_contiguous() || !tensors[i].is_cpu())
+            throw std::runtime_error("Tensor must be contiguous and on cpu");
+        bytes[i] = tensors[i].storage().nbytes();
+    }
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    std::vector<handle_t> handles(n);
+    std::vector<bool> fresh(n);
+    std::vector<handle_t> created;
+    std::unordered_set<handle_t> seen;
+    ull total_bytes = 0;
+    try
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            auto iter = this->tensors_info.find(keys[i]);
+            if (iter == this->tensors_info.end())
+            {
+                handles[i] = this->handles.create(bytes[i]);
+                created.push_back(handles[i]);
+                this->tensors_info[keys[i]] = handles[i];
+            }
+            else
+                handles[i] = iter->second;
+            if (!seen.insert(handles[i]).second)
+                throw std::runtime_error("Batch error, duplicate key " + keys[i]);
+            const TensorEntry &entry = this->handles.get(handles[i]);
+            bool in_place = (entry.flags & ENTRY_STORED) && entry.bytes == bytes[i];
+            if (!in_place)
+                check_unmapped(entry, "Write");
+            auto planned = this->static_layout.find(keys[i]);
+            if (planned != this->static_layout.end() && planned->second.second != bytes[i])
+                throw std::runtime_error("Write error, tensor size does not match the planned layout");
+            fresh[i] = !in_place && planned == this->static_layout.end();
+            if (fresh[i])
+                total_bytes += bytes[i];
+        }
+    }
+    catch (...)
+    {
+        for (handle_t handle : created)
+            this->handles.remove(handle);
+        for (size_t i = 0; i < n; i++)
+        {
+            auto iter = this->tensors_info.find(keys[i]);
+            if (iter != this->tensors_info.end() && !this->handles.contains(iter->second))
+                this->tensors_info.erase(iter);
+        }
+        throw;
+    }
+    // new extents of the batch are carved from a single allocation, back to back
+    ull offset = total_bytes > 0 ? this->space_mgr.alloc(total_bytes) : 0;
+    infos.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        infos[i] = place(handles[i], bytes[i], &keys[i], tensors[i]._version(), fresh[i] ? &offset : nullptr);
+        if (fresh[i])
+            offset += bytes[i];
+        if (this->persistent)
+            this->tensors_meta[keys[i]] = TensorMeta{static_cast<int8_t>(tensors[i].scalar_type()), std::vector<int64_t>(tensors[i].sizes().begin(), tensors[i].sizes().end())};
+    }
+    return handles;
+}
+
+std::vector<SpaceInfo> Offloader::prepare_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys)
+{
+    if (tensors.size() != keys.size())
+        throw std::runtime_error("Batch error, tensors and keys have different lengths");
+    if (!this->thread_safe)
+        for (const std::string &key : keys)
+            invalidate_prefetch(key);
+    size_t n = tensors.size();
+    for (const at::Tensor &tensor : tensors)
+    {
+        if (!tensor.is_contiguous() || !tensor.is_cpu())
+            throw std::runtime_error("Tensor must be contiguous and on cpu");
+    }
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    // everything is checked before the first entry is changed, so a failed batch has no effect
+    std::vector<handle_t> handles(n);
+    std::unordered_set<handle_t> seen;
+    for (size_t i = 0; i < n; i++)
+    {
+        auto iter = this->tensors_info.find(keys[i]);
+        if (iter == this->tensors_info.end())
+            throw std::runtime_error("Read error, tensor not found");
+        handles[i] = iter->second;
+        if (!seen.insert(handles[i]).second)
+            throw std::runtime_error("Batch error, duplicate key " + keys[i]);
+        const TensorEntry &entry = this->handles.get(handles[i]);
+        if (!(entry.flags & ENTRY_STORED))
+            throw std::runtime_error("Read error, tensor not found");
+        if (tensors[i].storage().nbytes() != entry.bytes)
+            throw std::runtime_error("Read error, tensor shape mismatch");
+        if (!this->retain)
+            check_unmapped(entry, "Read");
+    }
+    std::vector<SpaceInfo> infos(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const TensorEntry &entry = this->handles.get(handles[i]);
+        infos[i] = SpaceInfo(entry.offset, static_cast<ull>(entry.bytes));
+        if (this->retain)
+        {
+            this->clean_versions[handles[i]] = tensors[i]._version();
+            continue;
+        }
+        this->handles.remove(handles[i]);
+        this->tensors_info.erase(keys[i]);
+        if (this->persistent)
+        {
+            this->tensors_meta.erase(keys[i]);
+            journal_del(keys[i]);
+        }
+    }
+    this->epoch++;
+    this->n_pending += n;
+    return infos;
+}
+
+std::vector<handle_t> Offloader::async_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, callback_t callback)
+{
+    std::vector<SpaceInfo> infos;
+    std::vector<handle_t> handles = prepare_write_batch(tensors, keys, infos);
+    if (tensors.empty())
+    {
+        if (callback != nullptr)
+            callback();
+        return handles;
+    }
+    callback_t done = countdown(tensors.size(), callback);
+    AsyncIO *aio = engine();
+    aio->plug();
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        auto fn = std::bind(&Offloader::complete, this, persist_callback(keys[i], infos[i], done));
+        aio->write(this->fd, tensors[i].data_ptr(), infos[i].second, infos[i].first, fn);
+    }
+    aio->unplug();
+    aio->get_event(NOWAIT);
+    return handles;
+}
+
+void Offloader::async_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, callback_t callback)
+{
+    std::vector<SpaceInfo> infos = prepare_read_batch(tensors, keys);
+    if (tensors.empty())
+    {
+        if (callback != nullptr)
+            callback();
+        return;
+    }
+    callback_t done = countdown(tensors.size(), callback);
+    AsyncIO *aio = engine();
+    aio->plug();
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        auto fn = std::bind(&Offloader::read_done, this, infos[i], done);
+        aio->read(this->fd, tensors[i].data_ptr(), infos[i].second, infos[i].first, fn);
+    }
+    aio->unplug();
+    aio->get_event(NOWAIT);
+}
+
+std::vector<handle_t> Offloader::sync_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys)
 {
-    if (!tensor.is_contiguous() || !tensor.is_cpu())
-        throw std::runtime_error("Tensor must be contiguous and on cpu");
-    if (this->tensors_info.find(key) == this->tensors_info.end())
-        throw std::runtime_error("Read error, tensor not found");
-    ull bytes = tensor.storage().nbytes();
-    SpaceInfo space_info = this->tensors_info[key];
-    if (bytes != space_info.second)
-        throw std::runtime_error("Read error, tensor shape mismatch");
-    this->tensors_info.erase(key);
-    return space_info;
+    bool done = false;
+    std::vector<handle_t> handles = async_write_batch(tensors, keys, [&done]()
+                                                      { done = true; });
+    wait_until(done);
+    return handles;
 }
 
-void Offloader::async_write(const at::Tensor &tensor, const std::string &key, callback_t callback)
+void Offloader::sync_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys)
 {
-    ull offset, bytes;
-    std::tie(offset, bytes) = prepare_write(tensor, key);
-    this->aio->write(this->fd, tensor.data_ptr(), bytes, offset, callback);
-
-    this->aio->get_event(NOWAIT);
+    bool done = false;
+    async_read_batch(tensors, keys, [&done]()
+                     { done = true; });
+    wait_until(done);
 }
 
-void Offloader::async_read(const at::Tensor &tensor, const std::string &key, callback_t callback)
+void Offloader::wait_until(const bool &done)
 {
-    ull offset, bytes;
-    std::tie(offset, bytes) = prepare_read(tensor, key);
-    auto fn = std::bind(&Offloader::release, this, offset, bytes, callback);
-    this->aio->read(this->fd, tensor.data_ptr(), bytes, offset, fn);
-
-    this->aio->get_event(NOWAIT);
+    flush_replay();
+    capture_wait();
+    AsyncIO *aio = engine();
+    try
+    {
+        while (!done)
+            aio->get_event(WAIT);
+    }
+    catch (...)
+    {
+        drain(aio);
+        throw;
+    }
 }
 
-void Offloader::sync_write(const at::Tensor &tensor, const std::string &key)
+void Offloader::sync_write_events()
 {
-    ull offset, bytes;
-    std::tie(offset, bytes) = prepare_write(tensor, key);
-    lseek(this->fd, offset, SEEK_SET);
-    write(this->fd, tensor.data_ptr(), bytes);
+    flush_replay();
+    capture_wait();
+    engine()->sync_write_events();
 }
 
-void Offloader::sync_read(const at::Tensor &tensor, const std::string &key)
+void Offloader::sync_read_events()
 {
-    ull offset, bytes;
-    std::tie(offset, bytes) = prepare_read(tensor, key);
-    lseek(this->fd, offset, SEEK_SET);
-    read(this->fd, tensor.data_ptr(), bytes);
-    release(offset, bytes);
+    flush_replay();
+    capture_wait();
+    engine()->sync_read_events();
 }
 
-void Offloader::sync_write_events()
+void Offloader::poll(bool wait)
 {
-    this->aio->sync_write_events();
+    flush_replay();
+    if (wait)
+        capture_wait();
+    engine()->get_event(wait ? WAIT : NOWAIT);
 }
 
-void Offloader::sync_read_events()
+bool Offloader::is_thread_safe() const
 {
-    this->aio->sync_read_events();
+    return this->thread_safe;
 }
 
 void Offloader::synchronize()
 {
-    this->aio->synchronize();
+    flush_replay();
+    capture_wait();
+    engine()->synchronize();
+    wait_prefaults();
+    if (this->persistent)
+    {
+        if (fdatasync(this->fd) != 0)
+            throw std::runtime_error("Sync error, fdatasync failed: " + std::string(strerror(errno)));
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        this->index->sync();
+    }
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(this->error_mtx);
+        error.swap(this->background_error);
+    }
+    if (!error.empty())
+        throw std::runtime_error(error);
 }
 
 Offloader::~Offloader()
 {
+    stop_compaction();
+    stop_prefaulting();
+    try
+    {
+        flush_replay();
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "tensornvme: %s\n", e.what());
+    }
+    if (!this->background_error.empty())
+        fprintf(stderr, "tensornvme: %s\n", this->background_error.c_str());
     errno = 0;
     delete this->aio;
+    for (auto &item : this->engines)
+        delete item.second;
+    if (this->persistent)
+    {
+        // keep the file and write a compact index for the next run
+        fdatasync(this->fd);
+        try
+        {
+            checkpoint_index();
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "tensornvme: %s\n", e.what());
+        }
+        close(this->fd);
+        return;
+    }
     close(this->fd);
     if (remove(this->filename.c_str()) != 0)
-        printf("Remove \"%s\" error(%d): %s\n", this->filename.c_str(), errno, strerror(errno));
+        fprintf(stderr, "tensornvme: Remove \"%s\" error(%d): %s\n", this->filename.c_str(), errno, strerror(errno));
 }
 
 SpaceInfo Offloader::prepare_writev(const std::vector<at::Tensor> &tensors, const std::string &key)
@@ -127,9 +1621,12 @@ SpaceInfo Offloader::prepare_writev(const std::vector<at::Tensor> &tensors, cons
             throw std::runtime_error("Tensor must be contiguous and on cpu");
         total_bytes += tensor.storage().nbytes();
     }
-    ull offset = this->space_mgr.alloc(total_bytes);
-    SpaceInfo space_info(offset, total_bytes);
-    this->tensors_info[key] = space_info;
+    SpaceInfo space_info = write_space(key, total_bytes, tensors_version(tensors));
+    if (this->persistent)
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        this->tensors_meta[key] = TensorMeta{-1, {}};
+    }
     return space_info;
 }
 
@@ -142,35 +1639,23 @@ SpaceInfo Offloader::prepare_readv(const std::vector<at::Tensor> &tensors, const
             throw std::runtime_error("Tensor must be contiguous and on cpu");
         total_bytes += tensor.storage().nbytes();
     }
-    if (this->tensors_info.find(key) == this->tensors_info.end())
-        throw std::runtime_error("Read error, tensor not found");
-    SpaceInfo space_info = this->tensors_info[key];
-    if (total_bytes != space_info.second)
-        throw std::runtime_error("Read error, tensor shape mismatch");
-    this->tensors_info.erase(key);
-    return space_info;
+    return read_space(key, total_bytes, tensors_version(tensors));
 }
 
 void Offloader::async_writev(const std::vector<at::Tensor> &tensors, const std::string &key, callback_t callback)
 {
     ull offset, bytes;
     std::tie(offset, bytes) = prepare_writev(tensors, key);
-    iovec *iov = tensors_to_iovec(tensors);
-    this->aio->writev(this->fd, iov, tensors.size(), offset, callback);
-
-    this->aio->get_event(NOWAIT);
+    auto fn = std::bind(&Offloader::complete, this, persist_callback(key, SpaceInfo(offset, bytes), callback));
+    submit_vec(WRITE, tensors, offset, fn);
 }
 
 void Offloader::async_readv(const std::vector<at::Tensor> &tensors, const std::string &key, callback_t callback)
 {
-
     ull offset, bytes;
     std::tie(offset, bytes) = prepare_readv(tensors, key);
-    iovec *iov = tensors_to_iovec(tensors);
-    auto fn = std::bind(&Offloader::release, this, offset, bytes, callback);
-    this->aio->readv(this->fd, iov, tensors.size(), offset, fn);
-
-    this->aio->get_event(NOWAIT);
+    auto fn = std::bind(&Offloader::read_done, this, SpaceInfo(offset, bytes), callback);
+    submit_vec(READ, tensors, offset, fn);
 }
 
 void Offloader::sync_writev(const std::vector<at::Tensor> &tensors, const std::string &key)
@@ -178,9 +1663,9 @@ void Offloader::sync_writev(const std::vector<at::Tensor> &tensors, const std::s
     ull offset, bytes;
     std::tie(offset, bytes) = prepare_writev(tensors, key);
     iovec *iov = tensors_to_iovec(tensors);
-    lseek(this->fd, offset, SEEK_SET);
-    writev(this->fd, iov, tensors.size());
-    delete iov;
+    transfer_now(WRITE, iov, tensors.size(), offset);
+    free(iov);
+    complete(persist_callback(key, SpaceInfo(offset, bytes)));
 }
 
 void Offloader::sync_readv(const std::vector<at::Tensor> &tensors, const std::string &key)
@@ -188,14 +1673,744 @@ void Offloader::sync_readv(const std::vector<at::Tensor> &tensors, const std::st
     ull offset, bytes;
     std::tie(offset, bytes) = prepare_readv(tensors, key);
     iovec *iov = tensors_to_iovec(tensors);
-    lseek(this->fd, offset, SEEK_SET);
-    readv(this->fd, iov, tensors.size());
-    delete iov;
+    transfer_now(READ, iov, tensors.size(), offset);
+    free(iov);
+    read_done(SpaceInfo(offset, bytes));
+}
+
+SpaceInfo Offloader::write_space(const std::string &key, ull bytes, int64_t version)
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    auto iter = this->tensors_info.find(key);
+    if (iter != this->tensors_info.end())
+        return place(iter->second, bytes, &key, version);
+    handle_t handle = this->handles.create(bytes);
+    try
+    {
+        SpaceInfo space_info = place(handle, bytes, &key, version);
+        this->tensors_info[key] = handle;
+        return space_info;
+    }
+    catch (...)
+    {
+        this->handles.remove(handle);
+        throw;
+    }
+}
+
+SpaceInfo Offloader::read_space(const std::string &key, ull bytes, int64_t version)
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    auto iter = this->tensors_info.find(key);
+    if (iter == this->tensors_info.end())
+        throw std::runtime_error("Read error, tensor not found");
+    TensorEntry &entry = this->handles.get(iter->second);
+    if (!(entry.flags & ENTRY_STORED))
+        throw std::runtime_error("Read error, tensor not found");
+    if (bytes != entry.bytes)
+        throw std::runtime_error("Read error, tensor shape mismatch");
+    SpaceInfo space_info(entry.offset, static_cast<ull>(entry.bytes));
+    if (this->retain)
+    {
+        // the on-disk copy stays valid as long as the tensor is not modified
+        this->clean_versions[iter->second] = version;
+    }
+    else
+    {
+        check_unmapped(entry, "Read");
+        this->handles.remove(iter->second);
+        this->tensors_info.erase(iter);
+        if (this->persistent)
+        {
+            this->tensors_meta.erase(key);
+            journal_del(key);
+        }
+    }
+    this->epoch++;
+    this->n_pending++;
+    return space_info;
+}
+
+SpaceInfo Offloader::place(handle_t handle, ull bytes, const std::string *key, int64_t version, const ull *fresh_offset)
+{
+    TensorEntry &entry = this->handles.get(handle);
+    bool stored = entry.flags & ENTRY_STORED;
+    SpaceInfo space_info;
+    if (stored && entry.bytes == bytes)
+    {
+        // rewrite in place
+        space_info = SpaceInfo(entry.offset, bytes);
+    }
+    else
+    {
+        if (stored)
+            check_unmapped(entry, "Write");
+        if (fresh_offset != nullptr)
+            space_info = SpaceInfo(*fresh_offset, bytes);
+        else
+            space_info = key != nullptr ? alloc_space(*key, bytes) : SpaceInfo(this->space_mgr.alloc(bytes), bytes);
+        if (stored && entry.offset >= this->static_bytes)
+        {
+            // the journal points to the old extent until the new write is recorded, so it is not reused before
+            if (this->persistent && key != nullptr)
+                this->retired[*key].push_back(SpaceInfo(entry.offset, static_cast<ull>(entry.bytes)));
+            else
+                this->space_mgr.free(entry.offset, entry.bytes);
+        }
+        this->layout_epoch++;
+    }
+    entry.offset = space_info.first;
+    entry.bytes = bytes;
+    entry.flags |= ENTRY_STORED;
+    if (this->retain)
+        this->clean_versions[handle] = version;
+    this->epoch++;
+    this->n_pending++;
+    return space_info;
 }
 
 void Offloader::release(ull offset, ull bytes, callback_t callback)
 {
-    this->space_mgr.free(offset, bytes);
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        if (offset >= this->static_bytes)
+            this->space_mgr.free(offset, bytes);
+        this->epoch++;
+    }
+    complete(callback);
+}
+
+void Offloader::read_done(SpaceInfo space_info, callback_t callback)
+{
+    if (this->retain)
+        complete(callback);
+    else
+        release(space_info.first, space_info.second, callback);
+}
+
+void Offloader::complete(callback_t callback)
+{
+    this->n_pending--;
+    if (callback != nullptr)
+        callback();
+}
+
+ull Offloader::file_bytes()
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    return this->space_mgr.get_used_bytes();
+}
+
+ull Offloader::live_bytes()
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    return this->space_mgr.get_used_bytes() - this->space_mgr.get_free_bytes();
+}
+
+bool Offloader::copy_extent(ull src, ull dst, ull bytes)
+{
+    // copy in chunks so that the compactor can yield to foreground I/O quickly
+    const ull chunk_bytes = 1 << 20;
+    loff_t off_in = src, off_out = dst;
+    ull copied = 0;
+    while (copied < bytes)
+    {
+        if (this->n_pending > 0)
+            return false;
+        ssize_t n = copy_file_range(this->fd, &off_in, this->fd, &off_out, std::min(chunk_bytes, bytes - copied), 0);
+        if (n <= 0)
+            throw std::runtime_error("Compaction error, copy_file_range failed: " + std::string(n < 0 ? strerror(errno) : "unexpected EOF"));
+        copied += n;
+    }
+    return true;
+}
+
+void Offloader::scan_extents(CompactionPass &pass)
+{
+    pass.extents.clear();
+    pass.keys.clear();
+    for (size_t i = 0; i < this->handles.capacity(); i++)
+    {
+        const TensorEntry &entry = this->handles.slot(i);
+        if ((entry.flags & ENTRY_USED) && (entry.flags & ENTRY_STORED) && entry.offset >= this->static_bytes)
+            pass.extents[entry.offset] = this->handles.slot_handle(i);
+    }
+    if (this->persistent)
+    {
+        for (const auto &item : this->tensors_info)
+            pass.keys[item.second] = item.first;
+    }
+    pass.built = true;
+    pass.epoch = this->epoch;
+}
+
+bool Offloader::relocate_one(CompactionPass &pass, ull &moved_bytes)
+{
+    handle_t handle;
+    SpaceInfo src;
+    ull dst, start_epoch;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        if (this->n_pending > 0)
+            return false;
+        if (!pass.built || pass.epoch != this->epoch)
+            scan_extents(pass);
+        // move the last extent of the file into the first hole which can hold it
+        if (pass.extents.empty())
+            return false;
+        auto last = std::prev(pass.extents.end());
+        // mapped extents cannot move, compaction stops at the first one
+        if (this->mapped->contains(last->first))
+            return false;
+        handle = last->second;
+        src = SpaceInfo(last->first, static_cast<ull>(this->handles.get(handle).bytes));
+        if (!this->space_mgr.alloc_below(src.second, src.first, dst))
+            return false;
+        start_epoch = this->epoch;
+    }
+    // data is copied without the lock, any foreground change in the meantime discards this move
+    bool copied = copy_extent(src.first, dst, src.second);
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    if (!copied || this->epoch != start_epoch)
+    {
+        this->space_mgr.free(dst, src.second);
+        return false;
+    }
+    this->handles.get(handle).offset = dst;
+    this->epoch++;
+    this->layout_epoch++;
+    // the pass follows this move without a rescan
+    pass.extents.erase(src.first);
+    pass.extents[dst] = handle;
+    pass.epoch = this->epoch;
+    if (this->persistent)
+    {
+        auto key = pass.keys.find(handle);
+        if (key != pass.keys.end())
+            journal_put(key->second, SpaceInfo(dst, src.second));
+    }
+    // the index points to the new extent by now
+    this->space_mgr.free(src.first, src.second);
+    if (ftruncate(this->fd, this->space_mgr.get_used_bytes()) != 0)
+        throw std::runtime_error("Compaction error, ftruncate failed: " + std::string(strerror(errno)));
+    moved_bytes += src.second;
+    return true;
+}
+
+ull Offloader::compact(ull max_bytes)
+{
+    // max_bytes=0 means unlimit
+    ull moved_bytes = 0;
+    // the extents are scanned once per call unless foreground requests change them meanwhile
+    CompactionPass pass{false, 0, {}, {}};
+    while (max_bytes == 0 || moved_bytes < max_bytes)
+    {
+        if (!relocate_one(pass, moved_bytes))
+            break;
+    }
+    return moved_bytes;
+}
+
+void Offloader::start_compaction(ull bytes_per_sec, double min_fragmentation, unsigned int interval_ms)
+{
+    if (this->compactor.joinable())
+        throw std::runtime_error("Compaction is already running");
+    this->compactor_stop = false;
+    this->compactor = std::thread(
+        [this, bytes_per_sec, min_fragmentation, interval_ms]
+        {
+            // bytes_per_sec=0 means unlimit
+            ull budget = bytes_per_sec * interval_ms / 1000;
+            if (bytes_per_sec > 0 && budget == 0)
+                budget = 1;
+            std::unique_lock<std::mutex> lock(this->compactor_mtx);
+            while (!this->compactor_stop)
+            {
+                this->compactor_cv.wait_for(lock, std::chrono::milliseconds(interval_ms));
+                if (this->compactor_stop || this->n_pending > 0)
+                    continue;
+                ull used = file_bytes();
+                if (used == 0 || 1.0 - (double)live_bytes() / used < min_fragmentation)
+                    continue;
+                try
+                {
+                    compact(budget);
+                }
+                catch (const std::exception &e)
+                {
+                    std::lock_guard<std::mutex> error_lock(this->error_mtx);
+                    this->background_error = std::string(e.what()) + ", background compaction is stopped";
+                    return;
+                }
+            }
+        });
+}
+
+void Offloader::stop_compaction()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->compactor_mtx);
+        this->compactor_stop = true;
+    }
+    this->compactor_cv.notify_all();
+    if (this->compactor.joinable())
+        this->compactor.join();
+}
+
+SpaceInfo Offloader::alloc_space(const std::string &key, ull bytes)
+{
+    auto iter = this->static_layout.find(key);
+    if (iter == this->static_layout.end())
+        return SpaceInfo(this->space_mgr.alloc(bytes), bytes);
+    if (iter->second.second != bytes)
+        throw std::runtime_error("Write error, tensor size does not match the planned layout");
+    return iter->second;
+}
+
+ull Offloader::plan_layout(const std::vector<std::tuple<std::string, ull, ull>> &entries, ull alignment)
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    if (this->space_mgr.get_used_bytes() > 0 || !this->static_layout.empty())
+        throw std::runtime_error("Layout must be planned before any tensor is offloaded");
+    // (key, bytes, access rank), tensors with the same rank are accessed together
+    std::vector<const std::tuple<std::string, ull, ull> *> order;
+    for (const auto &entry : entries)
+    {
+        if (std::get<1>(entry) == 0)
+            throw std::runtime_error("Invalid tensor size (0) in layout");
+        order.push_back(&entry);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const std::tuple<std::string, ull, ull> *a, const std::tuple<std::string, ull, ull> *b)
+                     { return std::get<2>(*a) < std::get<2>(*b); });
+    // each group starts at an aligned offset and its tensors are packed back to back
+    ull offset = 0;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const std::string &key = std::get<0>(*order[i]);
+        ull bytes = std::get<1>(*order[i]);
+        if (alignment > 1 && (i == 0 || std::get<2>(*order[i]) != std::get<2>(*order[i - 1])))
+            offset = (offset + alignment - 1) / alignment * alignment;
+        if (!this->static_layout.emplace(key, SpaceInfo(offset, bytes)).second)
+        {
+            this->static_layout.clear();
+            throw std::runtime_error("Duplicated key in layout: " + key);
+        }
+        offset += bytes;
+    }
+    if (offset == 0)
+        return 0;
+    ull end = this->space_mgr.alloc(offset) + offset;
+    // reserve the whole region now so that the file is laid out contiguously on the device
+    int err = posix_fallocate(this->fd, 0, end);
+    if (err != 0)
+    {
+        // nothing was offloaded yet, so the layout is simply forgotten
+        this->static_layout.clear();
+        this->space_mgr.restore(0, std::vector<SpaceInfo>());
+        throw std::runtime_error("Layout error, posix_fallocate failed: " + std::string(strerror(err)));
+    }
+    this->static_bytes = end;
+    return this->static_bytes;
+}
+
+callback_t Offloader::persist_callback(const std::string &key, SpaceInfo space_info, callback_t callback)
+{
+    if (!this->persistent)
+        return callback;
+    // the extent is recorded only after its data is on disk
+    return [this, key, space_info, callback]
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->meta_mtx);
+            // a read may have consumed the key while the write was in flight
+            auto iter = this->tensors_info.find(key);
+            if (iter != this->tensors_info.end() && this->handles.get(iter->second).offset == space_info.first)
+                journal_put(key, space_info);
+        }
+        if (callback != nullptr)
+            callback();
+    };
+}
+
+void Offloader::journal_put(const std::string &key, SpaceInfo space_info)
+{
+    auto iter = this->tensors_meta.find(key);
+    this->index->put(key, IndexEntry{space_info, iter == this->tensors_meta.end() ? TensorMeta{-1, {}} : iter->second});
+    free_retired(key);
+    if (this->index->need_checkpoint() && this->n_pending == 0)
+        checkpoint_index();
+}
+
+void Offloader::journal_del(const std::string &key)
+{
+    this->index->del(key);
+    free_retired(key);
+}
+
+void Offloader::free_retired(const std::string &key)
+{
+    auto iter = this->retired.find(key);
+    if (iter == this->retired.end())
+        return;
+    for (const SpaceInfo &space_info : iter->second)
+        this->space_mgr.free(space_info.first, space_info.second);
+    this->retired.erase(iter);
+}
+
+void Offloader::checkpoint_index()
+{
+    std::unordered_map<std::string, IndexEntry> entries;
+    for (const auto &item : this->tensors_info)
+    {
+        const TensorEntry &entry = this->handles.get(item.second);
+        if (!(entry.flags & ENTRY_STORED))
+            continue;
+        auto meta = this->tensors_meta.find(item.first);
+        entries[item.first] = IndexEntry{SpaceInfo(entry.offset, static_cast<ull>(entry.bytes)), meta == this->tensors_meta.end() ? TensorMeta{-1, {}} : meta->second};
+    }
+    this->index->checkpoint(this->space_mgr, entries);
+}
+
+std::vector<std::string> Offloader::keys()
+{
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    std::vector<std::string> keys;
+    for (const auto &item : this->tensors_info)
+        keys.push_back(item.first);
+    return keys;
+}
+
+at::Tensor Offloader::load(const std::string &key, bool mmap)
+{
+    TensorMeta meta;
+    handle_t handle;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        auto iter = this->tensors_meta.find(key);
+        if (iter == this->tensors_meta.end())
+            throw std::runtime_error("Load error, tensor not found");
+        meta = iter->second;
+        handle = this->tensors_info.at(key);
+    }
+    if (meta.dtype < 0)
+        throw std::runtime_error("Load error, dtype and shape of the tensor are unknown");
+    if (mmap)
+        return map_extent(handle, meta.shape, static_cast<at::ScalarType>(meta.dtype), "willneed", false);
+    at::Tensor tensor = at::empty(meta.shape, at::TensorOptions().dtype(static_cast<at::ScalarType>(meta.dtype)));
+    sync_read(tensor, key);
+    return tensor;
+}
+
+int64_t Offloader::tensors_version(const std::vector<at::Tensor> &tensors)
+{
+    // versions never decrease, so the sum is unchanged only if no tensor is modified
+    int64_t version = 0;
+    for (const at::Tensor &tensor : tensors)
+        version += tensor._version();
+    return version;
+}
+
+bool Offloader::is_clean(handle_t handle, int64_t version)
+{
+    if (!this->retain || !(this->handles.get(handle).flags & ENTRY_STORED))
+        return false;
+    auto iter = this->clean_versions.find(handle);
+    return iter != this->clean_versions.end() && iter->second == version;
+}
+
+bool Offloader::drop(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    bool clean;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        auto iter = this->tensors_info.find(key);
+        clean = iter != this->tensors_info.end() && is_clean(iter->second, tensor._version());
+    }
+    if (!clean)
+    {
+        async_write(tensor, key, callback);
+        return false;
+    }
+    if (callback != nullptr)
+        callback();
+    return true;
+}
+
+bool Offloader::drop(const at::Tensor &tensor, handle_t handle, callback_t callback)
+{
+    bool clean;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        clean = is_clean(handle, tensor._version());
+    }
+    if (!clean)
+    {
+        async_write(tensor, handle, callback);
+        return false;
+    }
+    if (callback != nullptr)
+        callback();
+    return true;
+}
+
+bool Offloader::dropv(const std::vector<at::Tensor> &tensors, const std::string &key, callback_t callback)
+{
+    bool clean;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        auto iter = this->tensors_info.find(key);
+        clean = iter != this->tensors_info.end() && is_clean(iter->second, tensors_version(tensors));
+    }
+    if (!clean)
+    {
+        async_writev(tensors, key, callback);
+        return false;
+    }
     if (callback != nullptr)
         callback();
+    return true;
+}
+
+void Offloader::erase(const std::string &key)
+{
+    if (!this->thread_safe)
+        invalidate_prefetch(key);
+    std::lock_guard<std::mutex> lock(this->meta_mtx);
+    auto iter = this->tensors_info.find(key);
+    if (iter == this->tensors_info.end())
+        throw std::runtime_error("Erase error, tensor not found");
+    TensorEntry &entry = this->handles.get(iter->second);
+    check_unmapped(entry, "Erase");
+    if ((entry.flags & ENTRY_STORED) && entry.offset >= this->static_bytes)
+        this->space_mgr.free(entry.offset, entry.bytes);
+    this->clean_versions.erase(iter->second);
+    this->handles.remove(iter->second);
+    this->tensors_info.erase(iter);
+    if (this->persistent)
+    {
+        this->tensors_meta.erase(key);
+        journal_del(key);
+    }
+    this->epoch++;
+    this->layout_epoch++;
+}
+
+void MappedExtents::pin(ull offset)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->counts[offset]++;
+}
+
+void MappedExtents::unpin(ull offset)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    auto iter = this->counts.find(offset);
+    if (iter != this->counts.end() && --iter->second == 0)
+        this->counts.erase(iter);
+}
+
+bool MappedExtents::contains(ull offset)
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->counts.count(offset) > 0;
+}
+
+void Offloader::check_unmapped(const TensorEntry &entry, const char *op)
+{
+    if ((entry.flags & ENTRY_STORED) && this->mapped->contains(entry.offset))
+        throw std::runtime_error(std::string(op) + " error, the extent is mapped by a live tensor");
+}
+
+static std::vector<int> parse_advice(const std::string &advice)
+{
+    std::vector<int> advices;
+    std::stringstream ss(advice);
+    std::string token;
+    while (std::getline(ss, token, ','))
+    {
+        if (token.empty() || token == "normal")
+            advices.push_back(MADV_NORMAL);
+        else if (token == "willneed")
+            advices.push_back(MADV_WILLNEED);
+        else if (token == "sequential")
+            advices.push_back(MADV_SEQUENTIAL);
+        else if (token == "random")
+            advices.push_back(MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+        else if (token == "hugepage")
+            advices.push_back(MADV_HUGEPAGE);
+#endif
+        else
+            throw std::runtime_error("Unknown madvise hint: " + token);
+    }
+    return advices;
+}
+
+static void prefault_pages(char *base, size_t length)
+{
+#ifdef MADV_POPULATE_READ
+    if (madvise(base, length, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    // touch one byte per page on kernels without MADV_POPULATE_READ
+    const size_t page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for (size_t i = 0; i < length; i += page)
+        sink += base[i];
+    (void)sink;
+}
+
+at::Tensor Offloader::map(const at::Tensor &tensor, const std::string &key, const std::string &advice, bool prefault)
+{
+    handle_t handle;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        auto iter = this->tensors_info.find(key);
+        if (iter == this->tensors_info.end())
+            throw std::runtime_error("Map error, tensor not found");
+        handle = iter->second;
+    }
+    return map_extent(handle, std::vector<int64_t>(tensor.sizes().begin(), tensor.sizes().end()), tensor.scalar_type(), advice, prefault);
+}
+
+at::Tensor Offloader::map(const at::Tensor &tensor, handle_t handle, const std::string &advice, bool prefault)
+{
+    return map_extent(handle, std::vector<int64_t>(tensor.sizes().begin(), tensor.sizes().end()), tensor.scalar_type(), advice, prefault);
+}
+
+at::Tensor Offloader::map_extent(handle_t handle, const std::vector<int64_t> &shape, at::ScalarType dtype, const std::string &advice, bool prefault)
+{
+    std::vector<int> advices = parse_advice(advice);
+    at::TensorOptions options = at::TensorOptions().dtype(dtype);
+    ull bytes = at::empty({0}, options).element_size();
+    for (int64_t dim : shape)
+        bytes *= dim;
+    ull offset;
+    {
+        std::lock_guard<std::mutex> lock(this->meta_mtx);
+        const TensorEntry &entry = this->handles.get(handle);
+        if (!(entry.flags & ENTRY_STORED))
+            throw std::runtime_error("Map error, tensor not found");
+        if (bytes != entry.bytes)
+            throw std::runtime_error("Map error, tensor shape mismatch");
+        offset = entry.offset;
+        // pinned before the lock is released, so that the extent cannot be freed or relocated
+        this->mapped->pin(offset);
+    }
+    // mmap needs a page aligned file offset, the tensor starts inside the first page
+    const ull page = sysconf(_SC_PAGESIZE);
+    ull map_offset = offset / page * page;
+    size_t length = bytes + (offset - map_offset);
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, map_offset);
+    if (base == MAP_FAILED)
+    {
+        this->mapped->unpin(offset);
+        throw std::runtime_error("Map error, mmap failed: " + std::string(strerror(errno)));
+    }
+    // hints are best effort, e.g. MADV_HUGEPAGE is rejected by file systems without large folio support
+    for (int adv : advices)
+        madvise(base, length, adv);
+    std::shared_ptr<MappedExtents> mapped = this->mapped;
+    auto deleter = [mapped, base, length, offset](void *)
+    {
+        munmap(base, length);
+        mapped->unpin(offset);
+    };
+    at::Tensor tensor = at::from_blob(static_cast<char *>(base) + (offset - map_offset), shape, deleter, options);
+    if (prefault)
+    {
+        // the task holds a reference to the tensor, so the mapping outlives it
+        {
+            std::lock_guard<std::mutex> lock(this->prefault_mtx);
+            if (!this->prefaulter.joinable())
+                this->prefaulter = std::thread(&Offloader::prefault_loop, this);
+            this->prefault_queue.push_back([tensor, base, length]()
+                                           { prefault_pages(static_cast<char *>(base), length); });
+        }
+        this->prefault_cv.notify_all();
+    }
+    return tensor;
+}
+
+void Offloader::flush_mapped(const at::Tensor &tensor)
+{
+    const ull page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = reinterpret_cast<uintptr_t>(tensor.data_ptr());
+    uintptr_t aligned = start / page * page;
+    if (msync(reinterpret_cast<void *>(aligned), tensor.nbytes() + (start - aligned), MS_SYNC) != 0)
+        throw std::runtime_error("Flush error, msync failed: " + std::string(strerror(errno)));
+}
+
+void Offloader::prefault_loop()
+{
+    std::unique_lock<std::mutex> lock(this->prefault_mtx);
+    while (true)
+    {
+        this->prefault_cv.wait(lock, [this]()
+                               { return this->prefault_stop || !this->prefault_queue.empty(); });
+        if (this->prefault_stop)
+            return;
+        std::function<void()> task = std::move(this->prefault_queue.front());
+        this->prefault_queue.pop_front();
+        this->prefault_busy = true;
+        lock.unlock();
+        task();
+        // the tensor is released without the lock, its deleter unmaps it
+        task = nullptr;
+        lock.lock();
+        this->prefault_busy = false;
+        this->prefault_cv.notify_all();
+    }
+}
+
+void Offloader::wait_prefaults()
+{
+    std::unique_lock<std::mutex> lock(this->prefault_mtx);
+    this->prefault_cv.wait(lock, [this]()
+                           { return this->prefault_queue.empty() && !this->prefault_busy; });
+}
+
+void Offloader::stop_prefaulting()
+{
+    std::deque<std::function<void()>> dropped;
+    {
+        std::lock_guard<std::mutex> lock(this->prefault_mtx);
+        this->prefault_stop = true;
+        dropped.swap(this->prefault_queue);
+    }
+    this->prefault_cv.notify_all();
+    if (this->prefaulter.joinable())
+        this->prefaulter.join();
+}
+
+AsyncIO *Offloader::engine()
+{
+    if (!this->thread_safe)
+        return this->aio;
+    // one cached engine per thread, most threads only use one offloader
+    thread_local unsigned long long cached_id = 0;
+    thread_local AsyncIO *cached_engine = nullptr;
+    if (cached_id == this->instance_id)
+        return cached_engine;
+    std::lock_guard<std::mutex> lock(this->engines_mtx);
+    AsyncIO *&aio = this->engines[std::this_thread::get_id()];
+    if (aio == nullptr)
+    {
+        aio = this->shared_engine != nullptr ? this->shared_engine->attach() : create_asyncio(this->n_entries, this->backend, 0, this->filename);
+        aio->register_file(this->fd);
+        aio->set_priority(READ, this->read_priority);
+        aio->set_priority(WRITE, this->write_priority);
+        // the controller sits next to the engine, which bounds its depth
+        if (this->autotune_min_depth > 0)
+            aio = new AdaptiveAsyncIO(aio, this->n_entries, this->autotune_min_depth, this->autotune_tolerance);
+        if (this->lane_writes > 0)
+            aio = new LanedAsyncIO(aio, this->lane_writes);
+        if (this->deadline_depth > 0)
+            aio = new DeadlineAsyncIO(aio, this->deadline_depth, this->deadline_slack);
+        if (this->arbiter != nullptr)
+            aio = new ArbitratedAsyncIO(aio, this->arbiter, this->io_class);
+    }
+    cached_id = this->instance_id;
+    cached_engine = aio;
+    return aio;
 }
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "offload_index.h"
+
+static const char INDEX_MAGIC[8] = {'T', 'N', 'V', 'M', 'E', 'I', 'D', 'X'};
+static const uint32_t INDEX_VERSION = 1;
+
+enum IndexRecordType
+{
+    RECORD_FREE_LIST = 1,
+    RECORD_PUT = 2,
+    RECORD_DEL = 3,
+};
+
+static uint32_t crc32(const char *data, size_t n)
+{
+    static uint32_t table[256];
+    static bool initialized = false;
+    if (!initialized)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        initialized = true;
+    }
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < n; i++)
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+template <typename T>
+static void pack(std::string &buf, T value)
+{
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void pack_str(std::string &buf, const std::string &s)
+{
+    pack<uint32_t>(buf, s.size());
+    buf.append(s);
+}
+
+class Unpacker
+{
+private:
+    const std::string &buf;
+    size_t pos;
+
+public:
+    Unpacker(const std::string &buf) : buf(buf), pos(0) {}
+
+    template <typename T>
+    T get()
+    {
+        if (pos + sizeof(T) > buf.size())
+            throw std::runtime_error("Index error, truncated record");
+        T value;
+        memcpy(&value, buf.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    std::string get_str()
+    {
+        uint32_t n = get<uint32_t>();
+        if (pos + n > buf.size())
+            throw std::runtime_error("Index error, truncated record");
+        std::string s = buf.substr(pos, n);
+        pos += n;
+        return s;
+    }
+};
+
+// record: [payload bytes (u32)][crc32 of payload (u32)][payload]
+static std::string frame(const std::string &payload)
+{
+    std::string record;
+    pack<uint32_t>(record, payload.size());
+    pack<uint32_t>(record, crc32(payload.data(), payload.size()));
+    record.append(payload);
+    return record;
+}
+
+static std::string put_record(const std::string &key, const IndexEntry &entry)
+{
+    std::string payload;
+    pack<uint8_t>(payload, RECORD_PUT);
+    pack_str(payload, key);
+    pack<uint64_t>(payload, entry.space_info.first);
+    pack<uint64_t>(payload, entry.space_info.second);
+    pack<int8_t>(payload, entry.meta.dtype);
+    pack<uint8_t>(payload, entry.meta.shape.size());
+    for (int64_t dim : entry.meta.shape)
+        pack<int64_t>(payload, dim);
+    return frame(payload);
+}
+
+static void write_all(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Index error, write failed: " + std::string(strerror(errno)));
+        }
+        written += n;
+    }
+}
+
+OffloadIndex::OffloadIndex(const std::string &path) : path(path), fd(-1), snapshot_bytes(0), journal_bytes(0)
+{
+}
+
+OffloadIndex::~OffloadIndex()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+void OffloadIndex::open_journal()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+    this->fd = open(this->path.c_str(), O_WRONLY | O_APPEND);
+    if (this->fd < 0)
+        throw std::runtime_error("Index error, open \"" + this->path + "\" failed: " + std::string(strerror(errno)));
+}
+
+void OffloadIndex::append(const std::string &record)
+{
+    write_all(this->fd, record);
+    this->journal_bytes += record.size();
+}
+
+bool OffloadIndex::load(SpaceManager &space_mgr, std::unordered_map<std::string, IndexEntry> &entries)
+{
+    int rfd = open(this->path.c_str(), O_RDONLY);
+    if (rfd < 0)
+    {
+        if (errno == ENOENT)
+            return false;
+        throw std::runtime_error("Index error, open \"" + this->path + "\" failed: " + std::string(strerror(errno)));
+    }
+    std::string buf;
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = ::read(rfd, chunk, sizeof(chunk))) > 0)
+        buf.append(chunk, n);
+    close(rfd);
+    if (n < 0)
+        throw std::runtime_error("Index error, read failed: " + std::string(strerror(errno)));
+    if (buf.size() < sizeof(INDEX_MAGIC) + sizeof(uint32_t) || memcmp(buf.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        throw std::runtime_error("Index error, \"" + this->path + "\" is not an offload index");
+    size_t pos = sizeof(INDEX_MAGIC);
+    uint32_t version;
+    memcpy(&version, buf.data() + pos, sizeof(uint32_t));
+    if (version != INDEX_VERSION)
+        throw std::runtime_error("Index error, unsupported index version");
+    pos += sizeof(uint32_t);
+    this->snapshot_bytes = 0;
+
+    entries.clear();
+    space_mgr.restore(0, vector<SpaceInfo>());
+    bool has_snapshot = false;
+    // number of put records which still belong to the snapshot
+    uint64_t n_snapshot_entries = 0;
+    while (pos + 2 * sizeof(uint32_t) <= buf.size())
+    {
+        uint32_t size, crc;
+        memcpy(&size, buf.data() + pos, sizeof(uint32_t));
+        memcpy(&crc, buf.data() + pos + sizeof(uint32_t), sizeof(uint32_t));
+        size_t start = pos + 2 * sizeof(uint32_t);
+        // a torn record at the end is dropped
+        if (start + size > buf.size() || crc32(buf.data() + start, size) != crc)
+            break;
+        std::string payload = buf.substr(start, size);
+        Unpacker unpacker(payload);
+        uint8_t type = unpacker.get<uint8_t>();
+        if (!has_snapshot && type != RECORD_FREE_LIST)
+            throw std::runtime_error("Index error, snapshot is missing");
+        if (type == RECORD_FREE_LIST)
+        {
+            if (has_snapshot)
+                throw std::runtime_error("Index error, duplicated snapshot");
+            // the free list of the writer also holds extents of requests in flight and of handles, which are
+            // not in the index, so the free map is rebuilt from the entries instead
+            unpacker.get<uint64_t>();
+            uint64_t n_spaces = unpacker.get<uint64_t>();
+            for (uint64_t i = 0; i < 2 * n_spaces; i++)
+                unpacker.get<uint64_t>();
+            n_snapshot_entries = unpacker.get<uint64_t>();
+            has_snapshot = true;
+        }
+        else if (type == RECORD_PUT)
+        {
+            std::string key = unpacker.get_str();
+            IndexEntry entry;
+            entry.space_info.first = unpacker.get<uint64_t>();
+            entry.space_info.second = unpacker.get<uint64_t>();
+            entry.meta.dtype = unpacker.get<int8_t>();
+            uint8_t ndim = unpacker.get<uint8_t>();
+            for (uint8_t i = 0; i < ndim; i++)
+                entry.meta.shape.push_back(unpacker.get<int64_t>());
+            if (n_snapshot_entries > 0)
+                n_snapshot_entries--;
+            entries[key] = entry;
+        }
+        else if (type == RECORD_DEL)
+        {
+            std::string key = unpacker.get_str();
+            entries.erase(key);
+        }
+        else
+        {
+            throw std::runtime_error("Index error, unknown record type");
+        }
+        pos = start + size;
+        if (type != RECORD_DEL && n_snapshot_entries == 0 && this->snapshot_bytes == 0)
+            this->snapshot_bytes = pos;
+    }
+    if (!has_snapshot || n_snapshot_entries > 0)
+        throw std::runtime_error("Index error, snapshot is incomplete");
+    vector<SpaceInfo> extents;
+    for (const auto &item : entries)
+        extents.push_back(item.second.space_info);
+    std::sort(extents.begin(), extents.end());
+    for (const SpaceInfo &extent : extents)
+    {
+        if (extent.second == 0)
+            continue;
+        if (extent.first < space_mgr.get_used_bytes())
+            throw std::runtime_error("Index error, entries overlap");
+        space_mgr.claim(extent.first, extent.second);
+    }
+    // drop the torn tail so that new records are appended to a valid index
+    if (truncate(this->path.c_str(), pos) != 0)
+        throw std::runtime_error("Index error, truncate failed: " + std::string(strerror(errno)));
+    this->journal_bytes = pos - this->snapshot_bytes;
+    open_journal();
+    return true;
+}
+
+void OffloadIndex::put(const std::string &key, const IndexEntry &entry)
+{
+    append(put_record(key, entry));
+}
+
+void OffloadIndex::del(const std::string &key)
+{
+    std::string payload;
+    pack<uint8_t>(payload, RECORD_DEL);
+    pack_str(payload, key);
+    append(frame(payload));
+}
+
+void OffloadIndex::checkpoint(const SpaceManager &space_mgr, const std::unordered_map<std::string, IndexEntry> &entries)
+{
+    std::string buf(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    pack<uint32_t>(buf, INDEX_VERSION);
+    std::string payload;
+    pack<uint8_t>(payload, RECORD_FREE_LIST);
+    pack<uint64_t>(payload, space_mgr.get_used_bytes());
+    pack<uint64_t>(payload, space_mgr.get_avail_spaces().size());
+    for (const SpaceInfo &space_info : space_mgr.get_avail_spaces())
+    {
+        pack<uint64_t>(payload, space_info.first);
+        pack<uint64_t>(payload, space_info.second);
+    }
+    pack<uint64_t>(payload, entries.size());
+    buf.append(frame(payload));
+    for (const auto &item : entries)
+        buf.append(put_record(item.first, item.second));
+
+    // write a new index and atomically replace the old one
+    std::string tmp_path = this->path + ".tmp";
+    int tmp_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (tmp_fd < 0)
+        throw std::runtime_error("Index error, open \"" + tmp_path + "\" failed: " + std::string(strerror(errno)));
+    try
+    {
+        write_all(tmp_fd, buf);
+        if (fdatasync(tmp_fd) != 0)
+            throw std::runtime_error("Index error, fdatasync failed: " + std::string(strerror(errno)));
+    }
+    catch (...)
+    {
+        close(tmp_fd);
+        throw;
+    }
+    close(tmp_fd);
+    if (rename(tmp_path.c_str(), this->path.c_str()) != 0)
+        throw std::runtime_error("Index error, rename failed: " + std::string(strerror(errno)));
+    this->snapshot_bytes = buf.size();
+    this->journal_bytes = 0;
+    open_journal();
+}
+
+bool OffloadIndex::need_checkpoint() const
+{
+    return this->journal_bytes > 2 * this->snapshot_bytes + (1 << 20);
+}
+
+void OffloadIndex::sync()
+{
+    if (this->fd >= 0 && fdatasync(this->fd) != 0)
+        throw std::runtime_error("Index error, fdatasync failed: " + std::string(strerror(errno)));
+}
+
+void OffloadIndex::remove()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+    this->fd = -1;
+    ::remove(this->path.c_str());
+}
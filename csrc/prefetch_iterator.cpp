@@ -0,0 +1,124 @@
+#include <math.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdexcept>
+#include "prefetch_iterator.h"
+
+// weight of the newest sample in the moving averages
+static const double ewma_weight = 0.25;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void update_average(double &average, double sample)
+{
+    average = average == 0.0 ? sample : (1 - ewma_weight) * average + ewma_weight * sample;
+}
+
+PrefetchIterator::PrefetchIterator(DiskOffloader &offloader, const std::vector<std::vector<at::Tensor>> &groups, unsigned int depth, unsigned int max_depth, bool adaptive) : offloader(offloader), groups(groups), states(groups.size(), GroupState{false, false, {}}), depth_(std::max(1u, std::min(depth, max_depth))), max_depth(std::max(1u, max_depth)), adaptive(adaptive), current(groups.size()), next_issue(0), closed(false), io_time(0.0), compute_time(0.0), stall(0.0)
+{
+}
+
+PrefetchIterator::~PrefetchIterator()
+{
+    try
+    {
+        close();
+    }
+    catch (const std::exception &e)
+    {
+        printf("%s\n", e.what());
+    }
+}
+
+bool PrefetchIterator::has_next() const
+{
+    size_t following = this->current == this->groups.size() ? 0 : this->current + 1;
+    return !this->closed && following < this->groups.size();
+}
+
+void PrefetchIterator::issue(size_t index)
+{
+    GroupState &state = this->states[index];
+    state.issued_at = std::chrono::steady_clock::now();
+    if (this->groups[index].empty())
+    {
+        state.issued = state.ready = true;
+        return;
+    }
+    // one submission and one completion per group
+    this->offloader.async_read_batch(this->groups[index], [this, index]()
+                                     {
+        GroupState &done = this->states[index];
+        done.ready = true;
+        update_average(this->io_time, seconds_since(done.issued_at)); });
+    // a failed submission leaves the group unissued and next_issue on it, so close() does not wait for it
+    state.issued = true;
+}
+
+void PrefetchIterator::adapt()
+{
+    if (!this->adaptive || this->compute_time <= 0.0)
+        return;
+    // enough groups in flight to cover the read time of one group with compute
+    double depth = ceil(this->io_time / this->compute_time);
+    this->depth_ = static_cast<unsigned int>(std::max(1.0, std::min(depth, static_cast<double>(this->max_depth))));
+}
+
+std::vector<at::Tensor> PrefetchIterator::next()
+{
+    if (!has_next())
+        throw std::runtime_error("PrefetchIterator is exhausted");
+    if (this->current == this->groups.size())
+        this->current = 0;
+    else
+    {
+        update_average(this->compute_time, seconds_since(this->returned_at));
+        for (const at::Tensor &tensor : this->groups[this->current])
+            this->offloader.drop(tensor);
+        this->current++;
+        adapt();
+    }
+    while (this->next_issue < this->groups.size() && this->next_issue <= this->current + this->depth_)
+    {
+        issue(this->next_issue);
+        this->next_issue++;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (!this->states[this->current].ready)
+        this->offloader.poll(true);
+    this->stall += seconds_since(start);
+    this->returned_at = std::chrono::steady_clock::now();
+    return this->groups[this->current];
+}
+
+void PrefetchIterator::close()
+{
+    if (this->closed)
+        return;
+    this->closed = true;
+    if (this->current < this->groups.size())
+        for (const at::Tensor &tensor : this->groups[this->current])
+            this->offloader.drop(tensor);
+    // groups read ahead but never returned are released as well
+    for (size_t i = this->current == this->groups.size() ? 0 : this->current + 1; i < this->next_issue; i++)
+    {
+        while (!this->states[i].ready)
+            this->offloader.poll(true);
+        for (const at::Tensor &tensor : this->groups[i])
+            this->offloader.drop(tensor);
+    }
+    this->offloader.synchronize();
+}
+
+unsigned int PrefetchIterator::depth() const
+{
+    return this->depth_;
+}
+
+double PrefetchIterator::stall_seconds() const
+{
+    return this->stall;
+}
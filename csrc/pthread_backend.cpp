@@ -8,12 +8,43 @@ void write_file(const std::string &filename, const std::string &content)
     file.close();
 }
 
+// positional I/O which retries short transfers, returns the number of bytes or -errno
+static ssize_t transfer_full(IOType type, int fd, void *buffer, size_t n_bytes, unsigned long long offset)
+{
+    size_t done = 0;
+    while (done < n_bytes)
+    {
+        char *ptr = static_cast<char *>(buffer) + done;
+        ssize_t res = type == WRITE ? pwrite(fd, ptr, n_bytes - done, offset + done) : pread(fd, ptr, n_bytes - done, offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -errno;
+        if (res == 0)
+            return -EIO;
+        done += res;
+    }
+    return done;
+}
+
+BS::priority_t PthreadAsyncIO::task_priority(IOType type) const
+{
+    if (this->priorities[type] == PRIO_CRITICAL)
+        return BS::pr::high;
+    if (this->priorities[type] == PRIO_BULK)
+        return BS::pr::low;
+    return BS::pr::normal;
+}
+
 void PthreadAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
 {
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
     auto fut = this->pool.submit_task(
-        [this, fd, buffer, n_bytes, offset]
+        [this, fd, buffer, n_bytes, offset, cancelled]
         {
-            auto val = pwrite(fd, buffer, n_bytes, offset);
+            if (cancelled->load())
+                return static_cast<ssize_t>(-ECANCELED);
+            auto val = transfer_full(WRITE, fd, buffer, n_bytes, offset);
             if (this->is_debug)
             {
                 auto cur_tasks = this->tasks_in_progress.fetch_add(1);
@@ -30,57 +61,87 @@ void PthreadAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long l
                 }
             }
             return val;
-        });
-    this->write_fut.push_back(std::make_tuple(std::move(fut), callback));
+        },
+        task_priority(WRITE));
+    this->write_fut.push_back(std::make_tuple(std::move(fut), callback, this->tag, cancelled));
 }
 
 void PthreadAsyncIO::writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
     auto fut = this->pool.submit_task(
-        [fd, iov, iovcnt, offset]
+        [fd, iov, iovcnt, offset, cancelled]
         {
-            return pwritev(fd, iov, iovcnt, offset);
-        });
-    this->write_fut.push_back(std::make_tuple(std::move(fut), callback));
+            if (cancelled->load())
+                return static_cast<ssize_t>(-ECANCELED);
+            ssize_t res = pwritev(fd, iov, iovcnt, offset);
+            return res < 0 ? -errno : res;
+        },
+        task_priority(WRITE));
+    this->write_fut.push_back(std::make_tuple(std::move(fut), callback, this->tag, cancelled));
 }
 
 void PthreadAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
 {
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
     auto fut = this->pool.submit_task(
-        [fd, buffer, n_bytes, offset]
+        [fd, buffer, n_bytes, offset, cancelled]
         {
-            return pread(fd, buffer, n_bytes, offset);
-        });
-    this->read_fut.push_back(std::make_tuple(std::move(fut), callback));
+            if (cancelled->load())
+                return static_cast<ssize_t>(-ECANCELED);
+            return transfer_full(READ, fd, buffer, n_bytes, offset);
+        },
+        task_priority(READ));
+    this->read_fut.push_back(std::make_tuple(std::move(fut), callback, this->tag, cancelled));
 }
 
 void PthreadAsyncIO::readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
     auto fut = this->pool.submit_task(
-        [fd, iov, iovcnt, offset]
+        [fd, iov, iovcnt, offset, cancelled]
         {
-            return preadv(fd, iov, iovcnt, offset);
-        });
-    this->read_fut.push_back(std::make_tuple(std::move(fut), callback));
+            if (cancelled->load())
+                return static_cast<ssize_t>(-ECANCELED);
+            ssize_t res = preadv(fd, iov, iovcnt, offset);
+            return res < 0 ? -errno : res;
+        },
+        task_priority(READ));
+    this->read_fut.push_back(std::make_tuple(std::move(fut), callback, this->tag, cancelled));
 }
 
+// tasks are handed to the pool as they are issued, there is nothing to batch
+void PthreadAsyncIO::plug() {}
+void PthreadAsyncIO::unplug() {}
+
 void PthreadAsyncIO::get_event(WaitType wt)
 {
     if (wt == NOWAIT)
+    {
+        // reap the tasks which are done, up to the first one still running
+        sync_events(WRITE, NOWAIT);
+        sync_events(READ, NOWAIT);
         return;
+    }
     this->sync_write_events();
     this->sync_read_events();
 }
 
-void PthreadAsyncIO::sync_write_events()
+void PthreadAsyncIO::sync_events(IOType type, WaitType wt)
 {
-    while (this->write_fut.size() > 0)
+    auto &futs = type == WRITE ? this->write_fut : this->read_fut;
+    while (futs.size() > 0)
     {
-        auto front = std::move(this->write_fut.front());
-        this->write_fut.pop_front();
+        if (wt == NOWAIT && std::get<0>(futs.front()).wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        auto front = std::move(futs.front());
+        futs.pop_front();
 
         auto fut(std::move(std::get<0>(front)));
-        fut.wait();
+        ssize_t res = fut.get();
+        // a cancelled task may have been skipped, its result is not an error
+        if (res < 0 && !std::get<3>(front)->load())
+            throw std::runtime_error(std::string(type == WRITE ? "Write" : "Read") + " error: " + std::string(strerror(-res)));
 
         auto callback = std::get<1>(front);
         if (callback != nullptr)
@@ -90,22 +151,14 @@ void PthreadAsyncIO::sync_write_events()
     }
 }
 
-void PthreadAsyncIO::sync_read_events()
+void PthreadAsyncIO::sync_write_events()
 {
-    while (this->read_fut.size() > 0)
-    {
-        auto front = std::move(this->read_fut.front());
-        this->read_fut.pop_front();
-
-        auto fut(std::move(std::get<0>(front)));
-        fut.wait();
+    sync_events(WRITE);
+}
 
-        auto callback = std::get<1>(front);
-        if (callback != nullptr)
-        {
-            callback();
-        }
-    }
+void PthreadAsyncIO::sync_read_events()
+{
+    sync_events(READ);
 }
 
 void PthreadAsyncIO::synchronize()
@@ -168,7 +221,7 @@ void PthreadAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long of
             }
             void *buf = cpu_tensor.data_ptr();
             size_t n_bytes = cpu_tensor.numel() * cpu_tensor.element_size();
-            auto val = pwrite(fd, buf, n_bytes, offset);
+            auto val = transfer_full(WRITE, fd, buf, n_bytes, offset);
             if (this->is_debug)
             {
                 auto cur_tasks = this->tasks_in_progress.fetch_add(1);
@@ -186,7 +239,7 @@ void PthreadAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long of
             }
             return val;
         });
-    this->write_fut.push_back(std::make_tuple(std::move(fut), callback));
+    this->write_fut.push_back(std::make_tuple(std::move(fut), callback, this->tag, std::make_shared<std::atomic<bool>>(false)));
 }
 
 void PthreadAsyncIO::register_tasks(unsigned int num_tasks)
@@ -195,4 +248,17 @@ void PthreadAsyncIO::register_tasks(unsigned int num_tasks)
     {
         this->tasks_in_progress.store(num_tasks);
     }
-}
\ No newline at end of file
+}
+
+void PthreadAsyncIO::cancel(unsigned long long tag)
+{
+    // tasks which have not started are skipped by the pool, running ones complete normally
+    for (auto *futs : {&this->write_fut, &this->read_fut})
+    {
+        for (auto &task : *futs)
+        {
+            if (tag == 0 || std::get<2>(task) == tag)
+                std::get<3>(task)->store(true);
+        }
+    }
+}
@@ -5,33 +5,208 @@
 #include "offload.h"
 #include "async_file_io.h"
 #include "backend.h"
+#include "io_profile.h"
+#include "host_arena.h"
+#include "disk_offloader.h"
+#include "tensor_store.h"
+#include "write_back_cache.h"
+#include "sharded_offloader.h"
+#include "prefetch_iterator.h"
+#include <optional>
 #include <string>
 
 namespace py = pybind11;
 
+// a blocking call of an offloader releases the GIL only in thread-safe mode, otherwise the GIL is what keeps
+// Python threads from calling it at once
+template <typename T, typename R, typename... Args>
+static auto nogil(R (T::*method)(Args...))
+{
+    return [method](T &offloader, Args... args) -> R
+    {
+        std::optional<py::gil_scoped_release> release;
+        if (offloader.is_thread_safe())
+            release.emplace();
+        return (offloader.*method)(std::forward<Args>(args)...);
+    };
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
     py::class_<Offloader>(m, "Offloader")
-        .def(py::init<const std::string &, unsigned int, const std::string &>(), py::arg("filename"), py::arg("n_entries"), py::arg("backend") = "aio")
-        .def("async_write", &Offloader::async_write, py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none())
-        .def("async_read", &Offloader::async_read, py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none())
-        .def("sync_write", &Offloader::sync_write, py::arg("tensor"), py::arg("key"))
-        .def("sync_read", &Offloader::sync_read, py::arg("tensor"), py::arg("key"))
-        .def("sync_write_events", &Offloader::sync_write_events)
-        .def("sync_read_events", &Offloader::sync_write_events)
-        .def("synchronize", &Offloader::synchronize)
+        .def(py::init<const std::string &, unsigned int, const std::string &, bool, bool, bool, std::shared_ptr<SharedEngine>>(), py::arg("filename"), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("persistent") = false, py::arg("retain") = false, py::arg("thread_safe") = false, py::arg("engine") = py::none())
+        .def("async_write", py::overload_cast<const at::Tensor &, const std::string &, callback_t, double>(&Offloader::async_write), py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none(), py::arg("deadline") = -1.0)
+        .def("async_read", py::overload_cast<const at::Tensor &, const std::string &, callback_t, double>(&Offloader::async_read), py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none(), py::arg("deadline") = -1.0)
+        .def("sync_write", nogil(py::overload_cast<const at::Tensor &, const std::string &>(&Offloader::sync_write)), py::arg("tensor"), py::arg("key"))
+        .def("sync_read", nogil(py::overload_cast<const at::Tensor &, const std::string &>(&Offloader::sync_read)), py::arg("tensor"), py::arg("key"))
+        .def("async_write", py::overload_cast<const at::Tensor &, handle_t, callback_t>(&Offloader::async_write), py::arg("tensor"), py::arg("handle"), py::arg("callback") = py::none())
+        .def("async_read", py::overload_cast<const at::Tensor &, handle_t, callback_t>(&Offloader::async_read), py::arg("tensor"), py::arg("handle"), py::arg("callback") = py::none())
+        .def("sync_write", nogil(py::overload_cast<const at::Tensor &, handle_t>(&Offloader::sync_write)), py::arg("tensor"), py::arg("handle"))
+        .def("sync_read", nogil(py::overload_cast<const at::Tensor &, handle_t>(&Offloader::sync_read)), py::arg("tensor"), py::arg("handle"))
+        .def("sync_write_events", nogil(&Offloader::sync_write_events))
+        .def("sync_read_events", nogil(&Offloader::sync_read_events))
+        .def("synchronize", nogil(&Offloader::synchronize))
         .def("async_writev", &Offloader::async_writev, py::arg("tensors"), py::arg("key"), py::arg("callback") = py::none())
         .def("async_readv", &Offloader::async_readv, py::arg("tensors"), py::arg("key"), py::arg("callback") = py::none())
-        .def("sync_writev", &Offloader::sync_writev, py::arg("tensors"), py::arg("key"))
-        .def("sync_readv", &Offloader::sync_readv, py::arg("tensors"), py::arg("key"));
+        .def("sync_writev", nogil(&Offloader::sync_writev), py::arg("tensors"), py::arg("key"))
+        .def("sync_readv", nogil(&Offloader::sync_readv), py::arg("tensors"), py::arg("key"))
+        .def("compact", &Offloader::compact, py::arg("max_bytes") = 0)
+        .def("start_compaction", &Offloader::start_compaction, py::arg("bytes_per_sec") = 0, py::arg("min_fragmentation") = 0.25, py::arg("interval_ms") = 100)
+        .def("stop_compaction", &Offloader::stop_compaction)
+        .def("file_bytes", &Offloader::file_bytes)
+        .def("live_bytes", &Offloader::live_bytes)
+        .def("plan_layout", &Offloader::plan_layout, py::arg("entries"), py::arg("alignment") = 4096)
+        .def("register", &Offloader::register_tensor, py::arg("tensor"))
+        .def("register", &Offloader::register_size, py::arg("n_bytes"))
+        .def("unregister", &Offloader::unregister, py::arg("handle"))
+        .def("metadata_bytes", &Offloader::metadata_bytes)
+        .def("keys", &Offloader::keys)
+        .def("load", &Offloader::load, py::arg("key"), py::arg("mmap") = false)
+        .def("drop", py::overload_cast<const at::Tensor &, const std::string &, callback_t>(&Offloader::drop), py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none())
+        .def("drop", py::overload_cast<const at::Tensor &, handle_t, callback_t>(&Offloader::drop), py::arg("tensor"), py::arg("handle"), py::arg("callback") = py::none())
+        .def("dropv", &Offloader::dropv, py::arg("tensors"), py::arg("key"), py::arg("callback") = py::none())
+        .def("erase", &Offloader::erase, py::arg("key"))
+        .def("map", py::overload_cast<const at::Tensor &, const std::string &, const std::string &, bool>(&Offloader::map), py::arg("tensor"), py::arg("key"), py::arg("advice") = "willneed", py::arg("prefault") = false)
+        .def("map", py::overload_cast<const at::Tensor &, handle_t, const std::string &, bool>(&Offloader::map), py::arg("tensor"), py::arg("handle"), py::arg("advice") = "willneed", py::arg("prefault") = false)
+        .def("flush_mapped", &Offloader::flush_mapped, py::arg("tensor"))
+        .def("async_write_batch", &Offloader::async_write_batch, py::arg("tensors"), py::arg("keys"), py::arg("callback") = py::none())
+        .def("async_read_batch", &Offloader::async_read_batch, py::arg("tensors"), py::arg("keys"), py::arg("callback") = py::none())
+        .def("sync_write_batch", nogil(&Offloader::sync_write_batch), py::arg("tensors"), py::arg("keys"))
+        .def("sync_read_batch", nogil(&Offloader::sync_read_batch), py::arg("tensors"), py::arg("keys"))
+        .def("inflight_stats", &Offloader::inflight_stats)
+        .def("start_recording", &Offloader::start_recording)
+        .def("stop_recording", &Offloader::stop_recording, py::arg("budget_bytes"))
+        .def("stop_prefetching", nogil(&Offloader::stop_prefetching))
+        .def("prefetch_stats", &Offloader::prefetch_stats)
+        .def("start_capture", nogil(&Offloader::start_capture))
+        .def("stop_capture", &Offloader::stop_capture)
+        .def("stop_replay", nogil(&Offloader::stop_replay))
+        .def("replay_stats", &Offloader::replay_stats)
+        .def("set_io_priority", nogil(&Offloader::set_io_priority), py::arg("read_priority") = "normal", py::arg("write_priority") = "normal", py::arg("max_writes") = 0)
+        .def("held_writes", &Offloader::held_writes)
+        .def("set_deadline_scheduler", nogil(&Offloader::set_deadline_scheduler), py::arg("depth") = 0, py::arg("slack") = 0.1)
+        .def("deadline_stats", &Offloader::deadline_stats)
+        .def("set_autotune", nogil(&Offloader::set_autotune), py::arg("min_depth") = 1, py::arg("latency_tolerance") = 2.0)
+        .def("autotune_stats", &Offloader::autotune_stats)
+        .def("cancel", py::overload_cast<const std::string &>(&Offloader::cancel), py::arg("key"))
+        .def("cancel", py::overload_cast<handle_t>(&Offloader::cancel), py::arg("handle"))
+        .def("cancel_all", &Offloader::cancel_all)
+        .def("set_io_class", nogil(&Offloader::set_io_class), py::arg("arbiter"), py::arg("io_class"));
+    py::class_<DiskOffloader, Offloader>(m, "DiskOffloader")
+        .def(py::init<const std::string &, unsigned int, const std::string &, bool, std::shared_ptr<HostArena>, bool, std::shared_ptr<SharedEngine>>(), py::arg("filename"), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("retain") = false, py::arg("arena") = py::none(), py::arg("thread_safe") = false, py::arg("engine") = py::none())
+        .def("async_write", &DiskOffloader::async_write, py::arg("tensor"), py::arg("callback") = py::none())
+        .def("async_read", &DiskOffloader::async_read, py::arg("tensor"), py::arg("callback") = py::none())
+        .def("sync_write", nogil(&DiskOffloader::sync_write), py::arg("tensor"))
+        .def("sync_read", nogil(&DiskOffloader::sync_read), py::arg("tensor"))
+        .def("async_writev", &DiskOffloader::async_writev, py::arg("tensors"), py::arg("callback") = py::none())
+        .def("async_readv", &DiskOffloader::async_readv, py::arg("tensors"), py::arg("callback") = py::none())
+        .def("sync_writev", nogil(&DiskOffloader::sync_writev), py::arg("tensors"))
+        .def("sync_readv", nogil(&DiskOffloader::sync_readv), py::arg("tensors"))
+        .def("drop", &DiskOffloader::drop, py::arg("tensor"), py::arg("callback") = py::none())
+        .def("dropv", &DiskOffloader::dropv, py::arg("tensors"), py::arg("callback") = py::none())
+        .def("map", &DiskOffloader::map, py::arg("tensor"), py::arg("advice") = "willneed", py::arg("prefault") = false)
+        .def("erase", &DiskOffloader::erase, py::arg("tensor"))
+        .def("async_write_batch", &DiskOffloader::async_write_batch, py::arg("tensors"), py::arg("callback") = py::none())
+        .def("async_read_batch", &DiskOffloader::async_read_batch, py::arg("tensors"), py::arg("callback") = py::none())
+        .def("sync_write_batch", nogil(&DiskOffloader::sync_write_batch), py::arg("tensors"))
+        .def("sync_read_batch", nogil(&DiskOffloader::sync_read_batch), py::arg("tensors"))
+        .def_static("key", py::overload_cast<const at::Tensor &>(&DiskOffloader::key), py::arg("tensor"))
+        .def_static("key", py::overload_cast<const std::vector<at::Tensor> &>(&DiskOffloader::key), py::arg("tensors"));
+    py::class_<HostArena, std::shared_ptr<HostArena>>(m, "HostArena")
+        .def(py::init<size_t, bool, bool>(), py::arg("max_cached_bytes") = 0, py::arg("hugepage") = false, py::arg("lock") = true)
+        .def("acquire", &HostArena::acquire, py::arg("tensor"))
+        .def("release", &HostArena::release, py::arg("tensor"))
+        .def("trim", &HostArena::trim)
+        .def("allocated_bytes", &HostArena::allocated_bytes)
+        .def("cached_bytes", &HostArena::cached_bytes)
+        .def("n_hits", &HostArena::n_hits)
+        .def("n_misses", &HostArena::n_misses);
+    py::class_<TensorStore>(m, "TensorStore")
+        .def(py::init<const std::string &, ull, unsigned int, const std::string &, const std::string &, unsigned int, std::shared_ptr<HostArena>>(), py::arg("filename"), py::arg("capacity_bytes"), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("policy") = "lru", py::arg("prefetch_depth") = 2, py::arg("arena") = py::none())
+        .def("put", &TensorStore::put, py::arg("key"), py::arg("tensor"))
+        .def("get", &TensorStore::get, py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("prefetch", &TensorStore::prefetch, py::arg("key"))
+        .def("remove", &TensorStore::remove, py::arg("key"))
+        .def("contains", &TensorStore::contains, py::arg("key"))
+        .def("is_resident", &TensorStore::is_resident, py::arg("key"))
+        .def("synchronize", &TensorStore::synchronize, py::call_guard<py::gil_scoped_release>())
+        .def("resident_bytes", &TensorStore::resident_bytes)
+        .def("budget_bytes", &TensorStore::budget_bytes)
+        .def("stats", &TensorStore::stats)
+        .def("set_pressure_limits", &TensorStore::set_pressure_limits, py::arg("max_usage_ratio") = 0.9, py::arg("max_psi_avg10") = 20.0, py::arg("interval_ms") = 100);
+    py::class_<WriteBackCache>(m, "WriteBackCache")
+        .def(py::init<const std::string &, ull, unsigned int, const std::string &>(), py::arg("filename"), py::arg("capacity_bytes"), py::arg("n_entries"), py::arg("backend") = "aio")
+        .def("write", &WriteBackCache::write, py::arg("tensor"), py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("read", &WriteBackCache::read, py::arg("tensor"), py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("pin", &WriteBackCache::pin, py::arg("key"))
+        .def("unpin", &WriteBackCache::unpin, py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("flush", &WriteBackCache::flush, py::arg("key"))
+        .def("flush_all", &WriteBackCache::flush_all)
+        .def("barrier", &WriteBackCache::barrier, py::call_guard<py::gil_scoped_release>())
+        .def("erase", &WriteBackCache::erase, py::arg("key"))
+        .def("contains", &WriteBackCache::contains, py::arg("key"))
+        .def("cached_bytes", &WriteBackCache::cached_bytes)
+        .def("dirty_bytes", &WriteBackCache::dirty_bytes)
+        .def("stats", &WriteBackCache::stats);
+    py::class_<ShardedOffloader>(m, "ShardedOffloader")
+        .def(py::init<const std::string &, unsigned int, unsigned int, const std::string &>(), py::arg("filename"), py::arg("n_shards"), py::arg("n_entries"), py::arg("backend") = "aio")
+        .def("async_write", &ShardedOffloader::async_write, py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none())
+        .def("async_read", &ShardedOffloader::async_read, py::arg("tensor"), py::arg("key"), py::arg("callback") = py::none())
+        .def("sync_write", &ShardedOffloader::sync_write, py::arg("tensor"), py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("sync_read", &ShardedOffloader::sync_read, py::arg("tensor"), py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("erase", &ShardedOffloader::erase, py::arg("key"), py::call_guard<py::gil_scoped_release>())
+        .def("synchronize", &ShardedOffloader::synchronize, py::call_guard<py::gil_scoped_release>())
+        .def("close", &ShardedOffloader::close, py::call_guard<py::gil_scoped_release>())
+        .def("n_shards", &ShardedOffloader::n_shards)
+        .def("shard_of", &ShardedOffloader::shard_of, py::arg("key"));
+    py::class_<PrefetchIterator>(m, "PrefetchIterator")
+        .def(py::init<DiskOffloader &, const std::vector<std::vector<at::Tensor>> &, unsigned int, unsigned int, bool>(), py::arg("offloader"), py::arg("groups"), py::arg("depth") = 2, py::arg("max_depth") = 8, py::arg("adaptive") = true, py::keep_alive<1, 2>())
+        .def("__iter__", [](PrefetchIterator &it) -> PrefetchIterator &
+             { return it; })
+        .def("__next__", [](PrefetchIterator &it)
+             {
+            if (!it.has_next())
+            {
+                it.close();
+                throw py::stop_iteration();
+            }
+            return it.next(); })
+        .def("close", &PrefetchIterator::close)
+        .def("depth", &PrefetchIterator::depth)
+        .def("stall_seconds", &PrefetchIterator::stall_seconds);
     m.def("get_backends", get_backends);
-    m.def("probe_backend", probe_backend, py::arg("backend"));
+    m.def("probe_backend", probe_backend, py::arg("backend"), py::arg("cached") = true);
+    py::class_<IOProfile>(m, "IOProfile")
+        .def(py::init([](const std::string &path, const std::string &backend, unsigned int n_entries, unsigned long long chunk_bytes, double write_bytes_per_sec, double read_bytes_per_sec)
+                      { return IOProfile{path, backend, n_entries, chunk_bytes, write_bytes_per_sec, read_bytes_per_sec}; }),
+             py::arg("path"), py::arg("backend"), py::arg("n_entries"), py::arg("chunk_bytes"), py::arg("write_bytes_per_sec") = 0.0, py::arg("read_bytes_per_sec") = 0.0)
+        .def_readwrite("path", &IOProfile::path)
+        .def_readwrite("backend", &IOProfile::backend)
+        .def_readwrite("n_entries", &IOProfile::n_entries)
+        .def_readwrite("chunk_bytes", &IOProfile::chunk_bytes)
+        .def_readwrite("write_bytes_per_sec", &IOProfile::write_bytes_per_sec)
+        .def_readwrite("read_bytes_per_sec", &IOProfile::read_bytes_per_sec);
+    m.def("get_profile_path", get_profile_path);
+    m.def("find_io_profile", find_io_profile, py::arg("path") = "");
+    m.def("save_io_profile", save_io_profile, py::arg("profile"));
+    m.def("measure_engine", measure_engine, py::arg("path"), py::arg("backend"), py::arg("n_entries"), py::arg("request_bytes"), py::arg("total_bytes"), py::call_guard<py::gil_scoped_release>());
     py::class_<AsyncFileWriter>(m, "AsyncFileWriter")
-        .def(py::init<int, unsigned int, const std::string &, unsigned int>(), py::arg("fd"), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("n_tasks") = 0)
+        .def(py::init<int, unsigned int, const std::string &, unsigned int, std::shared_ptr<SharedEngine>>(), py::arg("fd"), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("n_tasks") = 0, py::arg("engine") = py::none())
         .def("write", &AsyncFileWriter::write, py::arg("buffer"), py::arg("n_bytes"), py::arg("offset"), py::arg("callback") = py::none())
         .def("write_tensor", &AsyncFileWriter::write_tensor, py::arg("tensor"), py::arg("offset"), py::arg("callback") = py::none(), py::arg("pinned") = py::none())
         .def("synchronize", &AsyncFileWriter::synchronize)
         .def("sync_h2d", &AsyncFileWriter::sync_h2d)
         .def("register_h2d", &AsyncFileWriter::register_h2d, py::arg("num_tensors"))
-        .def("register_tasks", &AsyncFileWriter::register_tasks, py::arg("num_tasks"));
+        .def("register_tasks", &AsyncFileWriter::register_tasks, py::arg("num_tasks"))
+        .def("set_priority", &AsyncFileWriter::set_priority, py::arg("priority"))
+        .def("set_io_class", &AsyncFileWriter::set_io_class, py::arg("arbiter"), py::arg("io_class"), py::call_guard<py::gil_scoped_release>());
+    py::class_<IOArbiter, std::shared_ptr<IOArbiter>>(m, "IOArbiter")
+        .def(py::init<unsigned long long, unsigned long long, unsigned int>(), py::arg("bytes_per_sec") = 0, py::arg("iops") = 0, py::arg("max_inflight") = 0)
+        .def("add_class", &IOArbiter::add_class, py::arg("name"), py::arg("weight") = 1.0, py::arg("bytes_per_sec") = 0, py::arg("iops") = 0)
+        .def("stats", &IOArbiter::stats);
+    py::class_<SharedEngine, std::shared_ptr<SharedEngine>>(m, "SharedEngine")
+        .def(py::init<unsigned int, const std::string &, unsigned int>(), py::arg("n_entries"), py::arg("backend") = "aio", py::arg("n_tasks") = 0)
+        .def_static("process", &SharedEngine::process, py::arg("backend") = "aio", py::arg("n_entries") = 64)
+        .def("n_entries", &SharedEngine::n_entries)
+        .def("n_attached", &SharedEngine::n_attached);
 }
\ No newline at end of file
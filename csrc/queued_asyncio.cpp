@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <algorithm>
+#include "queued_asyncio.h"
+
+QueuedAsyncIO::Inflight::~Inflight()
+{
+    if (!this->landed)
+        this->owner->settle(*this->request, false);
+}
+
+QueuedAsyncIO::QueuedAsyncIO(AsyncIO *inner) : inner(inner), has_deadline(false), n_inflight(0), n_writes(0), n_reads(0) {}
+
+QueuedAsyncIO::Request QueuedAsyncIO::make_request(IOType type, unsigned long long bytes, const iovec *iov, std::function<void(callback_t)> submit, callback_t callback)
+{
+    return Request{type, this->tag, this->priorities[type], this->has_deadline, this->deadline, bytes, iov, std::move(submit), callback};
+}
+
+void QueuedAsyncIO::issue(Request request)
+{
+    if (request.type == WRITE)
+        this->n_writes++;
+    else
+        this->n_reads++;
+    enqueue(std::move(request));
+}
+
+void QueuedAsyncIO::submit(std::shared_ptr<Request> request, std::function<void()> landed)
+{
+    this->n_inflight++;
+    std::shared_ptr<Inflight> inflight(new Inflight{this, request, false});
+    this->inner->set_tag(request->tag);
+    if (request->has_deadline)
+        this->inner->set_deadline(std::max(0.0, std::chrono::duration<double>(request->deadline - clock::now()).count()));
+    try
+    {
+        request->submit([this, request, inflight, landed]()
+                        {
+                            inflight->landed = true;
+                            settle(*request, true);
+                            // refill before the callback, which may block
+                            landed();
+                            if (request->callback != nullptr)
+                                request->callback(); });
+    }
+    catch (...)
+    {
+        this->inner->set_tag(this->tag);
+        this->inner->set_deadline(-1);
+        throw;
+    }
+    this->inner->set_tag(this->tag);
+    if (request->has_deadline)
+        this->inner->set_deadline(-1);
+}
+
+void QueuedAsyncIO::settle(const Request &request, bool landed)
+{
+    this->n_inflight--;
+    if (request.type == WRITE)
+        this->n_writes--;
+    else
+        this->n_reads--;
+}
+
+void QueuedAsyncIO::forget(Request &request, std::vector<callback_t> &dropped)
+{
+    if (request.type == WRITE)
+        this->n_writes--;
+    else
+        this->n_reads--;
+    // the engine never saw the array, so it is freed here
+    free(const_cast<iovec *>(request.iov));
+    dropped.push_back(request.callback);
+}
+
+static unsigned long long iov_bytes(const iovec *iov, unsigned int iovcnt)
+{
+    unsigned long long bytes = 0;
+    for (unsigned int i = 0; i < iovcnt; i++)
+        bytes += iov[i].iov_len;
+    return bytes;
+}
+
+void QueuedAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    issue(make_request(
+        WRITE, n_bytes, nullptr, [this, fd, buffer, n_bytes, offset](callback_t done)
+        { this->inner->write(fd, buffer, n_bytes, offset, done); },
+        callback));
+}
+
+void QueuedAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    issue(make_request(
+        READ, n_bytes, nullptr, [this, fd, buffer, n_bytes, offset](callback_t done)
+        { this->inner->read(fd, buffer, n_bytes, offset, done); },
+        callback));
+}
+
+void QueuedAsyncIO::writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
+{
+    issue(make_request(
+        WRITE, iov_bytes(iov, iovcnt), iov, [this, fd, iov, iovcnt, offset](callback_t done)
+        { this->inner->writev(fd, iov, iovcnt, offset, done); },
+        callback));
+}
+
+void QueuedAsyncIO::readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
+{
+    issue(make_request(
+        READ, iov_bytes(iov, iovcnt), iov, [this, fd, iov, iovcnt, offset](callback_t done)
+        { this->inner->readv(fd, iov, iovcnt, offset, done); },
+        callback));
+}
+
+void QueuedAsyncIO::plug()
+{
+    this->inner->plug();
+}
+
+void QueuedAsyncIO::unplug()
+{
+    this->inner->unplug();
+}
+
+void QueuedAsyncIO::get_event(WaitType wt)
+{
+    if (wt == WAIT)
+    {
+        wait();
+        return;
+    }
+    this->inner->get_event(NOWAIT);
+}
+
+void QueuedAsyncIO::sync_write_events()
+{
+    while (this->n_writes > 0)
+        wait();
+    this->inner->sync_write_events();
+}
+
+void QueuedAsyncIO::sync_read_events()
+{
+    while (this->n_reads > 0)
+        wait();
+    this->inner->sync_read_events();
+}
+
+void QueuedAsyncIO::synchronize()
+{
+    while (this->n_writes > 0 || this->n_reads > 0)
+        wait();
+    this->inner->synchronize();
+}
+
+void QueuedAsyncIO::register_h2d(unsigned int num_tensors)
+{
+    this->inner->register_h2d(num_tensors);
+}
+
+void QueuedAsyncIO::register_tasks(unsigned int num_tasks)
+{
+    this->inner->register_tasks(num_tasks);
+}
+
+void QueuedAsyncIO::sync_h2d()
+{
+    this->inner->sync_h2d();
+}
+
+void QueuedAsyncIO::register_file(int fd)
+{
+    this->inner->register_file(fd);
+}
+
+void QueuedAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned)
+{
+    this->inner->write_tensor(fd, t, offset, callback, pinned);
+}
+
+void QueuedAsyncIO::set_priority(IOType type, IOPriority priority)
+{
+    AsyncIO::set_priority(type, priority);
+    this->inner->set_priority(type, priority);
+}
+
+void QueuedAsyncIO::set_deadline(double seconds)
+{
+    this->has_deadline = seconds >= 0;
+    if (this->has_deadline)
+        this->deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+void QueuedAsyncIO::set_tag(unsigned long long tag)
+{
+    AsyncIO::set_tag(tag);
+    this->inner->set_tag(tag);
+}
+
+void QueuedAsyncIO::cancel(unsigned long long tag)
+{
+    std::vector<callback_t> dropped;
+    drop(tag, dropped);
+    this->inner->cancel(tag);
+    for (callback_t &callback : dropped)
+    {
+        if (callback != nullptr)
+            callback();
+    }
+}
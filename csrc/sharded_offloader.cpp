@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <functional>
+#include <stdexcept>
+#include <pybind11/pybind11.h>
+#include "sharded_offloader.h"
+
+namespace py = pybind11;
+
+ShardedOffloader::ShardedOffloader(const std::string &filename, unsigned int n_shards, unsigned int n_entries, const std::string &backend) : stop(false)
+{
+    if (n_shards == 0)
+        throw std::runtime_error("n_shards must be positive");
+    for (unsigned int i = 0; i < n_shards; i++)
+    {
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->offloader.reset(new Offloader(filename + "." + std::to_string(i), n_entries, backend));
+        shard->outstanding = 0;
+        shard->in_flight = 0;
+        shard->sleeping = false;
+        this->shards.push_back(std::move(shard));
+    }
+    for (auto &shard : this->shards)
+        shard->worker = std::thread(&ShardedOffloader::run, this, std::ref(*shard));
+}
+
+ShardedOffloader::~ShardedOffloader()
+{
+    try
+    {
+        if (Py_IsInitialized() && PyGILState_Check())
+        {
+            py::gil_scoped_release release;
+            close();
+        }
+        else
+            close();
+    }
+    catch (const std::exception &e)
+    {
+        printf("%s\n", e.what());
+    }
+}
+
+void ShardedOffloader::close()
+{
+    if (this->stop)
+        return;
+    std::exception_ptr error;
+    try
+    {
+        synchronize();
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    this->stop = true;
+    for (auto &shard : this->shards)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shard->mtx);
+        }
+        shard->cv.notify_one();
+        shard->worker.join();
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+unsigned int ShardedOffloader::n_shards() const
+{
+    return this->shards.size();
+}
+
+unsigned int ShardedOffloader::shard_of(const std::string &key) const
+{
+    return std::hash<std::string>()(key) % this->shards.size();
+}
+
+void ShardedOffloader::enqueue(ShardRequest request)
+{
+    if (this->stop)
+        throw std::runtime_error("The sharded offloader is closed");
+    Shard &shard = *this->shards[shard_of(request.key)];
+    shard.outstanding++;
+    shard.queue.push(std::move(request));
+    // pairs with the fence of the worker, either it sees the request or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shard.sleeping)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+        }
+        shard.cv.notify_one();
+    }
+}
+
+void ShardedOffloader::wait_sync(ShardRequest request)
+{
+    request.done = std::make_shared<std::promise<void>>();
+    std::future<void> future = request.done->get_future();
+    enqueue(std::move(request));
+    future.get();
+}
+
+void ShardedOffloader::async_write(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    enqueue(ShardRequest{SHARD_WRITE, tensor, key, callback, nullptr});
+}
+
+void ShardedOffloader::async_read(const at::Tensor &tensor, const std::string &key, callback_t callback)
+{
+    enqueue(ShardRequest{SHARD_READ, tensor, key, callback, nullptr});
+}
+
+void ShardedOffloader::sync_write(const at::Tensor &tensor, const std::string &key)
+{
+    wait_sync(ShardRequest{SHARD_WRITE, tensor, key, nullptr, nullptr});
+}
+
+void ShardedOffloader::sync_read(const at::Tensor &tensor, const std::string &key)
+{
+    wait_sync(ShardRequest{SHARD_READ, tensor, key, nullptr, nullptr});
+}
+
+void ShardedOffloader::erase(const std::string &key)
+{
+    wait_sync(ShardRequest{SHARD_ERASE, at::Tensor(), key, nullptr, nullptr});
+}
+
+void ShardedOffloader::synchronize()
+{
+    std::unique_lock<std::mutex> lock(this->idle_mtx);
+    this->idle_cv.wait(lock, [this]()
+                       {
+        for (auto &shard : this->shards)
+            if (shard->outstanding > 0)
+                return false;
+        return true; });
+    if (this->error)
+    {
+        std::exception_ptr error = this->error;
+        this->error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void ShardedOffloader::finish(Shard &shard, const ShardRequest &request, std::exception_ptr error)
+{
+    if (request.done)
+    {
+        if (error)
+            request.done->set_exception(error);
+        else
+            request.done->set_value();
+    }
+    std::lock_guard<std::mutex> lock(this->idle_mtx);
+    if (error && !request.done && !this->error)
+        this->error = error;
+    if (--shard.outstanding == 0)
+        this->idle_cv.notify_all();
+}
+
+void ShardedOffloader::execute(Shard &shard, ShardRequest &request)
+{
+    if (request.op == SHARD_ERASE)
+    {
+        shard.offloader->erase(request.key);
+        finish(shard, request, nullptr);
+        return;
+    }
+    auto request_ptr = std::make_shared<ShardRequest>(std::move(request));
+    auto callback = [this, &shard, request_ptr]()
+    {
+        shard.in_flight--;
+        std::exception_ptr error;
+        try
+        {
+            if (request_ptr->callback != nullptr)
+                request_ptr->callback();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        finish(shard, *request_ptr, error);
+    };
+    shard.in_flight++;
+    try
+    {
+        if (request_ptr->op == SHARD_WRITE)
+            shard.offloader->async_write(request_ptr->tensor, request_ptr->key, callback);
+        else
+            shard.offloader->async_read(request_ptr->tensor, request_ptr->key, callback);
+    }
+    catch (...)
+    {
+        // the request was rejected before its submission
+        shard.in_flight--;
+        finish(shard, *request_ptr, std::current_exception());
+    }
+}
+
+void ShardedOffloader::run(Shard &shard)
+{
+    ShardRequest request;
+    while (true)
+    {
+        while (shard.queue.pop(request))
+        {
+            try
+            {
+                execute(shard, request);
+            }
+            catch (...)
+            {
+                finish(shard, request, std::current_exception());
+            }
+        }
+        try
+        {
+            if (shard.in_flight > 0)
+            {
+                // new requests wait for at most one completion
+                shard.offloader->poll(true);
+                continue;
+            }
+        }
+        catch (...)
+        {
+            // the failed requests never complete, drain the engine and drop them
+            std::exception_ptr error = std::current_exception();
+            while (true)
+            {
+                try
+                {
+                    shard.offloader->synchronize();
+                    break;
+                }
+                catch (...)
+                {
+                }
+            }
+            std::lock_guard<std::mutex> lock(this->idle_mtx);
+            if (!this->error)
+                this->error = error;
+            shard.outstanding -= shard.in_flight;
+            shard.in_flight = 0;
+            if (shard.outstanding == 0)
+                this->idle_cv.notify_all();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(shard.mtx);
+        shard.sleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        shard.cv.wait(lock, [this, &shard]()
+                      { return this->stop || !shard.queue.empty(); });
+        shard.sleeping = false;
+        if (this->stop && shard.queue.empty())
+            return;
+    }
+}
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include "backend.h"
+#include "shared_engine.h"
+
+// tags of a front-end are moved into its own range of engine tags, above the tags it uses itself
+static const int tag_bits = 40;
+// a waiter which shares the engine polls it, sleeping between polls for up to this long
+static const std::chrono::microseconds max_reap_interval(200);
+
+SharedEngine::SharedEngine(unsigned int n_entries, const std::string &backend, unsigned int n_tasks) : inner(create_asyncio(n_entries, backend, n_tasks)), entries(get_n_entries(n_entries, "")), next_id(1), n_views(0), n_landed(0) {}
+
+std::shared_ptr<SharedEngine> SharedEngine::process(const std::string &backend, unsigned int n_entries)
+{
+    static std::mutex mtx;
+    static std::unordered_map<std::string, std::shared_ptr<SharedEngine>> engines;
+    std::lock_guard<std::mutex> lock(mtx);
+    std::shared_ptr<SharedEngine> &engine = engines[backend];
+    if (engine == nullptr)
+        engine = std::make_shared<SharedEngine>(n_entries, backend);
+    return engine;
+}
+
+AsyncIO *SharedEngine::attach()
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    this->n_views++;
+    return new SharedAsyncIO(shared_from_this(), this->next_id++);
+}
+
+unsigned int SharedEngine::n_entries() const
+{
+    return this->entries;
+}
+
+unsigned int SharedEngine::n_attached()
+{
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->n_views;
+}
+
+SharedAsyncIO::Request::~Request()
+{
+    // engines drop a failed request while they are called, so the engine lock is held here
+    if (!this->landed)
+        this->view->landed(*this, true);
+}
+
+SharedAsyncIO::SharedAsyncIO(std::shared_ptr<SharedEngine> shared, unsigned long long id) : shared(shared), id(id), n_inflight(0), n_writes(0), n_reads(0), plugged(false) {}
+
+SharedAsyncIO::~SharedAsyncIO()
+{
+    synchronize();
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    this->shared->n_views--;
+}
+
+void SharedAsyncIO::submit(IOType type, std::function<void(callback_t)> submit, callback_t callback)
+{
+    std::shared_ptr<Request> request(new Request{this, type, (this->id << tag_bits) | this->tag, callback, false});
+    if (type == WRITE)
+        this->n_writes++;
+    else
+        this->n_reads++;
+    if (this->plugged)
+    {
+        this->plugged_requests.emplace_back(request, std::move(submit));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    try
+    {
+        issue(request, submit);
+    }
+    catch (...)
+    {
+        if (type == WRITE)
+            this->n_writes--;
+        else
+            this->n_reads--;
+        throw;
+    }
+}
+
+void SharedAsyncIO::issue(std::shared_ptr<Request> request, const std::function<void(callback_t)> &submit)
+{
+    AsyncIO *inner = this->shared->inner.get();
+    inner->set_priority(request->type, this->priorities[request->type]);
+    inner->set_tag(request->engine_tag);
+    this->n_inflight++;
+    this->tags[request->engine_tag]++;
+    try
+    {
+        submit([request]()
+               { request->view->landed(*request, false); });
+    }
+    catch (...)
+    {
+        inner->set_tag(0);
+        request->landed = true;
+        this->n_inflight--;
+        if (--this->tags[request->engine_tag] == 0)
+            this->tags.erase(request->engine_tag);
+        throw;
+    }
+    inner->set_tag(0);
+}
+
+void SharedAsyncIO::landed(Request &request, bool failed)
+{
+    request.landed = true;
+    this->n_inflight--;
+    if (--this->tags[request.engine_tag] == 0)
+        this->tags.erase(request.engine_tag);
+    this->completed.push_back(Completion{request.type, request.callback, failed});
+    this->shared->n_landed++;
+}
+
+void SharedAsyncIO::reap(WaitType wt)
+{
+    unsigned long long n_landed = this->shared->n_landed;
+    try
+    {
+        this->shared->inner->get_event(wt);
+    }
+    catch (const std::exception &e)
+    {
+        // the failed request may belong to another front-end, it is reported there
+        printf("%s\n", e.what());
+    }
+    if (this->shared->n_landed != n_landed)
+        this->shared->reaped.notify_all();
+}
+
+void SharedAsyncIO::run_completed()
+{
+    std::deque<Completion> ready;
+    {
+        std::lock_guard<std::mutex> lock(this->shared->mtx);
+        ready.swap(this->completed);
+    }
+    bool failed = false;
+    IOType failed_type = WRITE;
+    for (Completion &completion : ready)
+    {
+        if (completion.type == WRITE)
+            this->n_writes--;
+        else
+            this->n_reads--;
+        if (completion.failed)
+        {
+            failed = true;
+            failed_type = completion.type;
+        }
+        else if (completion.callback != nullptr)
+            completion.callback();
+    }
+    if (failed)
+        throw std::runtime_error(std::string(failed_type == WRITE ? "Write" : "Read") + " error on the shared engine");
+}
+
+void SharedAsyncIO::wait()
+{
+    {
+        std::unique_lock<std::mutex> lock(this->shared->mtx);
+        std::chrono::microseconds interval(1);
+        while (this->completed.empty() && this->n_inflight > 0)
+        {
+            // a front-end alone blocks nobody, the engine has a request of it in flight so the wait ends
+            if (this->shared->n_views == 1)
+            {
+                reap(WAIT);
+                break;
+            }
+            // the kernel wait would hold the lock, so others could neither submit nor reap in the meantime
+            reap(NOWAIT);
+            if (!this->completed.empty())
+                break;
+            this->shared->reaped.wait_for(lock, interval);
+            interval = std::min(2 * interval, max_reap_interval);
+        }
+        if (this->completed.empty())
+            reap(NOWAIT);
+    }
+    run_completed();
+}
+
+void SharedAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    submit(
+        WRITE, [this, fd, buffer, n_bytes, offset](callback_t done)
+        { this->shared->inner->write(fd, buffer, n_bytes, offset, done); },
+        callback);
+}
+
+void SharedAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    submit(
+        READ, [this, fd, buffer, n_bytes, offset](callback_t done)
+        { this->shared->inner->read(fd, buffer, n_bytes, offset, done); },
+        callback);
+}
+
+void SharedAsyncIO::writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
+{
+    submit(
+        WRITE, [this, fd, iov, iovcnt, offset](callback_t done)
+        { this->shared->inner->writev(fd, iov, iovcnt, offset, done); },
+        callback);
+}
+
+void SharedAsyncIO::readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
+{
+    submit(
+        READ, [this, fd, iov, iovcnt, offset](callback_t done)
+        { this->shared->inner->readv(fd, iov, iovcnt, offset, done); },
+        callback);
+}
+
+void SharedAsyncIO::plug()
+{
+    this->plugged = true;
+}
+
+void SharedAsyncIO::unplug()
+{
+    this->plugged = false;
+    std::vector<std::pair<std::shared_ptr<Request>, std::function<void(callback_t)>>> requests;
+    requests.swap(this->plugged_requests);
+    if (requests.empty())
+        return;
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    AsyncIO *inner = this->shared->inner.get();
+    inner->plug();
+    size_t n_issued = 0;
+    try
+    {
+        for (; n_issued < requests.size(); n_issued++)
+            issue(requests[n_issued].first, requests[n_issued].second);
+    }
+    catch (...)
+    {
+        // the failed request and the ones after it are not issued
+        for (size_t i = n_issued; i < requests.size(); i++)
+        {
+            requests[i].first->landed = true;
+            if (requests[i].first->type == WRITE)
+                this->n_writes--;
+            else
+                this->n_reads--;
+        }
+        inner->unplug();
+        throw;
+    }
+    inner->unplug();
+}
+
+void SharedAsyncIO::get_event(WaitType wt)
+{
+    if (wt == WAIT)
+    {
+        wait();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->shared->mtx);
+        reap(NOWAIT);
+    }
+    run_completed();
+}
+
+void SharedAsyncIO::sync_write_events()
+{
+    while (this->n_writes > 0)
+        wait();
+}
+
+void SharedAsyncIO::sync_read_events()
+{
+    while (this->n_reads > 0)
+        wait();
+}
+
+void SharedAsyncIO::synchronize()
+{
+    // only the requests of this front-end are waited for
+    while (this->n_writes > 0 || this->n_reads > 0)
+        wait();
+}
+
+void SharedAsyncIO::register_h2d(unsigned int num_tensors)
+{
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    this->shared->inner->register_h2d(num_tensors);
+}
+
+void SharedAsyncIO::register_tasks(unsigned int num_tasks)
+{
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    this->shared->inner->register_tasks(num_tasks);
+}
+
+void SharedAsyncIO::sync_h2d()
+{
+    // the pthread engine waits on its own condition variable, the others return right away
+    this->shared->inner->sync_h2d();
+}
+
+void SharedAsyncIO::register_file(int fd)
+{
+    std::lock_guard<std::mutex> lock(this->shared->mtx);
+    this->shared->inner->register_file(fd);
+}
+
+void SharedAsyncIO::write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned)
+{
+    submit(
+        WRITE, [this, fd, t, offset, pinned](callback_t done)
+        { this->shared->inner->write_tensor(fd, t, offset, done, pinned); },
+        callback);
+}
+
+void SharedAsyncIO::cancel(unsigned long long tag)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->shared->mtx);
+        // plugged requests never reach the engine
+        std::vector<std::pair<std::shared_ptr<Request>, std::function<void(callback_t)>>> kept;
+        for (auto &item : this->plugged_requests)
+        {
+            Request &request = *item.first;
+            if (tag != 0 && request.engine_tag != ((this->id << tag_bits) | tag))
+            {
+                kept.push_back(std::move(item));
+                continue;
+            }
+            request.landed = true;
+            this->completed.push_back(Completion{request.type, request.callback, false});
+        }
+        this->plugged_requests.swap(kept);
+        if (tag != 0)
+            this->shared->inner->cancel((this->id << tag_bits) | tag);
+        else
+        {
+            std::vector<unsigned long long> engine_tags;
+            for (const auto &item : this->tags)
+                engine_tags.push_back(item.first);
+            for (unsigned long long engine_tag : engine_tags)
+                this->shared->inner->cancel(engine_tag);
+        }
+    }
+    run_completed();
+}
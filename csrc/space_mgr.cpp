@@ -65,12 +65,87 @@ void SpaceManager::free(ull offset, ull bytes)
             iter++;
         }
     }
-    if (offset + bytes == used_bytes)
-        used_bytes = used_bytes - bytes;
+    // merged space reaches the end, shrink the high-water mark
+    if (new_avail_space.first + new_avail_space.second == used_bytes)
+        used_bytes = new_avail_space.first;
     else
         avail_spaces.push_back(new_avail_space);
 }
 
+void SpaceManager::claim(ull offset, ull bytes)
+{
+    if (bytes == 0)
+        throw std::runtime_error("Invalid claim size (0)");
+    if (offset >= used_bytes)
+    {
+        if (limit > 0 && offset + bytes > limit)
+            throw std::runtime_error("File size exceed limit");
+        if (offset > used_bytes)
+            avail_spaces.push_back(SpaceInfo(used_bytes, offset - used_bytes));
+        used_bytes = offset + bytes;
+        return;
+    }
+    for (auto iter = avail_spaces.begin(); iter != avail_spaces.end(); iter++)
+    {
+        if (iter->first <= offset && offset + bytes <= iter->first + iter->second)
+        {
+            SpaceInfo head(iter->first, offset - iter->first);
+            SpaceInfo tail(offset + bytes, iter->first + iter->second - offset - bytes);
+            avail_spaces.erase(iter);
+            if (head.second > 0)
+                avail_spaces.push_back(head);
+            if (tail.second > 0)
+                avail_spaces.push_back(tail);
+            return;
+        }
+    }
+    throw std::runtime_error("Claim error, space is in use");
+}
+
+void SpaceManager::restore(ull used_bytes, const vector<SpaceInfo> &avail_spaces)
+{
+    this->used_bytes = used_bytes;
+    this->avail_spaces = avail_spaces;
+}
+
+const vector<SpaceInfo> &SpaceManager::get_avail_spaces() const
+{
+    return avail_spaces;
+}
+
+bool SpaceManager::alloc_below(ull bytes, ull bound, ull &offset)
+{
+    if (bytes == 0)
+        throw std::runtime_error("Invalid alloc size (0)");
+    auto target_iter = avail_spaces.end();
+    for (auto iter = avail_spaces.begin(); iter != avail_spaces.end(); iter++)
+    {
+        if (iter->second >= bytes && iter->first + bytes <= bound && (target_iter == avail_spaces.end() || iter->first < target_iter->first))
+            target_iter = iter;
+    }
+    if (target_iter == avail_spaces.end())
+        return false;
+    offset = target_iter->first;
+    target_iter->first += bytes;
+    target_iter->second -= bytes;
+    if (target_iter->second == 0)
+        avail_spaces.erase(target_iter);
+    return true;
+}
+
+ull SpaceManager::get_used_bytes() const
+{
+    return used_bytes;
+}
+
+ull SpaceManager::get_free_bytes() const
+{
+    ull free_bytes = 0;
+    for (auto iter = avail_spaces.begin(); iter != avail_spaces.end(); iter++)
+        free_bytes += iter->second;
+    return free_bytes;
+}
+
 void SpaceManager::print()
 {
     printf("Used bytes: %lld", used_bytes);
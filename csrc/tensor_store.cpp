@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "tensor_store.h"
+#include "disk_offloader.h"
+
+static std::string find_cgroup_dir()
+{
+    // cgroup v2 entry of the process is "0::<path>"
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.compare(0, 3, "0::") != 0)
+            continue;
+        std::string dir = "/sys/fs/cgroup" + line.substr(3);
+        if (access((dir + "/memory.current").c_str(), R_OK) == 0)
+            return dir;
+    }
+    return "";
+}
+
+static bool read_value(const std::string &path, ull &value)
+{
+    std::ifstream file(path);
+    std::string text;
+    if (!(file >> text) || text == "max")
+        return false;
+    value = std::stoull(text);
+    return true;
+}
+
+static double read_psi_avg10(const std::string &path)
+{
+    // "some avg10=1.23 avg60=... total=..."
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.compare(0, 5, "some ") != 0)
+            continue;
+        size_t pos = line.find("avg10=");
+        if (pos != std::string::npos)
+            return std::stod(line.substr(pos + 6));
+    }
+    return 0.0;
+}
+
+TensorStore::TensorStore(const std::string &filename, ull capacity_bytes, unsigned int n_entries, const std::string &backend, const std::string &policy, unsigned int prefetch_depth, std::shared_ptr<HostArena> arena) : offloader(filename, n_entries, backend, false, true), arena(arena), capacity_bytes(capacity_bytes), lfu(policy == "lfu"), prefetch_depth(prefetch_depth), resident(0), spilling(0), tick(0), next_seq(0), n_hits(0), n_misses(0), n_spills(0), n_clean_spills(0), n_prefetches(0), cgroup_dir(find_cgroup_dir()), max_usage_ratio(0.9), max_psi_avg10(20.0), pressure_interval(100), pressure_budget(capacity_bytes)
+{
+    if (policy != "lru" && policy != "lfu")
+        throw std::runtime_error("Unknown eviction policy: " + policy);
+}
+
+TensorStore::~TensorStore()
+{
+    // completions refer to entries, run them while the store is alive
+    this->offloader.synchronize();
+}
+
+void TensorStore::set_pressure_limits(double max_usage_ratio, double max_psi_avg10, unsigned int interval_ms)
+{
+    this->max_usage_ratio = max_usage_ratio;
+    this->max_psi_avg10 = max_psi_avg10;
+    this->pressure_interval = std::chrono::milliseconds(interval_ms);
+}
+
+std::tuple<ull, ull, std::string> TensorStore::priority(const std::string &key, const Entry &entry) const
+{
+    return std::make_tuple(this->lfu ? entry.freq : 0, entry.tick, key);
+}
+
+void TensorStore::touch(const std::string &key, Entry &entry)
+{
+    // resident entries are kept in victims, the others are not evictable
+    if (entry.state == STORE_RESIDENT)
+        this->victims.erase(priority(key, entry));
+    entry.freq++;
+    entry.tick = ++this->tick;
+    entry.state = STORE_RESIDENT;
+    this->victims.insert(priority(key, entry));
+}
+
+void TensorStore::put(const std::string &key, const at::Tensor &tensor)
+{
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    if (this->entries.count(key))
+        remove(key);
+    Entry &entry = this->entries[key];
+    entry.tensor = tensor;
+    entry.bytes = tensor.storage().nbytes();
+    // not evictable until touch() makes it resident
+    entry.state = STORE_SPILLED;
+    entry.on_disk = false;
+    entry.freq = 0;
+    entry.seq = this->next_seq++;
+    entry.spill_gen = 0;
+    this->put_order[entry.seq] = key;
+    this->resident += entry.bytes;
+    touch(key, entry);
+    make_room(&key);
+}
+
+at::Tensor TensorStore::get(const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter == this->entries.end())
+        throw std::runtime_error("Get error, key not found");
+    Entry &entry = iter->second;
+    switch (entry.state)
+    {
+    case STORE_RESIDENT:
+        this->n_hits++;
+        break;
+    case STORE_SPILLING:
+        // still in DRAM, the completion sees the new state and keeps the storage; a later spill gets a new
+        // generation, so this completion does not release the storage under the later write
+        this->n_hits++;
+        this->spilling -= entry.bytes;
+        break;
+    case STORE_LOADING:
+        this->n_hits++;
+        while (entry.state == STORE_LOADING)
+            this->offloader.sync_read_events();
+        break;
+    case STORE_SPILLED:
+    {
+        this->n_misses++;
+        load(key, entry, true);
+        // misses are likely to continue in put order
+        unsigned int n_prefetched = 0;
+        for (auto next = this->put_order.upper_bound(entry.seq); next != this->put_order.end() && n_prefetched < this->prefetch_depth; ++next)
+        {
+            Entry &candidate = this->entries.at(next->second);
+            if (candidate.state != STORE_SPILLED)
+                continue;
+            if (this->resident - this->spilling + candidate.bytes > budget_bytes())
+                break;
+            load(next->second, candidate, false);
+            this->n_prefetches++;
+            n_prefetched++;
+        }
+        break;
+    }
+    }
+    touch(key, entry);
+    make_room(&key);
+    return entry.tensor;
+}
+
+void TensorStore::prefetch(const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter == this->entries.end())
+        throw std::runtime_error("Prefetch error, key not found");
+    if (iter->second.state != STORE_SPILLED)
+        return;
+    load(key, iter->second, false);
+    this->n_prefetches++;
+    make_room(&key);
+}
+
+void TensorStore::load(const std::string &key, Entry &entry, bool wait)
+{
+    DiskOffloader::allocate(entry.tensor, this->arena.get());
+    this->resident += entry.bytes;
+    if (wait)
+    {
+        // the caller makes the entry resident
+        this->offloader.sync_read(entry.tensor, key);
+        return;
+    }
+    entry.state = STORE_LOADING;
+    this->offloader.async_read(entry.tensor, key, [this, key]()
+                               {
+        Entry &loaded = this->entries.at(key);
+        if (loaded.state == STORE_LOADING)
+            touch(key, loaded); });
+}
+
+void TensorStore::spill(const std::string &key, Entry &entry)
+{
+    this->victims.erase(priority(key, entry));
+    entry.state = STORE_SPILLING;
+    this->spilling += entry.bytes;
+    this->n_spills++;
+    ull gen = ++entry.spill_gen;
+    auto callback = [this, key, gen]()
+    {
+        Entry &spilled = this->entries.at(key);
+        if (spilled.state != STORE_SPILLING || spilled.spill_gen != gen)
+            return;
+        DiskOffloader::release(spilled.tensor);
+        spilled.state = STORE_SPILLED;
+        this->spilling -= spilled.bytes;
+        this->resident -= spilled.bytes;
+    };
+    // tensors which are unchanged since they were read back are released without a write
+    if (this->offloader.drop(entry.tensor, key, callback))
+        this->n_clean_spills++;
+    entry.on_disk = true;
+}
+
+void TensorStore::make_room(const std::string *protect)
+{
+    ull budget = budget_bytes();
+    auto victim = this->victims.begin();
+    while (this->resident - this->spilling > budget && victim != this->victims.end())
+    {
+        const std::string key = std::get<2>(*victim);
+        ++victim;
+        if (protect != nullptr && key == *protect)
+            continue;
+        spill(key, this->entries.at(key));
+    }
+}
+
+void TensorStore::remove(const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter == this->entries.end())
+        throw std::runtime_error("Remove error, key not found");
+    if (iter->second.state == STORE_SPILLING || iter->second.state == STORE_LOADING)
+        this->offloader.synchronize();
+    Entry &entry = iter->second;
+    if (entry.state == STORE_RESIDENT)
+    {
+        this->victims.erase(priority(key, entry));
+        this->resident -= entry.bytes;
+    }
+    if (entry.on_disk)
+        this->offloader.erase(key);
+    this->put_order.erase(entry.seq);
+    this->entries.erase(iter);
+}
+
+bool TensorStore::contains(const std::string &key) const
+{
+    return this->entries.count(key) > 0;
+}
+
+bool TensorStore::is_resident(const std::string &key) const
+{
+    auto iter = this->entries.find(key);
+    return iter != this->entries.end() && iter->second.state != STORE_SPILLED;
+}
+
+void TensorStore::synchronize()
+{
+    this->offloader.synchronize();
+}
+
+ull TensorStore::resident_bytes() const
+{
+    return this->resident;
+}
+
+ull TensorStore::budget_bytes()
+{
+    update_pressure();
+    return std::min(this->capacity_bytes, this->pressure_budget);
+}
+
+void TensorStore::update_pressure()
+{
+    if (this->cgroup_dir.empty())
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (now - this->last_pressure_check < this->pressure_interval)
+        return;
+    this->last_pressure_check = now;
+    ull budget = this->capacity_bytes;
+    ull current, limit;
+    if (read_value(this->cgroup_dir + "/memory.current", current) && read_value(this->cgroup_dir + "/memory.max", limit))
+    {
+        // give back what the cgroup uses above the high watermark
+        ull high = static_cast<ull>(limit * this->max_usage_ratio);
+        if (current > high)
+            budget = std::min(budget, this->resident > current - high ? this->resident - (current - high) : 0);
+    }
+    if (this->max_psi_avg10 > 0 && read_psi_avg10(this->cgroup_dir + "/memory.pressure") > this->max_psi_avg10)
+        budget = std::min(budget, this->resident / 10 * 9);
+    this->pressure_budget = budget;
+}
+
+std::unordered_map<std::string, ull> TensorStore::stats() const
+{
+    return {
+        {"hits", this->n_hits},
+        {"misses", this->n_misses},
+        {"spills", this->n_spills},
+        {"clean_spills", this->n_clean_spills},
+        {"prefetches", this->n_prefetches},
+        {"resident_bytes", this->resident},
+        {"keys", this->entries.size()},
+    };
+}
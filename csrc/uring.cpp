@@ -2,7 +2,7 @@
 #include <memory>
 #include "uring.h"
 
-UringAsyncIO::UringAsyncIO(unsigned int n_entries, unsigned int n_tasks) : n_write_events(0), n_read_events(0), n_entries(n_entries)
+UringAsyncIO::UringAsyncIO(unsigned int n_entries, unsigned int n_tasks) : n_write_events(0), n_read_events(0), n_entries(n_entries), plugged(false)
 {
     io_uring_queue_init(n_entries, &this->ring, 0);
 }
@@ -33,37 +33,113 @@ void UringAsyncIO::get_event(WaitType wt)
     }
 
     std::unique_ptr<IOData> data(static_cast<IOData *>(io_uring_cqe_get_data(cqe)));
-    if (data->type == WRITE)
+    int res = cqe->res;
+    io_uring_cqe_seen(&this->ring, cqe);
+    // completion of a cancel request
+    if (data == nullptr)
+        return;
+    bool done = true;
+    try
+    {
+        done = data->advance(res);
+    }
+    catch (...)
+    {
+        this->inflight.erase(data.get());
+        done_event(data->type);
+        throw;
+    }
+    if (!done)
+    {
+        // short transfer, the event stays in flight
+        submit(data.release());
+        return;
+    }
+    this->inflight.erase(data.get());
+    done_event(data->type);
+    if (data->callback != nullptr)
+        data->callback();
+}
+
+void UringAsyncIO::done_event(IOType type)
+{
+    if (type == WRITE)
         this->n_write_events--;
-    else if (data->type == READ)
+    else if (type == READ)
         this->n_read_events--;
     else
         throw std::runtime_error("Unknown IO event type");
-    io_uring_cqe_seen(&this->ring, cqe);
-    if (data->callback != nullptr)
-        data->callback();
 }
 
-void UringAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+void UringAsyncIO::submit(IOData *data)
 {
-    io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
-    IOData *data = new IOData(WRITE, callback);
-    io_uring_prep_write(sqe, fd, buffer, n_bytes, offset);
+    io_uring_sqe *sqe = get_sqe();
+    if (data->type == WRITE)
+        io_uring_prep_write(sqe, data->fd, data->buffer, data->n_bytes, data->offset);
+    else
+        io_uring_prep_read(sqe, data->fd, data->buffer, data->n_bytes, data->offset);
+    sqe->ioprio = ioprio_value(this->priorities[data->type]);
     io_uring_sqe_set_data(sqe, data);
+    if (!this->plugged)
+        io_uring_submit(&this->ring);
+}
+
+io_uring_sqe *UringAsyncIO::get_sqe()
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+    while (sqe == nullptr)
+    {
+        // the submission queue is full while plugged, hand it to the kernel
+        io_uring_submit(&this->ring);
+        sqe = io_uring_get_sqe(&this->ring);
+    }
+    return sqe;
+}
+
+void UringAsyncIO::plug()
+{
+    this->plugged = true;
+}
+
+void UringAsyncIO::unplug()
+{
+    this->plugged = false;
     io_uring_submit(&this->ring);
+}
+
+void UringAsyncIO::write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
+{
+    IOData *data = new IOData(WRITE, callback, fd, buffer, n_bytes, offset);
+    data->tag = this->tag;
+    this->inflight.insert(data);
+    submit(data);
     this->n_write_events++;
 }
 
 void UringAsyncIO::read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback)
 {
-    io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
-    IOData *data = new IOData(READ, callback);
-    io_uring_prep_read(sqe, fd, buffer, n_bytes, offset);
-    io_uring_sqe_set_data(sqe, data);
-    io_uring_submit(&this->ring);
+    IOData *data = new IOData(READ, callback, fd, buffer, n_bytes, offset);
+    data->tag = this->tag;
+    this->inflight.insert(data);
+    submit(data);
     this->n_read_events++;
 }
 
+void UringAsyncIO::cancel(unsigned long long tag)
+{
+    for (IOData *data : this->inflight)
+    {
+        if (data->cancelled || (tag != 0 && data->tag != tag))
+            continue;
+        data->cancelled = true;
+        io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_cancel(sqe, data, 0);
+        io_uring_sqe_set_data(sqe, nullptr);
+    }
+    if (!this->plugged)
+        io_uring_submit(&this->ring);
+}
+
 void UringAsyncIO::sync_write_events()
 {
     while (this->n_write_events > 0)
@@ -84,21 +160,29 @@ void UringAsyncIO::synchronize()
 
 void UringAsyncIO::writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
-    io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+    io_uring_sqe *sqe = get_sqe();
     IOData *data = new IOData(WRITE, callback, iov);
+    data->tag = this->tag;
+    this->inflight.insert(data);
     io_uring_prep_writev(sqe, fd, iov, iovcnt, offset);
+    sqe->ioprio = ioprio_value(this->priorities[WRITE]);
     io_uring_sqe_set_data(sqe, data);
-    io_uring_submit(&this->ring);
+    if (!this->plugged)
+        io_uring_submit(&this->ring);
     this->n_write_events++;
 }
 
 void UringAsyncIO::readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback)
 {
-    io_uring_sqe *sqe = io_uring_get_sqe(&this->ring);
+    io_uring_sqe *sqe = get_sqe();
     IOData *data = new IOData(READ, callback, iov);
+    data->tag = this->tag;
+    this->inflight.insert(data);
     io_uring_prep_readv(sqe, fd, iov, iovcnt, offset);
+    sqe->ioprio = ioprio_value(this->priorities[READ]);
     io_uring_sqe_set_data(sqe, data);
-    io_uring_submit(&this->ring);
+    if (!this->plugged)
+        io_uring_submit(&this->ring);
     this->n_read_events++;
 }
 
@@ -0,0 +1,222 @@
+#include <stdexcept>
+#include "write_back_cache.h"
+
+WriteBackCache::WriteBackCache(const std::string &filename, ull capacity_bytes, unsigned int n_entries, const std::string &backend) : offloader(filename, n_entries, backend, false, true), capacity_bytes(capacity_bytes), cached(0), dirty(0), tick(0), n_hits(0), n_misses(0), n_writes(0), n_absorbed(0), n_flushes(0), n_evictions(0), n_bypassed(0)
+{
+}
+
+WriteBackCache::~WriteBackCache()
+{
+    // completions refer to entries, run them while the cache is alive
+    this->offloader.synchronize();
+}
+
+void WriteBackCache::touch(const std::string &key, Entry &entry)
+{
+    bool evictable = !this->pinned.count(key);
+    if (evictable)
+        this->victims.erase(std::make_pair(entry.tick, key));
+    entry.tick = ++this->tick;
+    if (evictable)
+        this->victims.insert(std::make_pair(entry.tick, key));
+}
+
+void WriteBackCache::insert(const std::string &key, const at::Tensor &buffer, bool dirty)
+{
+    ull bytes = buffer.storage().nbytes();
+    make_room(bytes);
+    Entry &entry = this->entries[key];
+    entry.buffer = buffer;
+    entry.bytes = bytes;
+    entry.dirty = dirty;
+    entry.tick = 0;
+    this->cached += bytes;
+    if (dirty)
+        this->dirty += bytes;
+    touch(key, entry);
+}
+
+void WriteBackCache::make_room(ull bytes)
+{
+    while (this->cached + bytes > this->capacity_bytes && !this->victims.empty())
+    {
+        const std::string key = this->victims.begin()->second;
+        Entry &entry = this->entries.at(key);
+        // the in-flight write keeps the buffer alive until it is on disk
+        if (entry.dirty)
+            write_back(key, entry);
+        this->victims.erase(this->victims.begin());
+        this->cached -= entry.bytes;
+        this->entries.erase(key);
+        this->n_evictions++;
+    }
+}
+
+void WriteBackCache::wait_written(const std::string &key)
+{
+    while (this->writing.count(key))
+        this->offloader.sync_write_events();
+}
+
+void WriteBackCache::write_back(const std::string &key, Entry &entry)
+{
+    // writes of the same key must not overlap, the older one could land last
+    wait_written(key);
+    this->writing.insert(key);
+    this->dirty -= entry.bytes;
+    entry.dirty = false;
+    this->n_flushes++;
+    this->on_disk.insert(key);
+    // the callback holds the buffer, evicted entries are freed once their write completes
+    at::Tensor buffer = entry.buffer;
+    this->offloader.async_write(buffer, key, [this, key, buffer]()
+                                { this->writing.erase(key); });
+}
+
+void WriteBackCache::write(const at::Tensor &tensor, const std::string &key)
+{
+    if (!tensor.is_contiguous() || !tensor.is_cpu())
+        throw std::runtime_error("Tensor must be contiguous and on cpu");
+    this->n_writes++;
+    auto iter = this->entries.find(key);
+    if (iter != this->entries.end() && iter->second.bytes == tensor.storage().nbytes())
+    {
+        Entry &entry = iter->second;
+        if (entry.dirty)
+            this->n_absorbed++;
+        else
+        {
+            entry.dirty = true;
+            this->dirty += entry.bytes;
+        }
+        // a buffer which is being written back is replaced instead of overwritten
+        if (this->writing.count(key))
+            entry.buffer = tensor.clone();
+        else
+            entry.buffer.copy_(tensor);
+        touch(key, entry);
+        return;
+    }
+    if (iter != this->entries.end())
+        erase(key);
+    if (tensor.storage().nbytes() > this->capacity_bytes && !this->pinned.count(key))
+    {
+        // larger than the whole cache, write through
+        wait_written(key);
+        this->offloader.sync_write(tensor, key);
+        this->on_disk.insert(key);
+        this->n_bypassed++;
+        return;
+    }
+    insert(key, tensor.clone(), true);
+}
+
+void WriteBackCache::read(const at::Tensor &tensor, const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter != this->entries.end())
+    {
+        if (iter->second.bytes != tensor.storage().nbytes())
+            throw std::runtime_error("Read error, tensor shape mismatch");
+        this->n_hits++;
+        tensor.copy_(iter->second.buffer);
+        touch(key, iter->second);
+        return;
+    }
+    this->n_misses++;
+    // an evicted entry may still be on its way to disk
+    wait_written(key);
+    this->offloader.sync_read(tensor, key);
+    if (tensor.storage().nbytes() <= this->capacity_bytes || this->pinned.count(key))
+        insert(key, tensor.clone(), false);
+}
+
+void WriteBackCache::pin(const std::string &key)
+{
+    if (!this->pinned.insert(key).second)
+        return;
+    auto iter = this->entries.find(key);
+    if (iter != this->entries.end())
+        this->victims.erase(std::make_pair(iter->second.tick, key));
+}
+
+void WriteBackCache::unpin(const std::string &key)
+{
+    if (!this->pinned.erase(key))
+        return;
+    auto iter = this->entries.find(key);
+    if (iter != this->entries.end())
+    {
+        this->victims.insert(std::make_pair(iter->second.tick, key));
+        make_room(0);
+    }
+}
+
+void WriteBackCache::flush(const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter == this->entries.end())
+        throw std::runtime_error("Flush error, key not found");
+    if (iter->second.dirty)
+        write_back(key, iter->second);
+}
+
+void WriteBackCache::flush_all()
+{
+    for (auto &item : this->entries)
+        if (item.second.dirty)
+            write_back(item.first, item.second);
+}
+
+void WriteBackCache::barrier()
+{
+    flush_all();
+    this->offloader.synchronize();
+}
+
+void WriteBackCache::erase(const std::string &key)
+{
+    auto iter = this->entries.find(key);
+    if (iter != this->entries.end())
+    {
+        if (!this->pinned.count(key))
+            this->victims.erase(std::make_pair(iter->second.tick, key));
+        this->cached -= iter->second.bytes;
+        if (iter->second.dirty)
+            this->dirty -= iter->second.bytes;
+        this->entries.erase(iter);
+    }
+    wait_written(key);
+    if (this->on_disk.erase(key))
+        this->offloader.erase(key);
+}
+
+bool WriteBackCache::contains(const std::string &key) const
+{
+    return this->entries.count(key) > 0;
+}
+
+ull WriteBackCache::cached_bytes() const
+{
+    return this->cached;
+}
+
+ull WriteBackCache::dirty_bytes() const
+{
+    return this->dirty;
+}
+
+std::unordered_map<std::string, ull> WriteBackCache::stats() const
+{
+    return {
+        {"hits", this->n_hits},
+        {"misses", this->n_misses},
+        {"writes", this->n_writes},
+        {"absorbed_writes", this->n_absorbed},
+        {"flushes", this->n_flushes},
+        {"evictions", this->n_evictions},
+        {"bypassed_writes", this->n_bypassed},
+        {"cached_bytes", this->cached},
+        {"dirty_bytes", this->dirty},
+    };
+}
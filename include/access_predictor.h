@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "space_mgr.h"
+
+// learns the key sequence of one training step and follows later steps through it, so that the
+// accesses which come next can be read ahead; steps repeat, so the pattern wraps around
+class AccessPredictor
+{
+private:
+    struct Access
+    {
+        std::string key;
+        ull bytes;
+        // seconds since the recording started
+        double time;
+    };
+
+    // an access further ahead than this is a jump, not a deviation
+    const size_t match_window;
+    vector<Access> pattern;
+    std::unordered_map<std::string, vector<size_t>> positions;
+    // duration of a step, used for the gap between the last access and the first one of the next step
+    double period;
+    // index of the next expected access
+    size_t next;
+    bool is_recording;
+
+public:
+    AccessPredictor(size_t match_window = 16);
+    // drop the old pattern and record a new one
+    void start_recording();
+    void record(const std::string &key, ull bytes, double time);
+    void stop_recording();
+    void clear();
+    bool recording() const;
+    // a pattern is recorded and followed
+    bool ready() const;
+    size_t size() const;
+    const std::string &key(size_t index) const;
+    ull bytes(size_t index) const;
+    // index of the next expected access
+    size_t position() const;
+    // match an access with the pattern and move past it, return its index or -1 for unknown keys;
+    // keys which are skipped or repeated are tolerated, an access far ahead re-synchronizes
+    long observe(const std::string &key);
+    // indices which are expected within lead seconds after the last observed access, at least one and
+    // at most max_count
+    vector<size_t> upcoming(double lead, size_t max_count) const;
+    // index lies in [from, to) of the wrapping pattern
+    bool between(size_t index, size_t from, size_t to) const;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "queued_asyncio.h"
+#include "depth_controller.h"
+
+// submits the requests of an engine at the depth and in the batches chosen by a DepthController, the others wait
+// in user space in issue order. The engine keeps its own queue depth as the upper bound
+class AdaptiveAsyncIO : public QueuedAsyncIO
+{
+private:
+    struct Pending : Request
+    {
+        clock::time_point submitted_at;
+    };
+
+    DepthController controller;
+    std::deque<Pending> queue;
+    // the caller batches its own requests
+    bool plugged;
+
+    void enqueue(Request request);
+    // submit up to the depth; while requests are in flight, only whole batches unless the caller waits
+    void dispatch(bool waiting);
+    void wait();
+    void drop(unsigned long long tag, std::vector<callback_t> &dropped);
+
+public:
+    // takes ownership of the engine, which was created with max_depth entries
+    AdaptiveAsyncIO(AsyncIO *inner, unsigned int max_depth, unsigned int min_depth, double latency_tolerance);
+    ~AdaptiveAsyncIO();
+
+    void plug();
+    void unplug();
+
+    std::unordered_map<std::string, unsigned long long> stats() const;
+};
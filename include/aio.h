@@ -4,8 +4,15 @@
 #include <torch/torch.h>
 #include <stdexcept>
 #include <memory>
+#include <vector>
+#include <unordered_set>
 #include "asyncio.h"
 
+// older libaio headers lack the flag, the kernel accepts it since 4.18
+#ifndef IOCB_FLAG_IOPRIO
+#define IOCB_FLAG_IOPRIO (1 << 1)
+#endif
+
 class AIOAsyncIO : public AsyncIO
 {
 private:
@@ -15,8 +22,25 @@ private:
     int max_nr;
     int min_nr = 1;
     struct timespec timeout;
+    bool plugged = false;
+    // cleared when the kernel rejects IOCB_FLAG_IOPRIO, before 4.18
+    bool ioprio_supported = true;
+    // iocbs queued while plugged, they live on the heap until their completion
+    std::vector<struct iocb *> pending;
+    // iocbs handed to the kernel, io_cancel() needs their address
+    std::unordered_set<struct iocb *> submitted;
 
     void get_event(WaitType wt);
+    void done_event(IOType type);
+    void finish_event(struct io_event &event);
+    void submit(IOData *data);
+    void enqueue(struct iocb *iocb);
+    // hand iocbs to the kernel, reaping while the context is full; on other errors the iocbs which were not
+    // submitted are dropped and the error is raised
+    void submit_iocbs(struct iocb **iocbs, size_t n);
+    // a request which never reached the kernel: its counts are undone and its callback does not run
+    void drop(struct iocb *iocb);
+    void set_ioprio(struct iocb &iocb, IOType type);
 
 public:
     AIOAsyncIO(unsigned int n_entries, unsigned int n_tasks);
@@ -26,6 +50,8 @@ public:
     void read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
     void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
     void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void plug();
+    void unplug();
 
     void register_h2d(unsigned int num_tensors);
     void sync_h2d();
@@ -36,4 +62,5 @@ public:
     void register_file(int fd);
     void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
     void register_tasks(unsigned int num_tasks);
+    void cancel(unsigned long long tag);
 };
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 #include "asyncio.h"
 #include "backend.h"
+#include "io_arbiter.h"
+#include "shared_engine.h"
 
 #ifndef DISABLE_URING
 #include "uring.h"
@@ -17,16 +19,22 @@
 class AsyncFileWriter
 {
 public:
-    AsyncFileWriter(int fd, unsigned int n_entries, const std::string &backend, unsigned int n_tasks);
+    // with a shared engine, n_entries, backend and n_tasks are those of the engine
+    AsyncFileWriter(int fd, unsigned int n_entries, const std::string &backend, unsigned int n_tasks, std::shared_ptr<SharedEngine> shared_engine = nullptr);
     void write(size_t buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
     void write_tensor(torch::Tensor tensor, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
     void synchronize();
     void register_h2d(unsigned int num_tensors);
     void sync_h2d();
     void register_tasks(unsigned int num_tasks);
+    // "normal", "critical" or "bulk", e.g. bulk for checkpoints next to training I/O
+    void set_priority(const std::string &priority);
+    // writes are admitted by the arbiter under the given class, e.g. a capped class for checkpoints
+    void set_io_class(std::shared_ptr<IOArbiter> arbiter, const std::string &io_class);
     ~AsyncFileWriter();
 
 private:
     int fd;
     AsyncIO *aio;
+    bool arbitrated;
 };
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <fcntl.h>
+#include <string.h>
 #include <functional>
+#include <stdexcept>
+#include <string>
 #include <torch/torch.h>
 
 using callback_t = std::function<void()>;
@@ -18,18 +21,65 @@ enum WaitType
     NOWAIT
 };
 
+enum IOPriority
+{
+    PRIO_NORMAL,
+    // latency-critical requests, e.g. reads which the compute loop is about to block on
+    PRIO_CRITICAL,
+    // background requests, e.g. write-back and checkpoints
+    PRIO_BULK
+};
+
+// ioprio of a request, best-effort level 0 or 7; 0 keeps the priority of the process
+inline unsigned short ioprio_value(IOPriority priority)
+{
+    const unsigned short best_effort = 2 << 13;
+    if (priority == PRIO_CRITICAL)
+        return best_effort | 0;
+    if (priority == PRIO_BULK)
+        return best_effort | 7;
+    return 0;
+}
+
 struct IOData
 {
     IOType type;
     callback_t callback;
     const iovec *iov;
+    // remaining part of a plain request, used to resubmit short transfers
+    int fd;
+    void *buffer;
+    size_t n_bytes;
+    unsigned long long offset;
+    // tag of the engine when the request was issued, used to cancel it
+    unsigned long long tag;
+    bool cancelled;
 
-    IOData(IOType type, callback_t callback = nullptr, const iovec *iov = nullptr) : type(type), callback(callback), iov(iov) {}
+    IOData(IOType type, callback_t callback = nullptr, const iovec *iov = nullptr) : type(type), callback(callback), iov(iov), fd(-1), buffer(nullptr), n_bytes(0), offset(0), tag(0), cancelled(false) {}
+    IOData(IOType type, callback_t callback, int fd, void *buffer, size_t n_bytes, unsigned long long offset) : type(type), callback(callback), iov(nullptr), fd(fd), buffer(buffer), n_bytes(n_bytes), offset(offset), tag(0), cancelled(false) {}
     ~IOData()
     {
         if (iov)
             delete iov;
     }
+
+    // account for the result of a completion, return false if the rest of the request has to be resubmitted
+    bool advance(long long res)
+    {
+        // a cancelled request is done whether it was aborted, failed or transferred only a part
+        if (cancelled)
+            return true;
+        if (res < 0)
+            throw std::runtime_error(std::string(type == WRITE ? "Write" : "Read") + " error: " + strerror(-res));
+        if (buffer == nullptr || static_cast<size_t>(res) >= n_bytes)
+            return true;
+        if (res == 0)
+            throw std::runtime_error(std::string(type == WRITE ? "Write" : "Read") + " error: no progress at offset " + std::to_string(offset));
+        buffer = static_cast<char *>(buffer) + res;
+        n_bytes -= res;
+        offset += res;
+        return false;
+    }
 };
 
 class AsyncIO
@@ -42,6 +92,10 @@ public:
     virtual void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback) = 0;
     virtual void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback) = 0;
 
+    // requests issued between plug() and unplug() are submitted together by unplug()
+    virtual void plug() = 0;
+    virtual void unplug() = 0;
+
     virtual void get_event(WaitType wt) = 0;
     virtual void sync_write_events() = 0;
     virtual void sync_read_events() = 0;
@@ -52,4 +106,20 @@ public:
 
     virtual void register_file(int fd) = 0;
     virtual void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned) = 0;
+
+    // priority of the requests of a type issued from now on
+    virtual void set_priority(IOType type, IOPriority priority) { this->priorities[type] = priority; }
+    // deadline in seconds from now of the requests issued from now on, negative for none; engines without
+    // a scheduler ignore it
+    virtual void set_deadline(double seconds) {}
+    // tag of the requests issued from now on, 0 for none
+    virtual void set_tag(unsigned long long tag) { this->tag = tag; }
+    // cancel the requests issued with the tag, or all requests for tag 0. Requests which have not reached
+    // the device are dropped, the others are aborted where the kernel supports it; the callbacks of
+    // cancelled requests still run, without errors, and their buffers are undefined
+    virtual void cancel(unsigned long long tag) = 0;
+
+protected:
+    IOPriority priorities[2] = {PRIO_NORMAL, PRIO_NORMAL};
+    unsigned long long tag = 0;
 };
\ No newline at end of file
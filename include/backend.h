@@ -1,3 +1,5 @@
+#pragma once
+
 #include "asyncio.h"
 #include <string>
 #include <algorithm>
@@ -8,12 +10,26 @@
 
 std::unordered_set<std::string> get_backends();
 
-bool probe_backend(const std::string &backend);
+// the result is cached per process unless cached is false
+bool probe_backend(const std::string &backend, bool cached = true);
 
 std::string get_default_backend();
 
 bool get_debug_flag();
 
-AsyncIO *create_asyncio(unsigned int n_entries, std::string backend, unsigned int n_tasks);
+// an empty or "auto" backend and 0 entries are taken from the profile of the device holding path (see io_profile.h),
+// or else the first working backend of uring, aio and pthread and default_n_entries
+AsyncIO *create_asyncio(unsigned int n_entries, std::string backend, unsigned int n_tasks, const std::string &path = "");
+
+// exactly the given backend with n_entries, neither TENSORNVME_BACKEND nor a profile is looked at
+AsyncIO *create_engine(const std::string &backend, unsigned int n_entries, unsigned int n_tasks);
+
+const unsigned int default_n_entries = 64;
+
+// n_entries, or the queue depth tuned for the device holding path when it is 0
+unsigned int get_n_entries(unsigned int n_entries, const std::string &path);
+
+std::string get_debug_log();
 
-std::string get_debug_log();
\ No newline at end of file
+// "normal", "critical" or "bulk"
+IOPriority get_priority(const std::string &name);
\ No newline at end of file
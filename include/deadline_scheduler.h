@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "queued_asyncio.h"
+
+// earliest-deadline-first submission in front of an engine: at most depth requests are in flight, the
+// others wait in user space ordered by their deadline. Requests without a deadline are due slack after
+// they are issued, so that they are not starved
+class DeadlineAsyncIO : public QueuedAsyncIO
+{
+private:
+    struct Pending : Request
+    {
+        clock::time_point due;
+        unsigned long long seq;
+    };
+
+    const unsigned int depth;
+    const clock::duration slack;
+    // min-heap by deadline, then by issue order
+    std::vector<Pending> queue;
+    unsigned long long seq;
+    unsigned long long n_deadlines, n_misses;
+    clock::duration max_lateness, total_lateness;
+
+    static bool later(const Pending &a, const Pending &b);
+    void enqueue(Request request);
+    void dispatch();
+    void finished(const Pending &request);
+    void wait();
+    void drop(unsigned long long tag, std::vector<callback_t> &dropped);
+
+public:
+    // takes ownership of the engine
+    DeadlineAsyncIO(AsyncIO *inner, unsigned int depth, double slack);
+    ~DeadlineAsyncIO();
+
+    // requests with a deadline, missed deadlines, and the worst and total lateness of the misses in us
+    std::unordered_map<std::string, unsigned long long> stats() const;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+// AIMD on the in-flight depth and the submission batch of an engine. Completions are grouped into epochs; after
+// each one, a latency above tolerance times the lowest one seen for requests of the same size cuts the depth by a
+// quarter and halves the batch, and an epoch in which requests waited for a slot without losing throughput adds one
+// to both
+class DepthController
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    DepthController(unsigned int max_depth, unsigned int min_depth, double latency_tolerance);
+    unsigned int depth() const;
+    unsigned int batch() const;
+    // a request waited because depth requests were in flight
+    void saturated();
+    void completed(unsigned long long bytes, clock::duration latency, clock::time_point now = clock::now());
+    // chosen depth and batch, their bounds, adjustments, and throughput and latency of the last epoch
+    std::unordered_map<std::string, unsigned long long> stats() const;
+
+private:
+    // requests are compared with requests of the same power-of-two size, a large one is not slow for its size
+    static const int n_buckets = 64;
+
+    const unsigned int max_depth, min_depth;
+    const double latency_tolerance;
+    unsigned int cur_depth, cur_batch;
+    // lowest mean latency of an epoch per size, drifting up slowly so that a heavier load is not congestion forever
+    double base_latency[n_buckets];
+    double last_throughput, last_latency, last_ratio;
+    clock::time_point epoch_start;
+    unsigned long long epoch_ops, epoch_bytes;
+    double epoch_latency[n_buckets];
+    unsigned long long epoch_count[n_buckets];
+    bool epoch_saturated;
+    unsigned long long n_epochs, n_increases, n_decreases;
+
+    static int bucket(unsigned long long bytes);
+    void adjust(clock::time_point now);
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "offload.h"
+#include "host_arena.h"
+
+// tensor level offloader: keys are derived from storages, storages are released after writes and
+// allocated again before reads, so a Python call maps to a single native call
+class DiskOffloader : public Offloader
+{
+public:
+    // without an arena, storages are allocated by the cpu allocator
+    DiskOffloader(const std::string &filename, unsigned int n_entries, const std::string &backend, bool retain = false, std::shared_ptr<HostArena> arena = nullptr, bool thread_safe = false, std::shared_ptr<SharedEngine> shared_engine = nullptr);
+    void async_write(const at::Tensor &tensor, callback_t callback = nullptr);
+    void async_read(const at::Tensor &tensor, callback_t callback = nullptr);
+    void sync_write(const at::Tensor &tensor);
+    void sync_read(const at::Tensor &tensor);
+    void async_writev(const std::vector<at::Tensor> &tensors, callback_t callback = nullptr);
+    void async_readv(const std::vector<at::Tensor> &tensors, callback_t callback = nullptr);
+    void sync_writev(const std::vector<at::Tensor> &tensors);
+    void sync_readv(const std::vector<at::Tensor> &tensors);
+    bool drop(const at::Tensor &tensor, callback_t callback = nullptr);
+    bool dropv(const std::vector<at::Tensor> &tensors, callback_t callback = nullptr);
+    at::Tensor map(const at::Tensor &tensor, const std::string &advice = "willneed", bool prefault = false);
+    void erase(const at::Tensor &tensor);
+    std::vector<handle_t> async_write_batch(const std::vector<at::Tensor> &tensors, callback_t callback = nullptr);
+    void async_read_batch(const std::vector<at::Tensor> &tensors, callback_t callback = nullptr);
+    std::vector<handle_t> sync_write_batch(const std::vector<at::Tensor> &tensors);
+    void sync_read_batch(const std::vector<at::Tensor> &tensors);
+    // key of a tensor, shared by all tensors which view the same storage
+    static std::string key(const at::Tensor &tensor);
+    static std::string key(const std::vector<at::Tensor> &tensors);
+    static std::vector<std::string> keys(const std::vector<at::Tensor> &tensors);
+    // give an empty storage a buffer of the tensor size, from the arena if there is one
+    static void allocate(const at::Tensor &tensor, HostArena *arena);
+    // drop the buffer of a storage, the tensor keeps its shape
+    static void release(const at::Tensor &tensor);
+
+private:
+    std::shared_ptr<HostArena> arena;
+
+    void allocate(const at::Tensor &tensor);
+    void check_allocated(const at::Tensor &tensor);
+    static callback_t release_callback(const at::Tensor &tensor, callback_t callback);
+    static callback_t release_callback(const std::vector<at::Tensor> &tensors, callback_t callback);
+};
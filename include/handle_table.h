@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "space_mgr.h"
+
+using handle_t = unsigned long long;
+
+enum EntryFlag
+{
+    // slot is taken by a live handle
+    ENTRY_USED = 1,
+    // data of the entry is on disk
+    ENTRY_STORED = 2,
+};
+
+// 16 bytes per tensor, so millions of tensors take a few tens of MB
+struct TensorEntry
+{
+    ull offset;
+    ull bytes : 40;
+    ull generation : 16;
+    ull flags : 8;
+};
+static_assert(sizeof(TensorEntry) == 16, "TensorEntry should be 16 bytes");
+
+// flat table of tensor entries, a handle is (generation << 32 | index)
+class HandleTable
+{
+private:
+    vector<TensorEntry> entries;
+    vector<uint32_t> free_slots;
+
+public:
+    static const ull max_bytes = (1ULL << 40) - 1;
+
+    HandleTable();
+    ~HandleTable();
+    handle_t create(ull bytes);
+    void remove(handle_t handle);
+    bool contains(handle_t handle) const;
+    TensorEntry &get(handle_t handle);
+    size_t size() const;
+    // number of slots, including free ones
+    size_t capacity() const;
+    // entry of a slot, free slots don't have ENTRY_USED set
+    TensorEntry &slot(size_t index);
+    handle_t slot_handle(size_t index) const;
+    size_t memory_bytes() const;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// recycles mlock-ed host buffers for tensor storages, so that offloading a tensor and reading it
+// back does not go through the general allocator and does not fault or zero pages again
+class HostArena : public std::enable_shared_from_this<HostArena>
+{
+public:
+    // max_cached_bytes bounds the idle buffers kept for reuse, 0 means unbounded
+    HostArena(size_t max_cached_bytes = 0, bool hugepage = false, bool lock = true);
+    ~HostArena();
+    // back the empty storage of tensor with a buffer of numel() * element_size() bytes
+    void acquire(const at::Tensor &tensor);
+    // return the buffer of tensor to the arena, the storage is left empty
+    void release(const at::Tensor &tensor);
+    // unmap all idle buffers
+    void trim();
+    size_t allocated_bytes();
+    size_t cached_bytes();
+    unsigned long long n_hits();
+    unsigned long long n_misses();
+
+private:
+    struct Block
+    {
+        void *ptr;
+        size_t capacity;
+        // set while the block backs a storage, keeps the arena alive until it is returned
+        std::shared_ptr<HostArena> owner;
+    };
+
+    const size_t max_cached_bytes;
+    const bool hugepage;
+    const bool lock;
+    std::mutex mtx;
+    // idle blocks by capacity
+    std::unordered_map<size_t, std::vector<Block *>> free_blocks;
+    size_t allocated, cached;
+    unsigned long long hits, misses;
+    bool lock_warned;
+
+    size_t round_up(size_t bytes) const;
+    Block *get(size_t bytes);
+    void put(Block *block);
+    void unmap(Block *block);
+    static void deleter(void *ctx);
+};
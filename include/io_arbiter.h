@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "queued_asyncio.h"
+
+// shared by the engines of one device: bandwidth and IOPS caps of the device and of each class, and weighted
+// fair sharing between classes which wait for the device. Engines of any thread attach to a class by name
+class IOArbiter
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // caps of the whole device, 0 for none; max_inflight bounds the requests in flight of all classes
+    IOArbiter(unsigned long long bytes_per_sec = 0, unsigned long long iops = 0, unsigned int max_inflight = 0);
+    // a class gets a share of the device proportional to its weight while others wait, and may be capped itself
+    void add_class(const std::string &name, double weight = 1.0, unsigned long long bytes_per_sec = 0, unsigned long long iops = 0);
+    // completed requests and bytes, throttled requests, throughput and latency from issue to completion per class
+    std::unordered_map<std::string, std::unordered_map<std::string, unsigned long long>> stats();
+
+    unsigned int class_id(const std::string &name);
+    // take the tokens of a request if the caps and the fair share allow it now
+    bool admit(unsigned int id, unsigned long long bytes);
+    // a request admitted earlier completed, or failed to submit without bytes
+    void done(unsigned int id, unsigned long long bytes, clock::duration latency, bool throttled);
+    // how long an engine with nothing in flight should wait before it asks again
+    clock::duration retry_after(unsigned int id);
+
+private:
+    struct TokenBucket
+    {
+        // tokens per second, 0 for no cap
+        double rate;
+        double tokens;
+        clock::time_point last;
+
+        TokenBucket(double rate);
+        void refill(clock::time_point now);
+        // a request may overdraw the bucket, the next ones wait for the debt
+        bool ready() const;
+        void take(double n);
+        clock::duration until_ready() const;
+    };
+
+    struct IOClass
+    {
+        std::string name;
+        double weight;
+        TokenBucket bytes, ops;
+        // bytes served divided by the weight, the class furthest behind goes first
+        double vtime;
+        // denied the last time it asked, and when it asked
+        bool waiting;
+        clock::time_point last_seen;
+        unsigned int n_inflight;
+        unsigned long long n_ops, n_bytes, n_throttled;
+        clock::duration total_latency, max_latency;
+        clock::time_point first_admit, last_done;
+    };
+
+    std::mutex mtx;
+    TokenBucket bytes, ops;
+    const unsigned int max_inflight;
+    unsigned int n_inflight;
+    std::vector<IOClass> classes;
+
+    void refill(IOClass &cls, clock::time_point now);
+};
+
+// queues the requests of one engine in user space until the arbiter admits them, in issue order
+class ArbitratedAsyncIO : public QueuedAsyncIO
+{
+private:
+    struct Pending : Request
+    {
+        clock::time_point issued_at;
+        bool throttled;
+    };
+
+    std::shared_ptr<IOArbiter> arbiter;
+    const unsigned int id;
+    std::deque<Pending> queue;
+
+    void enqueue(Request request);
+    void pump();
+    void start(std::shared_ptr<Pending> request);
+    // a request the engine dropped gives its slot in the arbiter back without bytes
+    void settle(const Request &request, bool landed);
+    // reap a completion, or sleep until the arbiter may admit the next request
+    void wait();
+    void drop(unsigned long long tag, std::vector<callback_t> &dropped);
+
+public:
+    // takes ownership of the engine
+    ArbitratedAsyncIO(AsyncIO *inner, std::shared_ptr<IOArbiter> arbiter, const std::string &io_class);
+    ~ArbitratedAsyncIO();
+
+    void get_event(WaitType wt);
+    // tensor writes are not queued, the caller waits until the arbiter admits them
+    void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
+};
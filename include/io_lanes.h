@@ -0,0 +1,33 @@
+#pragma once
+
+#include <deque>
+#include "queued_asyncio.h"
+
+// separate read and write lanes in front of an engine: while reads which are not bulk are in flight, at
+// most max_writes writes are in flight and later writes wait in user space, in order
+class LanedAsyncIO : public QueuedAsyncIO
+{
+private:
+    // 0 lets every write through
+    unsigned int max_writes;
+    unsigned int n_critical_reads;
+    std::deque<Request> held;
+    unsigned long long n_held;
+
+    static bool critical(const Request &request);
+    // reads are submitted at once, writes wait behind held ones or while the lane is full
+    void enqueue(Request request);
+    void settle(const Request &request, bool landed);
+    void release_writes();
+    void wait();
+    void drop(unsigned long long tag, std::vector<callback_t> &dropped);
+
+public:
+    // takes ownership of the engine
+    LanedAsyncIO(AsyncIO *inner, unsigned int max_writes);
+    ~LanedAsyncIO();
+
+    void set_max_writes(unsigned int max_writes);
+    // writes which waited for reads
+    unsigned long long held_writes() const;
+};
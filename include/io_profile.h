@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// backend, queue depth and request size which were measured best for a device by `tensornvme tune`
+struct IOProfile
+{
+    // directory which was tuned
+    std::string path;
+    std::string backend;
+    unsigned int n_entries;
+    unsigned long long chunk_bytes;
+    // measured with the chosen values
+    double write_bytes_per_sec, read_bytes_per_sec;
+};
+
+// $TENSORNVME_PROFILE, or tensornvme/profile in the user cache directory
+std::string get_profile_path();
+
+// profile of the device holding path (or the directory it will be created in), if that device was tuned. Without a
+// path, the profile is used only if it holds a single device. The file is read once per process
+std::optional<IOProfile> find_io_profile(const std::string &path);
+
+// add or replace the profile of the device holding profile.path, the file is rewritten atomically
+void save_io_profile(const IOProfile &profile);
+
+// throughput of an engine over total_bytes of requests of request_bytes with n_entries in flight, written to and
+// read back from a scratch file at path which is removed afterwards
+std::unordered_map<std::string, double> measure_engine(const std::string &path, const std::string &backend, unsigned int n_entries, unsigned long long request_bytes, unsigned long long total_bytes);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// unbounded lock-free queue with many producers and a single consumer (Vyukov's intrusive list)
+template <typename T>
+class MPSCQueue
+{
+public:
+    MPSCQueue() : stub(new Node()), head(stub), tail(stub) {}
+
+    ~MPSCQueue()
+    {
+        T item;
+        while (pop(item))
+            ;
+        delete this->tail;
+    }
+
+    MPSCQueue(const MPSCQueue &) = delete;
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+    void push(T item)
+    {
+        Node *node = new Node(std::move(item));
+        Node *prev = this->head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // consumer only
+    bool pop(T &item)
+    {
+        Node *next = this->tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+        item = std::move(next->item);
+        delete this->tail;
+        this->tail = next;
+        return true;
+    }
+
+    // consumer only, a push which is half done may be missed
+    bool empty() const
+    {
+        return this->tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next;
+        T item;
+
+        Node() : next(nullptr) {}
+        explicit Node(T item) : next(nullptr), item(std::move(item)) {}
+    };
+
+    Node *stub;
+    std::atomic<Node *> head;
+    Node *tail;
+};
@@ -2,8 +2,25 @@
 
 #include "asyncio.h"
 #include <ATen/ATen.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
 #include "space_mgr.h"
+#include "handle_table.h"
+#include "offload_index.h"
+#include "access_predictor.h"
+#include "io_lanes.h"
+#include "deadline_scheduler.h"
+#include "io_arbiter.h"
+#include "shared_engine.h"
+#include "adaptive_depth.h"
 #ifndef DISABLE_URING
 #include "uring.h"
 #endif
@@ -11,19 +28,97 @@
 #include "aio.h"
 #endif
 
+// extents referenced by mapped tensors, shared with their deleters which may outlive the offloader
+struct MappedExtents
+{
+    std::mutex mtx;
+    std::unordered_map<ull, unsigned int> counts;
+
+    void pin(ull offset);
+    void unpin(ull offset);
+    bool contains(ull offset);
+};
+
+// a read ahead of a predicted access, into the tensor which was read with the key while recording
+struct Prefetch
+{
+    at::Tensor tensor;
+    // index of the access in the recorded pattern
+    size_t index;
+    bool done;
+    // the access was skipped, the buffer is released once the read completes
+    bool wasted;
+    // completions of reads of the key which arrived while the prefetch was in flight
+    std::vector<callback_t> waiters;
+    std::chrono::steady_clock::time_point issued_at;
+};
+
+// a request of a captured step, its extent is resolved when the capture stops
+struct ReplayOp
+{
+    IOType type;
+    std::string key;
+    SpaceInfo space_info;
+    // index of the previous request of the key in the wrapping schedule, it must land before this one
+    // is submitted
+    size_t after;
+    // the request closes a group, requests of a group are submitted together
+    bool batch_end;
+    // the replayed request is completed, initially true
+    bool landed;
+};
+
+// an async request which can be cancelled, of a string key or of a handle
+struct TaggedRequest
+{
+    IOType type;
+    std::string key;
+    handle_t handle;
+    bool by_key;
+    SpaceInfo space_info;
+    bool cancelled;
+    // a read which took the key or the handle off the disk, its extent is released when it lands
+    bool consumed;
+    // dtype and shape of the destination of a consumed read of a key, put back with the key in persistent mode
+    TensorMeta meta;
+};
+
+// requests of a string key which are not completed yet
+struct InFlight
+{
+    // source of the write in flight, reads of the key are copied from it
+    at::Tensor writing;
+    // destination of the read in flight, duplicate reads are copied from it
+    at::Tensor reading;
+    // newest write which waits for the requests in flight, an older waiting write is superseded
+    at::Tensor held;
+    callback_t held_callback;
+    bool has_held = false;
+    // run when the write in flight lands, e.g. freeing the extent of a read served from its source
+    std::vector<callback_t> after_write;
+    // reads merged into the read in flight
+    std::vector<std::pair<at::Tensor, callback_t>> after_read;
+};
+
 class Offloader
 {
 public:
-    Offloader(const std::string &filename, unsigned int n_entries, const std::string &backend);
+    // with a shared engine, requests go through a front-end of it instead of an engine of the offloader
+    Offloader(const std::string &filename, unsigned int n_entries, const std::string &backend, bool persistent = false, bool retain = false, bool thread_safe = false, std::shared_ptr<SharedEngine> shared_engine = nullptr);
     SpaceInfo prepare_write(const at::Tensor &tensor, const std::string &key);
     SpaceInfo prepare_read(const at::Tensor &tensor, const std::string &key);
-    void async_write(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr);
-    void async_read(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr);
+    // deadline in seconds from now, negative for none, only used by the deadline scheduler
+    void async_write(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr, double deadline = -1);
+    void async_read(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr, double deadline = -1);
     void sync_write(const at::Tensor &tensor, const std::string &key);
     void sync_read(const at::Tensor &tensor, const std::string &key);
     void sync_write_events();
     void sync_read_events();
     void synchronize();
+    // run the callbacks of completed requests, block until one completes if wait is true
+    void poll(bool wait);
+    // several threads may call the offloader at once, so blocking calls may release the GIL
+    bool is_thread_safe() const;
     ~Offloader();
     SpaceInfo prepare_writev(const std::vector<at::Tensor> &tensors, const std::string &key);
     SpaceInfo prepare_readv(const std::vector<at::Tensor> &tensors, const std::string &key);
@@ -31,12 +126,274 @@ public:
     void async_readv(const std::vector<at::Tensor> &tensors, const std::string &key, callback_t callback = nullptr);
     void sync_writev(const std::vector<at::Tensor> &tensors, const std::string &key);
     void sync_readv(const std::vector<at::Tensor> &tensors, const std::string &key);
+    ull compact(ull max_bytes);
+    void start_compaction(ull bytes_per_sec, double min_fragmentation, unsigned int interval_ms);
+    void stop_compaction();
+    ull file_bytes();
+    ull live_bytes();
+    ull plan_layout(const std::vector<std::tuple<std::string, ull, ull>> &entries, ull alignment);
+
+    handle_t register_tensor(const at::Tensor &tensor);
+    handle_t register_size(ull bytes);
+    void unregister(handle_t handle);
+    SpaceInfo prepare_write(const at::Tensor &tensor, handle_t handle);
+    SpaceInfo prepare_read(const at::Tensor &tensor, handle_t handle);
+    void async_write(const at::Tensor &tensor, handle_t handle, callback_t callback = nullptr);
+    void async_read(const at::Tensor &tensor, handle_t handle, callback_t callback = nullptr);
+    void sync_write(const at::Tensor &tensor, handle_t handle);
+    void sync_read(const at::Tensor &tensor, handle_t handle);
+    size_t metadata_bytes();
+
+    std::vector<std::string> keys();
+    at::Tensor load(const std::string &key, bool mmap = false);
+
+    // write the tensor only if the on-disk copy is missing or stale, return true if no write is needed
+    bool drop(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr);
+    bool drop(const at::Tensor &tensor, handle_t handle, callback_t callback = nullptr);
+    bool dropv(const std::vector<at::Tensor> &tensors, const std::string &key, callback_t callback = nullptr);
+    void erase(const std::string &key);
+
+    // return a tensor with the dtype and shape of `tensor` whose storage is a shared mapping of the stored extent
+    at::Tensor map(const at::Tensor &tensor, const std::string &key, const std::string &advice = "willneed", bool prefault = false);
+    at::Tensor map(const at::Tensor &tensor, handle_t handle, const std::string &advice = "willneed", bool prefault = false);
+    // write dirty pages of a mapped tensor back to the file
+    void flush_mapped(const at::Tensor &tensor);
+
+    // one allocator pass and one submission for many tensors, each tensor gets its own key and handle
+    std::vector<handle_t> async_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, callback_t callback = nullptr);
+    void async_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, callback_t callback = nullptr);
+    std::vector<handle_t> sync_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys);
+    void sync_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys);
+
+    // forwarded reads, merged reads and superseded writes of the in-flight table, and cancelled requests
+    std::unordered_map<std::string, ull> inflight_stats();
+
+    // record the key sequence of reads (typically one training step), later reads are then followed
+    // through it and the next keys are read ahead into their recorded tensors, within budget_bytes
+    void start_recording();
+    void stop_recording(ull budget_bytes);
+    void stop_prefetching();
+    // issued, hit, late and wasted prefetches
+    std::unordered_map<std::string, ull> prefetch_stats();
+
+    // capture the key requests of one step, the schedule is compiled when the capture stops; later calls
+    // which follow it are submitted with the extents resolved there and grouped as in the captured step.
+    // Retain mode only, a call which deviates from the schedule takes the normal path
+    void start_capture();
+    void stop_capture();
+    void stop_replay();
+    // replayed and fallback requests, submitted groups and requests in the schedule
+    std::unordered_map<std::string, ull> replay_stats();
+
+    // priorities of the reads and writes issued from now on, "normal", "critical" or "bulk"; max_writes > 0
+    // also separates the lanes: while reads which are not bulk are in flight, at most max_writes writes are
+    void set_io_priority(const std::string &read_priority, const std::string &write_priority, unsigned int max_writes = 0);
+    // writes which waited for reads in the lanes, not counted in thread-safe mode
+    ull held_writes();
+
+    // submit at most depth requests (0 for n_entries) and the others earliest deadline first, requests without
+    // a deadline are due slack seconds after they are issued
+    void set_deadline_scheduler(unsigned int depth = 0, double slack = 0.1);
+    // requests with a deadline, misses and lateness of the misses, not counted in thread-safe mode
+    std::unordered_map<std::string, ull> deadline_stats();
+
+    // adjust the in-flight depth (between min_depth and n_entries) and the submission batch from the observed
+    // throughput and latency, a latency above latency_tolerance times the lowest one cuts the depth
+    void set_autotune(unsigned int min_depth = 1, double latency_tolerance = 2.0);
+    // chosen depth and batch, adjustments, and throughput and latency of the last epoch, not counted in
+    // thread-safe mode
+    std::unordered_map<std::string, ull> autotune_stats();
+
+    // every request of the offloader is admitted by the arbiter under the given class, which is shared with
+    // other offloaders and writers of the device
+    void set_io_class(std::shared_ptr<IOArbiter> arbiter, const std::string &io_class);
+
+    // cancel the async requests of a key or a handle which are not completed yet, and drop its waiting write
+    // and unused prefetch; return the number of cancelled requests. Callbacks still run, the destination of a
+    // cancelled read is undefined and a cancelled write leaves the tensor not stored. Vector, batch and sync
+    // requests are not cancelled, nor is anything in thread-safe mode
+    unsigned int cancel(const std::string &key);
+    unsigned int cancel(handle_t handle);
+    unsigned int cancel_all();
+
+protected:
+    // give an empty storage a buffer before it is prefetched, and drop it if the prefetch is wasted;
+    // without them only reads are recorded, nothing is prefetched
+    std::function<void(const at::Tensor &)> prefetch_alloc, prefetch_free;
+
 private:
     const std::string filename;
+    // keep the file and its index after the offloader is destroyed
+    const bool persistent;
+    // reads keep the on-disk copy, extents are freed by erase() or unregister()
+    const bool retain;
+    // queue depth of the engine, sync requests are split to fill it; 0 is the depth tuned for the device
+    const unsigned int n_entries;
+    // request size tuned for the device, 0 to split sync requests into n_entries chunks
+    const ull sync_chunk_bytes;
+    // every calling thread submits to and reaps from its own engine
+    const bool thread_safe;
+    const std::string backend;
+    const std::shared_ptr<SharedEngine> shared_engine;
+    const unsigned long long instance_id;
     int fd;
+    // engine of the non thread-safe mode
     AsyncIO *aio;
+    // engines of calling threads in thread-safe mode
+    std::unordered_map<std::thread::id, AsyncIO *> engines;
+    std::mutex engines_mtx;
     SpaceManager space_mgr;
-    std::unordered_map<std::string, SpaceInfo> tensors_info;
+    HandleTable handles;
+    // string keys are mapped to handles
+    std::unordered_map<std::string, handle_t> tensors_info;
+    // dtype and shape of string keys, only kept in persistent mode
+    std::unordered_map<std::string, TensorMeta> tensors_meta;
+    std::unique_ptr<OffloadIndex> index;
+    // old extents of rewritten keys which the index may still point to, freed once it records the new one
+    std::unordered_map<std::string, std::vector<SpaceInfo>> retired;
+    // tensor version when memory and disk were last in sync, only kept in retain mode
+    std::unordered_map<handle_t, int64_t> clean_versions;
+    // planned extents live in [0, static_bytes) and are never returned to space_mgr
+    std::unordered_map<std::string, SpaceInfo> static_layout;
+    ull static_bytes;
+
+    // guards space_mgr, handles and tensors_info against the background compactor
+    std::mutex meta_mtx;
+    // foreground requests which are not completed yet
+    std::atomic<unsigned int> n_pending;
+    // bumped on every foreground metadata change
+    ull epoch;
+    std::shared_ptr<MappedExtents> mapped;
+    // one thread populates mappings in the order of the map() calls, started by the first prefault
+    std::thread prefaulter;
+    std::mutex prefault_mtx;
+    std::condition_variable prefault_cv;
+    std::deque<std::function<void()>> prefault_queue;
+    bool prefault_busy, prefault_stop;
+    std::thread compactor;
+    std::mutex compactor_mtx;
+    std::condition_variable compactor_cv;
+    bool compactor_stop;
+    // error which stopped the background compactor, raised by the next synchronize()
+    std::mutex error_mtx;
+    std::string background_error;
+    // async requests of string keys in flight, not used in thread-safe mode
+    std::unordered_map<std::string, InFlight> inflight;
+    ull n_forwarded, n_merged, n_superseded;
+    AccessPredictor predictor;
+    // destination tensors of the recorded reads, by pattern index
+    std::vector<at::Tensor> pattern_tensors;
+    std::chrono::steady_clock::time_point record_start;
+    ull prefetch_budget, prefetch_bytes;
+    // moving average of the prefetch read time, in seconds
+    double prefetch_latency;
+    std::unordered_map<std::string, Prefetch> prefetches;
+    ull n_prefetch_issued, n_prefetch_hits, n_prefetch_late, n_prefetch_wasted;
+    // bumped whenever an extent of a string key moves or is freed, a schedule is only valid for one layout
+    std::atomic<ull> layout_epoch;
+    bool capturing;
+    std::vector<ReplayOp> captured;
+    std::chrono::steady_clock::time_point capture_last;
+    std::vector<ReplayOp> schedule;
+    ull schedule_layout;
+    // index of the next expected request, schedule.size() when the calls deviate from the schedule
+    size_t replay_next;
+    // requests issued since the last group boundary are not submitted yet
+    bool replay_plugged;
+    unsigned int n_replay_inflight;
+    ull n_replayed, n_replay_fallbacks, n_replay_batches;
+    // applied to engines created later in thread-safe mode
+    IOPriority read_priority, write_priority;
+    unsigned int lane_writes;
+    // wraps the engine of the non thread-safe mode once lanes are enabled, owned through aio
+    LanedAsyncIO *lanes;
+    // depth of the deadline scheduler, 0 without it
+    unsigned int deadline_depth;
+    double deadline_slack;
+    // wraps the engine of the non thread-safe mode once deadlines are scheduled, owned through aio
+    DeadlineAsyncIO *scheduler;
+    // lowest depth of the controller, 0 without it
+    unsigned int autotune_min_depth;
+    double autotune_tolerance;
+    // wraps the engine of the non thread-safe mode once autotuning is enabled, owned through aio
+    AdaptiveAsyncIO *tuner;
+    // class of the requests in the arbiter, applied to engines created later in thread-safe mode
+    std::shared_ptr<IOArbiter> arbiter;
+    std::string io_class;
+    // cancellable requests in flight by engine tag, not used in thread-safe mode
+    std::unordered_map<ull, TaggedRequest> tagged;
+    ull next_tag;
+    ull n_cancelled;
 
+    SpaceInfo alloc_space(const std::string &key, ull bytes);
+    SpaceInfo write_space(const std::string &key, ull bytes, int64_t version);
+    SpaceInfo read_space(const std::string &key, ull bytes, int64_t version);
+    // fresh_offset is a new extent which was allocated by the caller
+    SpaceInfo place(handle_t handle, ull bytes, const std::string *key, int64_t version, const ull *fresh_offset = nullptr);
+    void submit_write(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback, ull tag = 0);
+    void submit_read(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback, ull tag = 0);
+    void write_now(const at::Tensor &tensor, SpaceInfo space_info, callback_t callback = nullptr);
+    void read_now(const at::Tensor &tensor, SpaceInfo space_info);
+    void transfer_now(IOType type, const iovec *iov, unsigned int iovcnt, ull offset);
+    void submit_vec(IOType type, const std::vector<at::Tensor> &tensors, ull offset, callback_t callback);
+    void drain(AsyncIO *aio);
+    void wait_until(const bool &done);
+    static callback_t countdown(size_t n, callback_t callback);
+    std::vector<handle_t> prepare_write_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys, std::vector<SpaceInfo> &infos);
+    std::vector<SpaceInfo> prepare_read_batch(const std::vector<at::Tensor> &tensors, const std::vector<std::string> &keys);
     void release(ull offset, ull bytes, callback_t callback = nullptr);
+    void read_done(SpaceInfo space_info, callback_t callback = nullptr);
+    void complete(callback_t callback = nullptr);
+    int64_t tensors_version(const std::vector<at::Tensor> &tensors);
+    bool is_clean(handle_t handle, int64_t version);
+    void open_index();
+    callback_t persist_callback(const std::string &key, SpaceInfo space_info, callback_t callback = nullptr);
+    void journal_put(const std::string &key, SpaceInfo space_info);
+    void journal_del(const std::string &key);
+    void free_retired(const std::string &key);
+    void checkpoint_index();
+    // stored extents by offset and the keys of their handles, rebuilt when a foreground request changed them
+    struct CompactionPass
+    {
+        bool built;
+        ull epoch;
+        std::map<ull, handle_t> extents;
+        std::unordered_map<handle_t, std::string> keys;
+    };
+    void scan_extents(CompactionPass &pass);
+    bool relocate_one(CompactionPass &pass, ull &moved_bytes);
+    void check_unmapped(const TensorEntry &entry, const char *op);
+    at::Tensor map_extent(handle_t handle, const std::vector<int64_t> &shape, at::ScalarType dtype, const std::string &advice, bool prefault);
+    void prefault_loop();
+    // wait until the queued prefaults are done
+    void wait_prefaults();
+    // queued prefaults are dropped
+    void stop_prefaulting();
+    AsyncIO *engine();
+    void start_write(const at::Tensor &tensor, const std::string &key, callback_t callback);
+    void start_read(const at::Tensor &tensor, const std::string &key, callback_t callback);
+    void write_landed(const std::string &key, callback_t callback);
+    void read_landed(const std::string &key, callback_t callback);
+    bool forward_read(const at::Tensor &tensor, const std::string &key, callback_t callback);
+    bool merge_read(const at::Tensor &tensor, const std::string &key, callback_t callback);
+    void settle(const std::string &key);
+    void learn(const at::Tensor &tensor, const std::string &key);
+    bool issue_prefetch(size_t index);
+    void prefetch_done(const std::string &key);
+    bool take_prefetch(const at::Tensor &tensor, const std::string &key, callback_t callback);
+    void waste_prefetch(const std::string &key);
+    void invalidate_prefetch(const std::string &key);
+    bool peek_space(const std::string &key, ull bytes, SpaceInfo &space_info);
+    bool copy_extent(ull src, ull dst, ull bytes);
+    void capture(IOType type, const at::Tensor &tensor, const std::string &key, bool sync);
+    void capture_wait();
+    bool replay(IOType type, const at::Tensor &tensor, const std::string &key, callback_t callback);
+    void flush_replay();
+    void drain_replay();
+    // key is null for a request of the handle, tensor is the destination of a read; returns 0 in thread-safe mode
+    ull tag_request(IOType type, const std::string *key, handle_t handle, SpaceInfo space_info, const at::Tensor *tensor = nullptr);
+    // returns true if the request was a consumed read which was cancelled, its extent is kept for the key again
+    bool untag(ull tag);
+    bool restore_read(const TaggedRequest &request);
+    unsigned int cancel_tags(const std::function<bool(const TaggedRequest &)> &matches);
 };
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "space_mgr.h"
+
+// dtype and shape of a stored tensor, dtype is -1 when unknown (e.g. vector I/O)
+struct TensorMeta
+{
+    int8_t dtype;
+    std::vector<int64_t> shape;
+};
+
+struct IndexEntry
+{
+    SpaceInfo space_info;
+    TensorMeta meta;
+};
+
+// journaled key -> extent index of a persistent offload file
+// the index starts with a snapshot (free list and all entries) followed by appended put/del records
+class OffloadIndex
+{
+private:
+    const std::string path;
+    int fd;
+    ull snapshot_bytes, journal_bytes;
+
+    void append(const std::string &record);
+    void open_journal();
+
+public:
+    OffloadIndex(const std::string &path);
+    ~OffloadIndex();
+    // replay the index into entries and rebuild space_mgr from their extents, returns false if there is no index
+    bool load(SpaceManager &space_mgr, std::unordered_map<std::string, IndexEntry> &entries);
+    void put(const std::string &key, const IndexEntry &entry);
+    void del(const std::string &key);
+    // rewrite the index as a single snapshot
+    void checkpoint(const SpaceManager &space_mgr, const std::unordered_map<std::string, IndexEntry> &entries);
+    bool need_checkpoint() const;
+    void sync();
+    void remove();
+};
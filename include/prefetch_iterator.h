@@ -0,0 +1,49 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <chrono>
+#include <vector>
+#include "disk_offloader.h"
+
+// iterates over groups of offloaded tensors in order: the reads of the next groups are kept in flight,
+// a group is returned once its own reads are done, and the previous group is written back (if it is
+// dirty) and released when the next one is requested
+class PrefetchIterator
+{
+public:
+    // depth is the number of groups read ahead, adaptive mode sizes it by the measured I/O and compute time
+    PrefetchIterator(DiskOffloader &offloader, const std::vector<std::vector<at::Tensor>> &groups, unsigned int depth = 2, unsigned int max_depth = 8, bool adaptive = true);
+    ~PrefetchIterator();
+    bool has_next() const;
+    std::vector<at::Tensor> next();
+    // write back the current group and the groups read ahead, and wait for the writes
+    void close();
+    unsigned int depth() const;
+    // time next() spent waiting for reads
+    double stall_seconds() const;
+
+private:
+    struct GroupState
+    {
+        bool issued;
+        bool ready;
+        std::chrono::steady_clock::time_point issued_at;
+    };
+
+    DiskOffloader &offloader;
+    const std::vector<std::vector<at::Tensor>> groups;
+    std::vector<GroupState> states;
+    unsigned int depth_;
+    const unsigned int max_depth;
+    const bool adaptive;
+    // index of the group returned last, groups.size() before the first next()
+    size_t current;
+    size_t next_issue;
+    bool closed;
+    std::chrono::steady_clock::time_point returned_at;
+    // moving averages of the read time of a group and the caller's time per group, in seconds
+    double io_time, compute_time, stall;
+
+    void issue(size_t index);
+    void adapt();
+};
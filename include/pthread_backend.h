@@ -17,6 +17,8 @@
 #include <mutex>
 
 #include "asyncio.h"
+// queued tasks are ordered by the priority of their requests
+#define BS_THREAD_POOL_ENABLE_PRIORITY
 #include "threadpool.hpp"
 #include "backend.h"
 #include <fstream>
@@ -29,14 +31,19 @@ private:
     unsigned int total_h2d;
     std::condition_variable cv;
     std::mutex mtx;
-    std::deque<std::tuple<std::future<ssize_t>, callback_t>> write_fut;
-    std::deque<std::tuple<std::future<ssize_t>, callback_t>> read_fut;
+    // result, callback, tag and cancellation flag of each task
+    using cancel_flag_t = std::shared_ptr<std::atomic<bool>>;
+    std::deque<std::tuple<std::future<ssize_t>, callback_t, unsigned long long, cancel_flag_t>> write_fut;
+    std::deque<std::tuple<std::future<ssize_t>, callback_t, unsigned long long, cancel_flag_t>> read_fut;
     const bool is_debug = get_debug_flag();
     const std::string debug_log = get_debug_log();
 
     std::atomic<unsigned int> tasks_in_progress;
     unsigned int total_tasks;
 
+    BS::priority_t task_priority(IOType type) const;
+    void sync_events(IOType type, WaitType wt = WAIT);
+
 public:
     PthreadAsyncIO(unsigned int n_entries, unsigned int n_tasks)
         : pool(n_entries), h2d_in_progress(0), tasks_in_progress(0), total_tasks(n_tasks), total_h2d(0) {}
@@ -47,6 +54,8 @@ public:
     void read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
     void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
     void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void plug();
+    void unplug();
 
     void get_event(WaitType wt);
     void sync_write_events();
@@ -59,4 +68,5 @@ public:
 
     void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
     void register_tasks(unsigned int num_tasks);
+    void cancel(unsigned long long tag);
 };
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "asyncio.h"
+
+// front-end of an engine which holds requests in user space until its policy submits them. It owns the engine
+// and the bookkeeping of the requests: how many are queued and in flight, the slots of requests the engine
+// drops without a completion, and the queued requests of a cancelled tag
+class QueuedAsyncIO : public AsyncIO
+{
+public:
+    // takes ownership of the engine
+    QueuedAsyncIO(AsyncIO *inner);
+
+    void write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
+    void read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
+    void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void plug();
+    void unplug();
+
+    void get_event(WaitType wt);
+    // queued requests are submitted by completions of the requests in flight
+    void sync_write_events();
+    void sync_read_events();
+    void register_h2d(unsigned int num_tensors);
+    void register_tasks(unsigned int num_tasks);
+    void sync_h2d();
+    void synchronize();
+
+    void register_file(int fd);
+    // tensor writes are not queued
+    void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
+    void set_priority(IOType type, IOPriority priority);
+    void set_deadline(double seconds);
+    void set_tag(unsigned long long tag);
+    // queued requests are dropped here, the others are cancelled by the engine
+    void cancel(unsigned long long tag);
+
+protected:
+    using clock = std::chrono::steady_clock;
+
+    struct Request
+    {
+        IOType type;
+        unsigned long long tag;
+        IOPriority priority;
+        bool has_deadline;
+        clock::time_point deadline;
+        unsigned long long bytes;
+        // array of a vector request, owned by the engine once submitted
+        const iovec *iov;
+        std::function<void(callback_t)> submit;
+        callback_t callback;
+    };
+
+    std::unique_ptr<AsyncIO> inner;
+    // deadline of the requests issued from now on, handed to the engine when they are submitted
+    bool has_deadline;
+    clock::time_point deadline;
+    unsigned int n_inflight;
+    // queued and in flight
+    unsigned int n_writes, n_reads;
+
+    // a request issued now, with the tag, priority and deadline of the engine
+    Request make_request(IOType type, unsigned long long bytes, const iovec *iov, std::function<void(callback_t)> submit, callback_t callback);
+    // queue or submit a request of the caller, which is counted already
+    virtual void enqueue(Request request) = 0;
+    // hand a queued request to the engine; landed runs when it completes, before its callback
+    void submit(std::shared_ptr<Request> request, std::function<void()> landed);
+    // a request left the engine, landed is false if the engine dropped it without its callback
+    virtual void settle(const Request &request, bool landed);
+    // reap a completion, submitting queued requests first if nothing else would
+    virtual void wait() = 0;
+    // drop the queued requests of the tag, 0 for all, and collect their callbacks
+    virtual void drop(unsigned long long tag, std::vector<callback_t> &dropped) = 0;
+    // forget a queued request which the engine never saw
+    void forget(Request &request, std::vector<callback_t> &dropped);
+
+    template <typename Queue>
+    void drop_queued(Queue &queue, unsigned long long tag, std::vector<callback_t> &dropped)
+    {
+        Queue kept;
+        for (auto &request : queue)
+        {
+            if (tag != 0 && request.tag != tag)
+                kept.push_back(std::move(request));
+            else
+                forget(request, dropped);
+        }
+        queue.swap(kept);
+    }
+
+private:
+    void issue(Request request);
+
+    // a request handed to the engine, its slot is freed when the engine drops it, with or without its callback
+    struct Inflight
+    {
+        QueuedAsyncIO *owner;
+        std::shared_ptr<Request> request;
+        bool landed;
+        ~Inflight();
+    };
+};
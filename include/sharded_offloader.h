@@ -0,0 +1,81 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "offload.h"
+#include "mpsc_queue.h"
+
+enum ShardOp
+{
+    SHARD_WRITE,
+    SHARD_READ,
+    SHARD_ERASE
+};
+
+struct ShardRequest
+{
+    ShardOp op;
+    at::Tensor tensor;
+    std::string key;
+    callback_t callback;
+    // set for sync requests, which report errors to the caller instead of synchronize()
+    std::shared_ptr<std::promise<void>> done;
+};
+
+// keys are hashed across n_shards offloaders, each with its own file, engine and allocator, driven by
+// its own thread; requests are handed to the shard threads through lock-free queues and callbacks
+// run on the shard threads
+class ShardedOffloader
+{
+public:
+    // shard i offloads to "<filename>.<i>"
+    ShardedOffloader(const std::string &filename, unsigned int n_shards, unsigned int n_entries, const std::string &backend);
+    ~ShardedOffloader();
+    void async_write(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr);
+    void async_read(const at::Tensor &tensor, const std::string &key, callback_t callback = nullptr);
+    void sync_write(const at::Tensor &tensor, const std::string &key);
+    void sync_read(const at::Tensor &tensor, const std::string &key);
+    void erase(const std::string &key);
+    // wait for all requests, rethrow the first error of an async request
+    void synchronize();
+    // wait for all requests and stop the shard threads; called by the destructor, which releases the GIL
+    // first as the shard threads may need it for Python callbacks
+    void close();
+    unsigned int n_shards() const;
+    unsigned int shard_of(const std::string &key) const;
+
+private:
+    struct Shard
+    {
+        std::unique_ptr<Offloader> offloader;
+        MPSCQueue<ShardRequest> queue;
+        std::thread worker;
+        // queued and running requests, guarded by the offloader's idle_mtx when it drops to 0
+        std::atomic<ull> outstanding;
+        // I/O submitted to the engine and not completed, only touched by the worker
+        ull in_flight;
+        std::atomic<bool> sleeping;
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> stop;
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::exception_ptr error;
+
+    void enqueue(ShardRequest request);
+    void wait_sync(ShardRequest request);
+    void run(Shard &shard);
+    void execute(Shard &shard, ShardRequest &request);
+    void finish(Shard &shard, const ShardRequest &request, std::exception_ptr error);
+};
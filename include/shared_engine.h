@@ -0,0 +1,112 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "asyncio.h"
+
+class SharedAsyncIO;
+
+// one engine (ring, aio context or thread pool) used by many offloaders and writers of any thread: they share
+// its queue depth, workers and completion processing instead of paying for an engine each
+class SharedEngine : public std::enable_shared_from_this<SharedEngine>
+{
+public:
+    SharedEngine(unsigned int n_entries, const std::string &backend, unsigned int n_tasks = 0);
+    // engine of the process for the backend, created with n_entries by the first call
+    static std::shared_ptr<SharedEngine> process(const std::string &backend, unsigned int n_entries);
+    // a front-end of the engine, owned by the caller
+    AsyncIO *attach();
+    unsigned int n_entries() const;
+    unsigned int n_attached();
+
+private:
+    friend class SharedAsyncIO;
+
+    // guards the engine and the completion queues of the front-ends
+    std::mutex mtx;
+    std::unique_ptr<AsyncIO> inner;
+    const unsigned int entries;
+    // front-ends get disjoint tag ranges in the engine
+    unsigned long long next_id;
+    unsigned int n_views;
+    // waiters poll the engine and sleep without the lock, a reap which lands requests wakes them
+    std::condition_variable reaped;
+    unsigned long long n_landed;
+};
+
+// a front-end of a shared engine: it counts its own requests, and the callbacks of its requests run in its own
+// get_event() calls, whichever front-end reaped them
+class SharedAsyncIO : public AsyncIO
+{
+private:
+    // a request handed to the engine, its completion is queued for the front-end
+    struct Request
+    {
+        SharedAsyncIO *view;
+        IOType type;
+        unsigned long long engine_tag;
+        callback_t callback;
+        bool landed;
+        // a request dropped by the engine without its callback failed
+        ~Request();
+    };
+
+    struct Completion
+    {
+        IOType type;
+        callback_t callback;
+        bool failed;
+    };
+
+    std::shared_ptr<SharedEngine> shared;
+    const unsigned long long id;
+    // guarded by the engine lock: requests in the engine, their tags, and completions not run yet
+    unsigned int n_inflight;
+    std::unordered_map<unsigned long long, unsigned int> tags;
+    std::deque<Completion> completed;
+    // issued and not run yet, only used by the owner
+    unsigned int n_writes, n_reads;
+    bool plugged;
+    std::vector<std::pair<std::shared_ptr<Request>, std::function<void(callback_t)>>> plugged_requests;
+
+    void submit(IOType type, std::function<void(callback_t)> submit, callback_t callback);
+    // hand a request to the engine, the engine lock is held
+    void issue(std::shared_ptr<Request> request, const std::function<void(callback_t)> &submit);
+    void landed(Request &request, bool failed);
+    // reap completions of any front-end, the engine lock is held
+    void reap(WaitType wt);
+    void run_completed();
+    // wait for a completion of this front-end, the engine lock is released while nothing lands
+    void wait();
+
+public:
+    SharedAsyncIO(std::shared_ptr<SharedEngine> shared, unsigned long long id);
+    ~SharedAsyncIO();
+
+    void write(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
+    void read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
+    void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    // requests of the front-end are batched, other front-ends are not held back
+    void plug();
+    void unplug();
+
+    void get_event(WaitType wt);
+    void sync_write_events();
+    void sync_read_events();
+    // host-to-device counts of the pthread backend belong to the engine, not to the front-end
+    void register_h2d(unsigned int num_tensors);
+    void register_tasks(unsigned int num_tasks);
+    void sync_h2d();
+    void synchronize();
+
+    void register_file(int fd);
+    void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
+    void cancel(unsigned long long tag);
+};
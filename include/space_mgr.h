@@ -18,6 +18,17 @@ public:
     SpaceManager(ull limit);
     ~SpaceManager();
     ull alloc(ull bytes);
+    // alloc from a free hole which ends before bound, return false if there is no such hole
+    bool alloc_below(ull bytes, ull bound, ull &offset);
     void free(ull offset, ull bytes);
+    // mark a given extent as used, it must be free or beyond the high-water mark
+    void claim(ull offset, ull bytes);
+    // reset the state, e.g. when reopening a persistent offload file
+    void restore(ull used_bytes, const vector<SpaceInfo> &avail_spaces);
+    const vector<SpaceInfo> &get_avail_spaces() const;
+    // high-water mark of the file
+    ull get_used_bytes() const;
+    // total bytes of free holes below the high-water mark
+    ull get_free_bytes() const;
     void print();
-};
\ No newline at end of file
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include "offload.h"
+#include "host_arena.h"
+
+enum StoreState
+{
+    // data is in DRAM only or in DRAM and on disk
+    STORE_RESIDENT,
+    // a spill write is in flight, data is still in DRAM
+    STORE_SPILLING,
+    // data is on disk only
+    STORE_SPILLED,
+    // a read is in flight
+    STORE_LOADING,
+};
+
+// key value store of tensors under a DRAM budget, cold tensors are spilled to the offload file
+// and read back on access; not thread-safe, like Offloader
+class TensorStore
+{
+public:
+    // policy is "lru" or "lfu", capacity_bytes bounds the resident bytes
+    TensorStore(const std::string &filename, ull capacity_bytes, unsigned int n_entries, const std::string &backend, const std::string &policy = "lru", unsigned int prefetch_depth = 2, std::shared_ptr<HostArena> arena = nullptr);
+    ~TensorStore();
+    // the store keeps a reference to the tensor, its storage is released while it is spilled
+    void put(const std::string &key, const at::Tensor &tensor);
+    // the returned tensor stays valid until the store spills it again
+    at::Tensor get(const std::string &key);
+    void prefetch(const std::string &key);
+    void remove(const std::string &key);
+    bool contains(const std::string &key) const;
+    bool is_resident(const std::string &key) const;
+    // wait for all spills and prefetches
+    void synchronize();
+    ull resident_bytes() const;
+    ull budget_bytes();
+    std::unordered_map<std::string, ull> stats() const;
+
+    // shrink the budget while the cgroup of the process is close to its limit or under pressure
+    void set_pressure_limits(double max_usage_ratio, double max_psi_avg10, unsigned int interval_ms);
+
+private:
+    struct Entry
+    {
+        at::Tensor tensor;
+        ull bytes;
+        StoreState state;
+        // written at least once, the offloader keeps the disk copy of every key (retain mode)
+        bool on_disk;
+        ull freq;
+        ull tick;
+        // put order, a miss prefetches the following keys
+        ull seq;
+        // bumped by every spill, only the completion of the latest spill releases the storage
+        ull spill_gen;
+    };
+
+    Offloader offloader;
+    std::shared_ptr<HostArena> arena;
+    const ull capacity_bytes;
+    const bool lfu;
+    const unsigned int prefetch_depth;
+    std::unordered_map<std::string, Entry> entries;
+    // resident entries ordered by eviction priority: (frequency or 0, last access, key)
+    std::set<std::tuple<ull, ull, std::string>> victims;
+    std::map<ull, std::string> put_order;
+    // bytes in DRAM, including in-flight spills and loads
+    ull resident, spilling, tick, next_seq;
+    ull n_hits, n_misses, n_spills, n_clean_spills, n_prefetches;
+
+    // cgroup v2 memory files of the process, empty if not found
+    std::string cgroup_dir;
+    double max_usage_ratio, max_psi_avg10;
+    std::chrono::milliseconds pressure_interval;
+    std::chrono::steady_clock::time_point last_pressure_check;
+    ull pressure_budget;
+
+    std::tuple<ull, ull, std::string> priority(const std::string &key, const Entry &entry) const;
+    void touch(const std::string &key, Entry &entry);
+    void make_room(const std::string *protect);
+    void spill(const std::string &key, Entry &entry);
+    void load(const std::string &key, Entry &entry, bool wait);
+    void update_pressure();
+};
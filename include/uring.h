@@ -1,6 +1,7 @@
 #pragma once
 
 #include <liburing.h>
+#include <unordered_set>
 #include "asyncio.h"
 
 class UringAsyncIO : public AsyncIO
@@ -9,8 +10,14 @@ private:
     unsigned int n_write_events, n_read_events;
     unsigned int n_entries;
     io_uring ring;
+    bool plugged;
+    // requests in flight, searched by cancel()
+    std::unordered_set<IOData *> inflight;
 
     void get_event(WaitType wt);
+    void done_event(IOType type);
+    void submit(IOData *data);
+    io_uring_sqe *get_sqe();
 
 public:
     UringAsyncIO(unsigned int n_entries, unsigned int n_tasks);
@@ -20,6 +27,8 @@ public:
     void read(int fd, void *buffer, size_t n_bytes, unsigned long long offset, callback_t callback);
     void writev(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
     void readv(int fd, const iovec *iov, unsigned int iovcnt, unsigned long long offset, callback_t callback);
+    void plug();
+    void unplug();
 
     void register_h2d(unsigned int num_tensors);
     void sync_h2d();
@@ -30,4 +39,5 @@ public:
     void register_file(int fd);
     void write_tensor(int fd, torch::Tensor t, unsigned long long offset, callback_t callback, std::optional<torch::Tensor> pinned);
     void register_tasks(unsigned int num_tasks);
+    void cancel(unsigned long long tag);
 };
\ No newline at end of file
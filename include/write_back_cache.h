@@ -0,0 +1,62 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include "offload.h"
+
+// DRAM cache tier in front of the offload file: writes are copied into the cache and only reach
+// the disk on flush or eviction, so repeated updates of a key coalesce into one write;
+// not thread-safe, like Offloader
+class WriteBackCache
+{
+public:
+    WriteBackCache(const std::string &filename, ull capacity_bytes, unsigned int n_entries, const std::string &backend);
+    ~WriteBackCache();
+    // the tensor can be modified or freed as soon as write() returns
+    void write(const at::Tensor &tensor, const std::string &key);
+    void read(const at::Tensor &tensor, const std::string &key);
+    // pinned keys are never evicted, pinning a key which is not cached takes effect when it is
+    void pin(const std::string &key);
+    void unpin(const std::string &key);
+    // start writing back the key or all dirty keys, the data stays cached
+    void flush(const std::string &key);
+    void flush_all();
+    // flush all dirty keys and wait until they are on disk
+    void barrier();
+    void erase(const std::string &key);
+    bool contains(const std::string &key) const;
+    ull cached_bytes() const;
+    ull dirty_bytes() const;
+    std::unordered_map<std::string, ull> stats() const;
+
+private:
+    struct Entry
+    {
+        at::Tensor buffer;
+        ull bytes;
+        bool dirty;
+        ull tick;
+    };
+
+    Offloader offloader;
+    const ull capacity_bytes;
+    std::unordered_map<std::string, Entry> entries;
+    // unpinned entries by last access
+    std::set<std::pair<ull, std::string>> victims;
+    std::unordered_set<std::string> pinned;
+    // keys with a write in flight, at most one per key
+    std::unordered_set<std::string> writing;
+    std::unordered_set<std::string> on_disk;
+    ull cached, dirty, tick;
+    ull n_hits, n_misses, n_writes, n_absorbed, n_flushes, n_evictions, n_bypassed;
+
+    void touch(const std::string &key, Entry &entry);
+    void insert(const std::string &key, const at::Tensor &buffer, bool dirty);
+    void make_room(ull bytes);
+    void write_back(const std::string &key, Entry &entry);
+    void wait_written(const std::string &key);
+};
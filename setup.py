@@ -54,7 +54,24 @@ sources = [
     "csrc/uring.cpp",
     "csrc/aio.cpp",
     "csrc/space_mgr.cpp",
+    "csrc/handle_table.cpp",
+    "csrc/access_predictor.cpp",
+    "csrc/offload_index.cpp",
+    "csrc/host_arena.cpp",
+    "csrc/disk_offloader.cpp",
+    "csrc/tensor_store.cpp",
+    "csrc/write_back_cache.cpp",
+    "csrc/sharded_offloader.cpp",
+    "csrc/prefetch_iterator.cpp",
     "csrc/backend.cpp",
+    "csrc/io_profile.cpp",
+    "csrc/queued_asyncio.cpp",
+    "csrc/io_lanes.cpp",
+    "csrc/deadline_scheduler.cpp",
+    "csrc/depth_controller.cpp",
+    "csrc/adaptive_depth.cpp",
+    "csrc/io_arbiter.cpp",
+    "csrc/shared_engine.cpp",
     "csrc/async_file_io.cpp",
     "csrc/py_api.cpp",
     "csrc/pthread_backend.cpp",
@@ -1,13 +1,38 @@
-from typing import Callable, List, Optional, Set
+from typing import Callable, Dict, Iterator, List, Optional, Set, Tuple, overload
 
 from torch import Tensor
 
 class Offloader:
-    def __init__(self, filename: str, n_entries: int, backend: str = "aio") -> None: ...
-    def async_write(self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None) -> None: ...
-    def async_read(self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None) -> None: ...
+    def __init__(
+        self,
+        filename: str,
+        n_entries: int,
+        backend: str = "aio",
+        persistent: bool = False,
+        retain: bool = False,
+        thread_safe: bool = False,
+        engine: Optional[SharedEngine] = None,
+    ) -> None: ...
+    @overload
+    def async_write(
+        self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None, deadline: float = -1.0
+    ) -> None: ...
+    @overload
+    def async_write(self, tensor: Tensor, handle: int, callback: Optional[Callable[[], None]] = None) -> None: ...
+    @overload
+    def async_read(
+        self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None, deadline: float = -1.0
+    ) -> None: ...
+    @overload
+    def async_read(self, tensor: Tensor, handle: int, callback: Optional[Callable[[], None]] = None) -> None: ...
+    @overload
     def sync_write(self, tensor: Tensor, key: str) -> None: ...
+    @overload
+    def sync_write(self, tensor: Tensor, handle: int) -> None: ...
+    @overload
     def sync_read(self, tensor: Tensor, key: str) -> None: ...
+    @overload
+    def sync_read(self, tensor: Tensor, handle: int) -> None: ...
     def sync_write_events(self) -> None: ...
     def sync_read_events(self) -> None: ...
     def synchronize(self) -> None: ...
@@ -15,12 +40,201 @@ class Offloader:
     def async_readv(self, tensors: List[Tensor], key: str, callback: Optional[Callable[[], None]] = None) -> None: ...
     def sync_writev(self, tensors: List[Tensor], key: str) -> None: ...
     def sync_readv(self, tensors: List[Tensor], key: str) -> None: ...
+    def compact(self, max_bytes: int = 0) -> int: ...
+    def start_compaction(self, bytes_per_sec: int = 0, min_fragmentation: float = 0.25, interval_ms: int = 100) -> None: ...
+    def stop_compaction(self) -> None: ...
+    def file_bytes(self) -> int: ...
+    def live_bytes(self) -> int: ...
+    def plan_layout(self, entries: List[Tuple[str, int, int]], alignment: int = 4096) -> int: ...
+    @overload
+    def register(self, tensor: Tensor) -> int: ...
+    @overload
+    def register(self, n_bytes: int) -> int: ...
+    def unregister(self, handle: int) -> None: ...
+    def metadata_bytes(self) -> int: ...
+    def keys(self) -> List[str]: ...
+    def load(self, key: str, mmap: bool = False) -> Tensor: ...
+    @overload
+    def drop(self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None) -> bool: ...
+    @overload
+    def drop(self, tensor: Tensor, handle: int, callback: Optional[Callable[[], None]] = None) -> bool: ...
+    def dropv(self, tensors: List[Tensor], key: str, callback: Optional[Callable[[], None]] = None) -> bool: ...
+    def erase(self, key: str) -> None: ...
+    @overload
+    def map(self, tensor: Tensor, key: str, advice: str = "willneed", prefault: bool = False) -> Tensor: ...
+    @overload
+    def map(self, tensor: Tensor, handle: int, advice: str = "willneed", prefault: bool = False) -> Tensor: ...
+    def flush_mapped(self, tensor: Tensor) -> None: ...
+    def async_write_batch(
+        self, tensors: List[Tensor], keys: List[str], callback: Optional[Callable[[], None]] = None
+    ) -> List[int]: ...
+    def async_read_batch(
+        self, tensors: List[Tensor], keys: List[str], callback: Optional[Callable[[], None]] = None
+    ) -> None: ...
+    def sync_write_batch(self, tensors: List[Tensor], keys: List[str]) -> List[int]: ...
+    def sync_read_batch(self, tensors: List[Tensor], keys: List[str]) -> None: ...
+    def inflight_stats(self) -> Dict[str, int]: ...
+    def start_recording(self) -> None: ...
+    def stop_recording(self, budget_bytes: int) -> None: ...
+    def stop_prefetching(self) -> None: ...
+    def prefetch_stats(self) -> Dict[str, int]: ...
+    def start_capture(self) -> None: ...
+    def stop_capture(self) -> None: ...
+    def stop_replay(self) -> None: ...
+    def replay_stats(self) -> Dict[str, int]: ...
+    def set_io_priority(self, read_priority: str = "normal", write_priority: str = "normal", max_writes: int = 0) -> None: ...
+    def held_writes(self) -> int: ...
+    def set_deadline_scheduler(self, depth: int = 0, slack: float = 0.1) -> None: ...
+    def deadline_stats(self) -> Dict[str, int]: ...
+    def set_autotune(self, min_depth: int = 1, latency_tolerance: float = 2.0) -> None: ...
+    def autotune_stats(self) -> Dict[str, int]: ...
+    @overload
+    def cancel(self, key: str) -> int: ...
+    @overload
+    def cancel(self, handle: int) -> int: ...
+    def cancel_all(self) -> int: ...
+    def set_io_class(self, arbiter: IOArbiter, io_class: str) -> None: ...
+
+class DiskOffloader(Offloader):
+    def __init__(
+        self,
+        filename: str,
+        n_entries: int,
+        backend: str = "aio",
+        retain: bool = False,
+        arena: Optional[HostArena] = None,
+        thread_safe: bool = False,
+        engine: Optional[SharedEngine] = None,
+    ) -> None: ...
+    def async_write(self, tensor: Tensor, callback: Optional[Callable[[], None]] = None) -> None: ...
+    def async_read(self, tensor: Tensor, callback: Optional[Callable[[], None]] = None) -> None: ...
+    def sync_write(self, tensor: Tensor) -> None: ...
+    def sync_read(self, tensor: Tensor) -> None: ...
+    def async_writev(self, tensors: List[Tensor], callback: Optional[Callable[[], None]] = None) -> None: ...
+    def async_readv(self, tensors: List[Tensor], callback: Optional[Callable[[], None]] = None) -> None: ...
+    def sync_writev(self, tensors: List[Tensor]) -> None: ...
+    def sync_readv(self, tensors: List[Tensor]) -> None: ...
+    def drop(self, tensor: Tensor, callback: Optional[Callable[[], None]] = None) -> bool: ...
+    def dropv(self, tensors: List[Tensor], callback: Optional[Callable[[], None]] = None) -> bool: ...
+    def map(self, tensor: Tensor, advice: str = "willneed", prefault: bool = False) -> Tensor: ...
+    def erase(self, tensor: Tensor) -> None: ...
+    def async_write_batch(self, tensors: List[Tensor], callback: Optional[Callable[[], None]] = None) -> List[int]: ...
+    def async_read_batch(self, tensors: List[Tensor], callback: Optional[Callable[[], None]] = None) -> None: ...
+    def sync_write_batch(self, tensors: List[Tensor]) -> List[int]: ...
+    def sync_read_batch(self, tensors: List[Tensor]) -> None: ...
+    @overload
+    @staticmethod
+    def key(tensor: Tensor) -> str: ...
+    @overload
+    @staticmethod
+    def key(tensors: List[Tensor]) -> str: ...
+
+class HostArena:
+    def __init__(self, max_cached_bytes: int = 0, hugepage: bool = False, lock: bool = True) -> None: ...
+    def acquire(self, tensor: Tensor) -> None: ...
+    def release(self, tensor: Tensor) -> None: ...
+    def trim(self) -> None: ...
+    def allocated_bytes(self) -> int: ...
+    def cached_bytes(self) -> int: ...
+    def n_hits(self) -> int: ...
+    def n_misses(self) -> int: ...
+
+class TensorStore:
+    def __init__(
+        self,
+        filename: str,
+        capacity_bytes: int,
+        n_entries: int,
+        backend: str = "aio",
+        policy: str = "lru",
+        prefetch_depth: int = 2,
+        arena: Optional[HostArena] = None,
+    ) -> None: ...
+    def put(self, key: str, tensor: Tensor) -> None: ...
+    def get(self, key: str) -> Tensor: ...
+    def prefetch(self, key: str) -> None: ...
+    def remove(self, key: str) -> None: ...
+    def contains(self, key: str) -> bool: ...
+    def is_resident(self, key: str) -> bool: ...
+    def synchronize(self) -> None: ...
+    def resident_bytes(self) -> int: ...
+    def budget_bytes(self) -> int: ...
+    def stats(self) -> Dict[str, int]: ...
+    def set_pressure_limits(
+        self, max_usage_ratio: float = 0.9, max_psi_avg10: float = 20.0, interval_ms: int = 100
+    ) -> None: ...
+
+class WriteBackCache:
+    def __init__(self, filename: str, capacity_bytes: int, n_entries: int, backend: str = "aio") -> None: ...
+    def write(self, tensor: Tensor, key: str) -> None: ...
+    def read(self, tensor: Tensor, key: str) -> None: ...
+    def pin(self, key: str) -> None: ...
+    def unpin(self, key: str) -> None: ...
+    def flush(self, key: str) -> None: ...
+    def flush_all(self) -> None: ...
+    def barrier(self) -> None: ...
+    def erase(self, key: str) -> None: ...
+    def contains(self, key: str) -> bool: ...
+    def cached_bytes(self) -> int: ...
+    def dirty_bytes(self) -> int: ...
+    def stats(self) -> Dict[str, int]: ...
+
+class ShardedOffloader:
+    def __init__(self, filename: str, n_shards: int, n_entries: int, backend: str = "aio") -> None: ...
+    def async_write(self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None) -> None: ...
+    def async_read(self, tensor: Tensor, key: str, callback: Optional[Callable[[], None]] = None) -> None: ...
+    def sync_write(self, tensor: Tensor, key: str) -> None: ...
+    def sync_read(self, tensor: Tensor, key: str) -> None: ...
+    def erase(self, key: str) -> None: ...
+    def synchronize(self) -> None: ...
+    def close(self) -> None: ...
+    def n_shards(self) -> int: ...
+    def shard_of(self, key: str) -> int: ...
+
+class PrefetchIterator(Iterator[List[Tensor]]):
+    def __init__(
+        self,
+        offloader: DiskOffloader,
+        groups: List[List[Tensor]],
+        depth: int = 2,
+        max_depth: int = 8,
+        adaptive: bool = True,
+    ) -> None: ...
+    def __iter__(self) -> PrefetchIterator: ...
+    def __next__(self) -> List[Tensor]: ...
+    def close(self) -> None: ...
+    def depth(self) -> int: ...
+    def stall_seconds(self) -> float: ...
 
 def get_backends() -> Set[str]: ...
-def probe_backend(backend: str) -> bool: ...
+def probe_backend(backend: str, cached: bool = True) -> bool: ...
+
+class IOProfile:
+    path: str
+    backend: str
+    n_entries: int
+    chunk_bytes: int
+    write_bytes_per_sec: float
+    read_bytes_per_sec: float
+    def __init__(
+        self,
+        path: str,
+        backend: str,
+        n_entries: int,
+        chunk_bytes: int,
+        write_bytes_per_sec: float = 0.0,
+        read_bytes_per_sec: float = 0.0,
+    ) -> None: ...
+
+def get_profile_path() -> str: ...
+def find_io_profile(path: str = "") -> Optional[IOProfile]: ...
+def save_io_profile(profile: IOProfile) -> None: ...
+def measure_engine(path: str, backend: str, n_entries: int, request_bytes: int, total_bytes: int) -> Dict[str, float]: ...
 
 class AsyncFileWriter:
-    def __init__(self, fd: int, n_entries: int, backend: str = "aio", n_tasks: int = 0) -> None: ...
+    def __init__(
+        self, fd: int, n_entries: int, backend: str = "aio", n_tasks: int = 0, engine: Optional[SharedEngine] = None
+    ) -> None: ...
     def write(self, buffer: int, n_bytes: int, offset: int, callback: Optional[Callable[[], None]] = None) -> None: ...
     def write_tensor(
         self,
@@ -31,3 +245,17 @@ class AsyncFileWriter:
     ) -> None: ...
     def synchronize(self) -> None: ...
     def register_tasks(self, num_tasks: int) -> None: ...
+    def set_priority(self, priority: str) -> None: ...
+    def set_io_class(self, arbiter: IOArbiter, io_class: str) -> None: ...
+
+class IOArbiter:
+    def __init__(self, bytes_per_sec: int = 0, iops: int = 0, max_inflight: int = 0) -> None: ...
+    def add_class(self, name: str, weight: float = 1.0, bytes_per_sec: int = 0, iops: int = 0) -> None: ...
+    def stats(self) -> Dict[str, Dict[str, int]]: ...
+
+class SharedEngine:
+    def __init__(self, n_entries: int, backend: str = "aio", n_tasks: int = 0) -> None: ...
+    @staticmethod
+    def process(backend: str = "aio", n_entries: int = 64) -> SharedEngine: ...
+    def n_entries(self) -> int: ...
+    def n_attached(self) -> int: ...
@@ -1,5 +1,6 @@
 import click
 from .check import check
+from .tune import tune
 
 
 @click.group()
@@ -8,6 +9,7 @@ def cli():
 
 
 cli.add_command(check)
+cli.add_command(tune)
 
 if __name__ == '__main__':
     cli()
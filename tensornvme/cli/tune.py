@@ -0,0 +1,97 @@
+import os
+from typing import Dict, List, Optional
+
+import click
+from tensornvme._C import IOProfile, get_backends, get_profile_path, measure_engine, probe_backend, save_io_profile
+
+QUEUE_PARAMS = ['nr_requests', 'max_sectors_kb', 'max_hw_sectors_kb', 'logical_block_size', 'rotational', 'scheduler']
+
+
+def queue_params(directory: str) -> Dict[str, str]:
+    dev = os.stat(directory).st_dev
+    sysfs = os.path.realpath(f'/sys/dev/block/{os.major(dev)}:{os.minor(dev)}')
+    # partitions have no queue of their own, it is the disk's
+    for path in (sysfs, os.path.dirname(sysfs)):
+        queue = os.path.join(path, 'queue')
+        if os.path.isdir(queue):
+            break
+    else:
+        return {}
+    params = {}
+    for name in QUEUE_PARAMS:
+        try:
+            with open(os.path.join(queue, name)) as f:
+                params[name] = f.read().strip()
+        except OSError:
+            pass
+    return params
+
+
+def parse_sizes(sizes: str) -> List[int]:
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    result = []
+    for size in sizes.split(','):
+        size = size.strip().upper()
+        if size[-1] in units:
+            result.append(int(size[:-1]) * units[size[-1]])
+        else:
+            result.append(int(size))
+    return result
+
+
+def score(result: Dict[str, float]) -> float:
+    # offloading reads back what it writes, so neither direction may be slow
+    w, r = result['write_bytes_per_sec'], result['read_bytes_per_sec']
+    return 2 * w * r / (w + r) if w + r > 0 else 0.0
+
+
+@click.command(help='Tune the backend, queue depth and request size for the device of a directory')
+@click.argument('directory', type=click.Path(exists=True, file_okay=False), default='.')
+@click.option('--backend', type=click.Choice(['all', *get_backends()]), default='all')
+@click.option('--depths', default='8,16,32,64,128', help='Queue depths to try')
+@click.option('--request-sizes', default='64K,256K,1M,4M', help='Request sizes to try')
+@click.option('--total-size', default='256M', help='Bytes written and read back per measurement')
+@click.option('--dry-run', is_flag=True, help='Print the best values without writing the profile')
+def tune(directory: str, backend: str, depths: str, request_sizes: str, total_size: str, dry_run: bool):
+    directory = os.path.abspath(directory)
+    params = queue_params(directory)
+    click.echo(f'Device queue of {directory}:')
+    for name, value in params.items():
+        click.echo(f'  {name}: {value}')
+
+    backends = sorted(get_backends()) if backend == 'all' else [backend]
+    backends = [b for b in backends if probe_backend(b, cached=False)]
+    click.echo(f'Working backends: {", ".join(backends) if backends else "none"}')
+    if not backends:
+        return
+
+    depth_list = sorted(int(d) for d in depths.split(','))
+    # deeper queues only wait in the block layer
+    if 'nr_requests' in params:
+        depth_list = [d for d in depth_list if d <= int(params['nr_requests'])] or depth_list[:1]
+    sizes = sorted(parse_sizes(request_sizes))
+    total_bytes = parse_sizes(total_size)[0]
+
+    best: Optional[IOProfile] = None
+    best_score = 0.0
+    for b in backends:
+        for depth in depth_list:
+            for size in sizes:
+                result = measure_engine(directory, b, depth, size, max(total_bytes, size * depth))
+                s = score(result)
+                click.echo(f'  {b:8s} depth {depth:4d} request {size >> 10:6d} KB: '
+                           f'write {result["write_bytes_per_sec"] / (1 << 20):8.0f} MB/s, '
+                           f'read {result["read_bytes_per_sec"] / (1 << 20):8.0f} MB/s')
+                # smaller depths and requests are tried first and kept unless clearly beaten
+                if best is None or s > best_score * 1.05:
+                    best = IOProfile(directory, b, depth, size, result['write_bytes_per_sec'],
+                                     result['read_bytes_per_sec'])
+                    best_score = s
+
+    click.echo(f'Best: backend {best.backend}, n_entries {best.n_entries}, chunk {best.chunk_bytes >> 10} KB')
+    if dry_run:
+        return
+    profile_path = get_profile_path()
+    os.makedirs(os.path.dirname(profile_path), exist_ok=True)
+    save_io_profile(best)
+    click.echo(f'Profile written to {profile_path}')
@@ -0,0 +1,75 @@
+#define CATCH_CONFIG_MAIN
+#include <stdio.h>
+#include "catch.hpp"
+
+#include "access_predictor.h"
+
+
+static void record_step(AccessPredictor &predictor, int n_keys) {
+    predictor.start_recording();
+    for (int i = 0; i < n_keys; i++)
+        predictor.record("k" + std::to_string(i), 4096, i * 0.01);
+    predictor.stop_recording();
+}
+
+TEST_CASE( "Test access predictor function" ) {
+    AccessPredictor predictor(4);
+
+    SECTION( "record and follow" ) {
+        REQUIRE_FALSE(predictor.ready());
+        record_step(predictor, 10);
+        REQUIRE(predictor.ready());
+        REQUIRE(predictor.size() == 10);
+        REQUIRE(predictor.key(3) == "k3");
+        REQUIRE(predictor.bytes(3) == 4096);
+        for (int step = 0; step < 2; step++) {
+            for (int i = 0; i < 10; i++)
+                REQUIRE(predictor.observe("k" + std::to_string(i)) == i);
+        }
+        REQUIRE(predictor.observe("unknown") == -1);
+        REQUIRE(predictor.position() == 0);
+    }
+
+    SECTION( "upcoming accesses" ) {
+        record_step(predictor, 10);
+        predictor.observe("k0");
+        // 0.01s between accesses
+        auto indices = predictor.upcoming(0.025, 16);
+        REQUIRE(indices == std::vector<size_t>({1, 2}));
+        // at least one access, even if it is too far
+        REQUIRE(predictor.upcoming(0.0, 16).size() == 1);
+        REQUIRE(predictor.upcoming(1.0, 3).size() == 3);
+        // wraps into the next step
+        for (int i = 1; i < 9; i++)
+            predictor.observe("k" + std::to_string(i));
+        indices = predictor.upcoming(0.025, 16);
+        REQUIRE(indices == std::vector<size_t>({9, 0}));
+    }
+
+    SECTION( "deviations" ) {
+        record_step(predictor, 10);
+        predictor.observe("k0");
+        // a skipped key
+        REQUIRE(predictor.observe("k2") == 2);
+        REQUIRE(predictor.position() == 3);
+        REQUIRE(predictor.between(1, 1, 2));
+        REQUIRE_FALSE(predictor.between(2, 1, 2));
+        // a repeated key does not move the position
+        REQUIRE(predictor.observe("k2") == 2);
+        REQUIRE(predictor.position() == 3);
+        // a jump re-synchronizes
+        REQUIRE(predictor.observe("k8") == 8);
+        REQUIRE(predictor.position() == 9);
+        REQUIRE(predictor.between(0, 8, 2));
+        REQUIRE_FALSE(predictor.between(5, 8, 2));
+    }
+
+    SECTION( "recording again" ) {
+        record_step(predictor, 10);
+        record_step(predictor, 3);
+        REQUIRE(predictor.size() == 3);
+        REQUIRE(predictor.observe("k5") == -1);
+        predictor.clear();
+        REQUIRE_FALSE(predictor.ready());
+    }
+}
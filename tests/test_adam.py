@@ -7,6 +7,7 @@ from torch import nn
 from transformers import GPT2Config, GPT2LMHeadModel
 
 from tensornvme import DiskOffloader
+from tensornvme._C import PrefetchIterator
 
 
 class GPTLMModel(nn.Module):
@@ -42,12 +43,14 @@ def adam(step, lr, param, grad, exp_avg, exp_avg_sq, beta1=0.9, beta2=0.999, eps
 
 class NVMEAdam(torch.optim.Optimizer):
     def __init__(self, params, lr, betas=(0.9, 0.999),
-                 offloader: Optional[DiskOffloader] = None, prefetch: int = 0, vecio: bool = False) -> None:
+                 offloader: Optional[DiskOffloader] = None, prefetch: int = 0, vecio: bool = False,
+                 iterator: bool = False) -> None:
         default = dict(lr=lr, betas=betas)
         super().__init__(params, default)
         self.offloader = offloader
         self.prefetch = prefetch
         self.vecio = vecio
+        self.iterator = iterator
         self.param_to_group = {}
         # init states
         for group in self.param_groups:
@@ -60,7 +63,7 @@ class NVMEAdam(torch.optim.Optimizer):
                     state['exp_avg_sq'] = torch.zeros_like(p)
                     if self.offloader is None:
                         continue
-                    if vecio:
+                    if vecio and not iterator:
                         self.offloader.sync_writev(
                             [state['exp_avg'], state['exp_avg_sq']])
                     else:
@@ -75,6 +78,18 @@ class NVMEAdam(torch.optim.Optimizer):
 
         params = [
             p for group in self.param_groups for p in group['params'] if p.grad is not None]
+        if self.offloader is not None and self.iterator:
+            # the iterator keeps the reads of the next params in flight and writes back the previous ones
+            groups = [[self.state[p]['exp_avg'], self.state[p]['exp_avg_sq']] for p in params]
+            it = PrefetchIterator(self.offloader, groups, max(self.prefetch, 1))
+            for p, (exp_avg, exp_avg_sq) in zip(params, it):
+                state = self.state[p]
+                group = self.param_to_group[p]
+                state['step'] += 1
+                beta1, beta2 = group['betas']
+                adam(state['step'], group['lr'], p, p.grad, exp_avg, exp_avg_sq, beta1=beta1, beta2=beta2)
+            it.close()
+            return loss
         if self.offloader is not None and self.prefetch > 0:
             for p in params[:self.prefetch]:
                 state = self.state[p]
@@ -214,6 +229,9 @@ def test_adam():
 
         {'n_entries': 1, 'backend': 'pthread', 'prefetch': 0, 'vecio': True},
         {'n_entries': 8, 'backend': 'pthread', 'prefetch': 2, 'vecio': True},
+
+        {'n_entries': 8, 'backend': 'uring', 'prefetch': 2, 'vecio': False, 'iterator': True},
+        {'n_entries': 8, 'backend': 'aio', 'prefetch': 2, 'vecio': False, 'iterator': True},
     ]
 
     for i, cfg in enumerate(test_config):
@@ -227,7 +245,8 @@ def test_adam():
             offloader = DiskOffloader(
                 '.', cfg['n_entries'], backend=cfg['backend'])
         optimizer_test = NVMEAdam(
-            params_test, 1e-3, offloader=offloader, prefetch=cfg['prefetch'], vecio=cfg['vecio'])
+            params_test, 1e-3, offloader=offloader, prefetch=cfg['prefetch'], vecio=cfg['vecio'],
+            iterator=cfg.get('iterator', False))
         optimizer_test.step()
 
         for p1, p2, p3 in zip(params_gt, params_test, params):
@@ -0,0 +1,71 @@
+#define CATCH_CONFIG_MAIN
+#include <stdio.h>
+#include <algorithm>
+#include "catch.hpp"
+
+#include "depth_controller.h"
+
+using clock_type = DepthController::clock;
+
+// one epoch of completions over 20 ms of synthetic time, with latency_us for every request
+static void run_epoch(DepthController &controller, clock_type::time_point &now, unsigned long long bytes, int latency_us, bool saturated) {
+    unsigned int n = std::max(8u, 2 * controller.depth());
+    clock_type::duration step = clock_type::duration(std::chrono::milliseconds(20)) / n;
+    if (saturated)
+        controller.saturated();
+    for (unsigned int i = 0; i < n; i++) {
+        now += step;
+        controller.completed(bytes, std::chrono::microseconds(latency_us), now);
+    }
+}
+
+TEST_CASE( "Test depth controller function" ) {
+    DepthController controller(64, 2, 2.0);
+    clock_type::time_point now = clock_type::now();
+
+    SECTION( "bounds" ) {
+        REQUIRE(controller.depth() == 32);
+        REQUIRE(controller.batch() == 1);
+        DepthController small(1, 8, 0.5);
+        REQUIRE(small.depth() == 1);
+    }
+
+    SECTION( "grows while saturated" ) {
+        for (int i = 0; i < 10; i++)
+            run_epoch(controller, now, 4096, 100, true);
+        REQUIRE(controller.depth() == 42);
+        REQUIRE(controller.batch() == 11);
+        REQUIRE(controller.stats().at("increases") == 10);
+        // not saturated, nothing to gain
+        run_epoch(controller, now, 4096, 100, false);
+        REQUIRE(controller.depth() == 42);
+    }
+
+    SECTION( "shrinks when latency exceeds the tolerance" ) {
+        run_epoch(controller, now, 4096, 100, true);
+        REQUIRE(controller.depth() == 33);
+        // within the tolerance
+        run_epoch(controller, now, 4096, 150, true);
+        REQUIRE(controller.depth() == 34);
+        run_epoch(controller, now, 4096, 1000, true);
+        REQUIRE(controller.depth() == 26);
+        REQUIRE(controller.stats().at("decreases") == 1);
+        for (int i = 0; i < 20; i++)
+            run_epoch(controller, now, 4096, 5000, true);
+        REQUIRE(controller.depth() == 2);
+    }
+
+    SECTION( "latency is compared per request size" ) {
+        run_epoch(controller, now, 4096, 100, true);
+        run_epoch(controller, now, 4 << 20, 5000, true);
+        // large requests are slow for their size only, not congested
+        for (int i = 0; i < 4; i++) {
+            run_epoch(controller, now, 4096, 100, true);
+            run_epoch(controller, now, 4 << 20, 5000, true);
+        }
+        REQUIRE(controller.stats().at("decreases") == 0);
+        REQUIRE(controller.depth() > 32);
+        run_epoch(controller, now, 4 << 20, 50000, true);
+        REQUIRE(controller.stats().at("decreases") == 1);
+    }
+}
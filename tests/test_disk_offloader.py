@@ -1,6 +1,12 @@
+import os
+import time
+from concurrent.futures import ThreadPoolExecutor
+
 import torch
 import pytest
 from tensornvme import DiskOffloader
+from tensornvme._C import (HostArena, IOArbiter, IOProfile, Offloader, PrefetchIterator, ShardedOffloader, SharedEngine,
+                           TensorStore, WriteBackCache, find_io_profile, measure_engine, save_io_profile)
 
 
 @pytest.mark.parametrize('backend', ['uring', 'aio'])
@@ -102,8 +108,797 @@ def test_async_vec_io(backend):
     assert torch.equal(y, y_copy)
 
 
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_compaction(backend):
+    x = torch.rand(1024)
+    y = torch.rand(1024)
+    z = torch.rand(512)
+    z_copy = z.clone()
+    of = DiskOffloader('.', backend=backend)
+    of.sync_write(x)
+    of.sync_write(y)
+    of.sync_write(z)
+    of.sync_read(x)
+    of.sync_read(y)
+    assert of.file_bytes() == (1024 + 1024 + 512) * 4
+    assert of.live_bytes() == 512 * 4
+    assert of.compact() == 512 * 4
+    assert of.file_bytes() == 512 * 4
+    of.sync_read(z)
+    assert torch.equal(z, z_copy)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_static_layout(backend):
+    x = torch.rand(100)
+    y = torch.rand(100)
+    z = torch.rand(1024)
+    x_copy, y_copy, z_copy = x.clone(), y.clone(), z.clone()
+    of = DiskOffloader('.', backend=backend)
+    # [x, y] at [0, 800), z at [4096, 8192)
+    assert of.plan_layout([[x, y], [z]]) == 8192
+    of.sync_write(z)
+    of.sync_write(x)
+    of.sync_write(y)
+    assert of.file_bytes() == 8192
+    of.sync_read(x)
+    of.sync_read(y)
+    of.sync_read(z)
+    # planned extents are never freed
+    assert of.live_bytes() == 8192
+    assert torch.equal(x, x_copy)
+    assert torch.equal(y, y_copy)
+    assert torch.equal(z, z_copy)
+    try:
+        of.plan_layout([[x]])
+        assert False
+    except RuntimeError:
+        pass
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_handle_io(backend):
+    x = torch.rand(2, 2)
+    y = torch.rand(4)
+    x_copy, y_copy = x.clone(), y.clone()
+    of = Offloader('./offload-test-handle', 8, backend)
+    hx = of.register(x)
+    hy = of.register(y.numel() * y.element_size())
+    try:
+        of.sync_read(x, hx)
+        assert False
+    except RuntimeError:
+        pass
+    of.sync_write(x, hx)
+    of.async_write(y, hy)
+    of.synchronize()
+    x.zero_()
+    y.zero_()
+    of.sync_read(x, hx)
+    of.async_read(y, hy)
+    of.synchronize()
+    assert torch.equal(x, x_copy)
+    assert torch.equal(y, y_copy)
+    # handles stay valid after reads
+    of.sync_write(x, hx)
+    of.unregister(hx)
+    try:
+        of.sync_read(x, hx)
+        assert False
+    except RuntimeError:
+        pass
+    assert of.live_bytes() == 0
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_persistent(backend):
+    filename = './offload-test-persistent'
+    x = torch.rand(2, 3)
+    y = torch.rand(5).half()
+    z = torch.rand(4)
+    of = Offloader(filename, 8, backend, persistent=True)
+    of.sync_write(x, 'x')
+    of.async_write(y, 'y')
+    of.sync_write(z, 'z')
+    of.synchronize()
+    of.sync_read(z, 'z')
+    del of
+    try:
+        # warm restart, no tensor is written again
+        of = Offloader(filename, 8, backend, persistent=True)
+        assert sorted(of.keys()) == ['x', 'y']
+        assert torch.equal(of.load('x'), x)
+        y_loaded = of.load('y')
+        assert y_loaded.dtype == torch.half
+        assert torch.equal(y_loaded, y)
+        assert of.keys() == []
+        del of
+    finally:
+        os.remove(filename)
+        os.remove(filename + '.index')
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_retain(backend):
+    x = torch.rand(2, 3)
+    x_copy = x.clone()
+    of = DiskOffloader('.', backend=backend, retain=True)
+    of.sync_write(x)
+    of.sync_read(x)
+    assert torch.equal(x, x_copy)
+    # unmodified since the read, the on-disk copy is reused
+    assert of.drop(x)
+    assert x.storage().size() == 0
+    of.sync_read(x)
+    assert torch.equal(x, x_copy)
+    x.add_(1)
+    assert not of.drop(x)
+    of.synchronize()
+    assert x.storage().size() == 0
+    of.sync_read(x)
+    assert torch.equal(x, x_copy + 1)
+    of.erase(x)
+    assert of.live_bytes() == 0
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_mmap(backend):
+    x = torch.rand(1000, 3)
+    x_copy = x.clone()
+    of = DiskOffloader('.', backend=backend, retain=True)
+    of.sync_write(x)
+    y = of.map(x, advice='sequential,willneed', prefault=True)
+    assert torch.equal(y, x_copy)
+    # the extent is pinned while it is mapped
+    with pytest.raises(RuntimeError):
+        of.erase(x)
+    y.mul_(2)
+    of.flush_mapped(y)
+    of.synchronize()
+    del y
+    of.sync_read(x)
+    assert torch.equal(x, x_copy * 2)
+    of.erase(x)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_host_arena(backend):
+    arena = HostArena(lock=False)
+    of = DiskOffloader('.', backend=backend, arena=arena)
+    x = torch.rand(256, 256)
+    x_copy = x.clone()
+    of.sync_write(x)
+    for _ in range(3):
+        of.sync_read(x)
+        assert torch.equal(x, x_copy)
+        of.async_write(x)
+        of.synchronize()
+        assert x.storage().size() == 0
+    # the first read maps a buffer, later reads reuse it
+    assert arena.n_misses() == 1
+    assert arena.n_hits() == 2
+    assert arena.cached_bytes() == arena.allocated_bytes()
+    arena.trim()
+    assert arena.allocated_bytes() == 0
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_sync_chunked_io(backend):
+    # large tensors are split into chunks which are submitted together
+    x = torch.rand(1 << 22)
+    y = torch.rand(3, 1000)
+    x_copy, y_copy = x.clone(), y.clone()
+    of = DiskOffloader('.', n_entries=4, backend=backend)
+    of.sync_write(x)
+    of.sync_writev([x_copy, y])
+    of.sync_read(x)
+    assert torch.equal(x, x_copy)
+    of.sync_readv([x_copy, y])
+    assert torch.equal(x_copy, x)
+    assert torch.equal(y, y_copy)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_storage_key(backend):
+    x = torch.rand(4, 4)
+    x_copy = x.clone()
+    # views of the same storage share a key
+    assert DiskOffloader.key(x) == DiskOffloader.key(x.view(16))
+    assert DiskOffloader.key(x) != DiskOffloader.key(x_copy)
+    of = DiskOffloader('.', backend=backend)
+    done = []
+    of.async_write(x, lambda: done.append(x.storage().size()))
+    of.synchronize()
+    assert done == [0]
+    of.sync_read(x.view(16))
+    assert torch.equal(x, x_copy)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_thread_safe(backend):
+    of = DiskOffloader('.', backend=backend, thread_safe=True)
+
+    def worker(seed):
+        tensors = [torch.full((1024,), seed * 100 + i, dtype=torch.float) for i in range(20)]
+        copies = [tensor.clone() for tensor in tensors]
+        for _ in range(3):
+            for tensor in tensors:
+                of.async_write(tensor)
+            of.synchronize()
+            for tensor in tensors:
+                of.sync_read(tensor)
+        return all(torch.equal(tensor, copy) for tensor, copy in zip(tensors, copies))
+
+    with ThreadPoolExecutor(8) as pool:
+        assert all(pool.map(worker, range(8)))
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_batch_io(backend):
+    tensors = [torch.rand(i + 1) for i in range(100)]
+    copies = [tensor.clone() for tensor in tensors]
+    keys = [f'tensor{i}' for i in range(len(tensors))]
+    of = Offloader('./offload-test-batch', 8, backend)
+    handles = of.sync_write_batch(tensors, keys)
+    assert len(handles) == len(tensors)
+    # extents of a batch are allocated back to back
+    assert of.file_bytes() == sum(tensor.numel() * tensor.element_size() for tensor in tensors)
+    for tensor in tensors:
+        tensor.zero_()
+    of.sync_read(tensors[0], handles[0])
+    assert torch.equal(tensors[0], copies[0])
+    with pytest.raises(RuntimeError):
+        of.sync_read_batch(tensors[1:3] + tensors[1:2], keys[1:3] + keys[1:2])
+    done = []
+    of.async_read_batch(tensors[1:], keys[1:], lambda: done.append(True))
+    of.synchronize()
+    assert done == [True]
+    assert all(torch.equal(tensor, copy) for tensor, copy in zip(tensors, copies))
+
+    # longer than IOV_MAX
+    of = DiskOffloader('.', backend=backend)
+    tensors = [torch.rand(4) for _ in range(3000)]
+    copies = [tensor.clone() for tensor in tensors]
+    of.async_writev(tensors)
+    of.synchronize()
+    of.sync_readv(tensors)
+    assert all(torch.equal(tensor, copy) for tensor, copy in zip(tensors, copies))
+    of.async_write_batch(tensors)
+    of.synchronize()
+    assert all(tensor.storage().size() == 0 for tensor in tensors)
+    of.sync_read_batch(tensors)
+    assert all(torch.equal(tensor, copy) for tensor, copy in zip(tensors, copies))
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+@pytest.mark.parametrize('policy', ['lru', 'lfu'])
+def test_tensor_store(backend, policy):
+    tensors = {f'tensor{i}': torch.rand(1024) for i in range(8)}
+    copies = {key: tensor.clone() for key, tensor in tensors.items()}
+    # room for 4 tensors
+    store = TensorStore('./offload-test-store', 4 * 4096, 8, backend, policy, prefetch_depth=0)
+    for key, tensor in tensors.items():
+        store.put(key, tensor)
+    store.synchronize()
+    assert store.resident_bytes() <= store.budget_bytes()
+    assert not store.is_resident('tensor0')
+    assert store.is_resident('tensor7')
+    assert store.stats()['spills'] == 4
+    for i in [4, 5, 6, 7, 0, 1, 2, 3]:
+        assert torch.equal(store.get(f'tensor{i}'), copies[f'tensor{i}'])
+    stats = store.stats()
+    assert stats['hits'] == 4
+    assert stats['misses'] == 4
+    # tensor0 was read back unchanged, it is spilled again without a write
+    store.get('tensor4')
+    assert store.stats()['clean_spills'] == 1
+    store.remove('tensor0')
+    assert not store.contains('tensor0')
+    with pytest.raises(RuntimeError):
+        store.get('tensor0')
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_tensor_store_respill(backend):
+    # room for 1 tensor, every get spills the other one
+    store = TensorStore('./offload-test-store-respill', 1 << 20, 8, backend, prefetch_depth=0)
+    a, b = torch.rand(1 << 18), torch.rand(1 << 18)
+    expected = {'a': a.clone(), 'b': b.clone()}
+    store.put('a', a)
+    store.put('b', b)
+    for _ in range(16):
+        # the key is hit while its spill is in flight, modified, and spilled again by the next get
+        for key in ('a', 'b'):
+            store.get(key).add_(1)
+            expected[key].add_(1)
+    store.synchronize()
+    for key in ('a', 'b'):
+        assert torch.equal(store.get(key), expected[key])
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_write_back_cache(backend):
+    # room for 2 tensors
+    cache = WriteBackCache('./offload-test-cache', 2 * 4096, 8, backend)
+    x = torch.rand(1024)
+    for _ in range(3):
+        x.add_(1)
+        cache.write(x, 'x')
+    x_copy = x.clone()
+    stats = cache.stats()
+    assert stats['absorbed_writes'] == 2
+    assert stats['flushes'] == 0
+    assert cache.dirty_bytes() == 4096
+    y = torch.empty(1024)
+    cache.read(y, 'x')
+    assert torch.equal(y, x_copy)
+    cache.pin('x')
+    tensors = [torch.rand(1024) for _ in range(3)]
+    for i, tensor in enumerate(tensors):
+        cache.write(tensor, f'tensor{i}')
+    # the pinned key stays, the oldest unpinned one is written back on eviction
+    assert cache.contains('x')
+    assert not cache.contains('tensor0')
+    assert cache.stats()['flushes'] == 2
+    cache.read(y, 'tensor0')
+    assert torch.equal(y, tensors[0])
+    assert cache.stats()['misses'] == 1
+    cache.barrier()
+    assert cache.dirty_bytes() == 0
+    cache.unpin('x')
+    cache.erase('x')
+    with pytest.raises(RuntimeError):
+        cache.read(y, 'x')
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_inflight(backend):
+    tensors = [torch.rand(16 << 20) for _ in range(3)]
+    of = Offloader('./offload-test-inflight', 8, backend)
+    # rewrites of a key in flight: the waiting one is superseded by the newest
+    for tensor in tensors:
+        of.async_write(tensor, 'x')
+    y = torch.empty_like(tensors[0])
+    # served from the newest source, consumes the key
+    of.async_read(y, 'x')
+    of.synchronize()
+    assert torch.equal(y, tensors[-1])
+    assert 'x' not in of.keys()
+    stats = of.inflight_stats()
+    assert stats['superseded_writes'] <= 1
+    assert of.live_bytes() == 0
+
+    of = Offloader('./offload-test-inflight', 8, backend, retain=True)
+    of.sync_write(tensors[0], 'x')
+    outputs = [torch.empty_like(tensors[0]) for _ in range(2)]
+    for output in outputs:
+        of.async_read(output, 'x')
+    of.async_write(tensors[1], 'x')
+    of.synchronize()
+    assert all(torch.equal(output, tensors[0]) for output in outputs)
+    of.sync_read(y, 'x')
+    assert torch.equal(y, tensors[1])
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_sharded_offloader(backend):
+    of = ShardedOffloader('./offload-test-sharded', 4, 8, backend)
+    assert of.n_shards() == 4
+    tensors = [torch.rand(1024) for _ in range(64)]
+    copies = [tensor.clone() for tensor in tensors]
+    keys = [f'tensor{i}' for i in range(len(tensors))]
+    assert len({of.shard_of(key) for key in keys}) > 1
+    done = []
+    for tensor, key in zip(tensors, keys):
+        of.async_write(tensor, key, lambda: done.append(True))
+    of.synchronize()
+    assert len(done) == len(tensors)
+    for tensor in tensors:
+        tensor.zero_()
+    for tensor, key in zip(tensors[1:], keys[1:]):
+        of.async_read(tensor, key)
+    of.sync_read(tensors[0], keys[0])
+    of.synchronize()
+    assert all(torch.equal(tensor, copy) for tensor, copy in zip(tensors, copies))
+    with pytest.raises(RuntimeError):
+        of.sync_read(tensors[0], keys[0])
+    of.async_read(tensors[1], keys[1])
+    with pytest.raises(RuntimeError):
+        of.synchronize()
+
+    # pending Python callbacks run on the shard threads while the offloader is torn down
+    of = ShardedOffloader('./offload-test-sharded', 4, 8, backend)
+    done = []
+    for tensor, key in zip(tensors, keys):
+        of.async_write(tensor, key, lambda: done.append(True))
+    of.close()
+    assert len(done) == len(tensors)
+    with pytest.raises(RuntimeError):
+        of.async_write(tensors[0], keys[0])
+    of = ShardedOffloader('./offload-test-sharded', 4, 8, backend)
+    for tensor, key in zip(tensors, keys):
+        of.async_write(tensor, key, lambda: done.append(True))
+    del of
+    assert len(done) == 2 * len(tensors)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_prefetch_iterator(backend):
+    groups = [[torch.rand(1024), torch.rand(256)] for _ in range(10)]
+    copies = [[tensor.clone() for tensor in group] for group in groups]
+    of = DiskOffloader('.', 8, backend)
+    of.sync_write_batch([tensor for group in groups for tensor in group])
+    it = PrefetchIterator(of, groups, depth=2)
+    n_groups = 0
+    for group, copy in zip(it, copies):
+        assert all(torch.equal(tensor, expected) for tensor, expected in zip(group, copy))
+        for tensor in group:
+            tensor.add_(1)
+        n_groups += 1
+    it.close()
+    assert n_groups == len(groups)
+    assert 1 <= it.depth() <= 8
+    # every group was written back and released
+    assert all(tensor.storage().size() == 0 for group in groups for tensor in group)
+    for group, copy in zip(groups, copies):
+        for tensor in group:
+            of.sync_read(tensor)
+        assert all(torch.equal(tensor, expected + 1) for tensor, expected in zip(group, copy))
+    # a group which cannot be read fails next() without leaving close() waiting for it
+    groups = [[torch.rand(1024)] for _ in range(3)]
+    of.sync_write_batch([group[0] for group in groups[:2]])
+    it = PrefetchIterator(of, groups, depth=2, adaptive=False)
+    with pytest.raises(RuntimeError):
+        next(it)
+    it.close()
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_learned_prefetch(backend):
+    tensors = [torch.rand(1 << 16) for _ in range(8)]
+    expected = [tensor.clone() for tensor in tensors]
+    of = DiskOffloader('.', 8, backend)
+    for tensor in tensors:
+        of.sync_write(tensor)
+
+    def step(skip=None):
+        for i, tensor in enumerate(tensors):
+            if i == skip:
+                continue
+            of.sync_read(tensor)
+            assert torch.equal(tensor, expected[i])
+            tensor.add_(1)
+            expected[i].add_(1)
+            of.sync_write(tensor)
+
+    of.start_recording()
+    step()
+    of.stop_recording(1 << 30)
+    step()
+    # a skipped access wastes its prefetch
+    step(skip=3)
+    step()
+    of.stop_prefetching()
+    stats = of.prefetch_stats()
+    assert stats['hits'] + stats['late'] > 0
+    assert stats['hits'] + stats['late'] + stats['wasted'] <= stats['issued']
+    assert stats['bytes'] == 0
+    assert all(tensor.storage().size() == 0 for tensor in tensors)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_replay(backend):
+    tensors = [torch.rand(1 << 14) for _ in range(8)]
+    of = Offloader('./offload-test-replay', 8, backend, retain=True)
+    expected = [tensor.clone() for tensor in tensors]
+
+    def step():
+        for i, tensor in enumerate(tensors):
+            of.async_write(tensor, f'tensor{i}')
+        of.synchronize()
+        for i, tensor in enumerate(tensors):
+            tensor.zero_()
+            of.async_read(tensor, f'tensor{i}')
+        of.synchronize()
+        for i, tensor in enumerate(tensors):
+            assert torch.equal(tensor, expected[i])
+            tensor.add_(1)
+            expected[i].add_(1)
+
+    of.start_capture()
+    step()
+    of.stop_capture()
+    assert of.replay_stats()['ops'] == 16
+    step()
+    step()
+    stats = of.replay_stats()
+    assert stats['replayed'] == 32
+    assert stats['fallbacks'] == 0
+    # a request outside of the schedule takes the normal path
+    extra = torch.rand(1 << 14)
+    of.sync_write(extra, 'extra')
+    step()
+    assert of.replay_stats()['fallbacks'] == 1
+    # freeing a captured extent invalidates the schedule
+    of.erase('tensor0')
+    of.sync_write(tensors[0], 'tensor0')
+    assert of.replay_stats()['ops'] == 0
+    step()
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_io_priority(backend):
+    of = Offloader('./offload-test-priority', 8, backend)
+    with pytest.raises(RuntimeError):
+        of.set_io_priority('urgent', 'bulk')
+    of.set_io_priority('critical', 'bulk', max_writes=1)
+    reads = [torch.rand(1 << 16) for _ in range(4)]
+    for i, tensor in enumerate(reads):
+        of.sync_write(tensor, f'read{i}')
+    expected = [tensor.clone() for tensor in reads]
+    writes = [torch.rand(1 << 20) for _ in range(8)]
+    # writes issued while critical reads are in flight are held back, except one
+    for i, tensor in enumerate(reads):
+        tensor.zero_()
+        of.async_read(tensor, f'read{i}')
+    for i, tensor in enumerate(writes):
+        of.async_write(tensor, f'write{i}')
+    of.synchronize()
+    assert all(torch.equal(tensor, copy) for tensor, copy in zip(reads, expected))
+    assert of.held_writes() <= len(writes)
+    for i, tensor in enumerate(writes):
+        copy = torch.empty_like(tensor)
+        of.sync_read(copy, f'write{i}')
+        assert torch.equal(copy, tensor)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_deadline_scheduler(backend):
+    of = Offloader('./offload-test-deadline', 8, backend)
+    of.set_deadline_scheduler(depth=2)
+    tensors = [torch.rand(1 << 18) for _ in range(8)]
+    # more requests than the depth, the later ones wait in the scheduler
+    for i, tensor in enumerate(tensors):
+        of.async_write(tensor, f'tensor{i}', deadline=10.0 if i % 2 == 0 else -1.0)
+    of.synchronize()
+    order = []
+    results = [torch.empty_like(tensor) for tensor in tensors]
+    for i, tensor in enumerate(results):
+        # due immediately, so every one of them misses
+        of.async_read(tensor, f'tensor{i}', lambda i=i: order.append(i), deadline=0.0 if i >= 4 else -1.0)
+    of.synchronize()
+    assert all(torch.equal(result, tensor) for result, tensor in zip(results, tensors))
+    assert sorted(order) == list(range(8))
+    stats = of.deadline_stats()
+    assert stats['deadlines'] == 8
+    assert stats['misses'] == 4
+    assert stats['total_lateness_us'] <= 4 * stats['max_lateness_us']
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_cancel(backend):
+    of = Offloader('./offload-test-cancel', 8, backend)
+    # only one request in flight, the others wait in the scheduler and can be dropped
+    of.set_deadline_scheduler(depth=1)
+    tensors = [torch.rand(1 << 18) for _ in range(8)]
+    done = []
+    for i, tensor in enumerate(tensors):
+        of.async_write(tensor, f'tensor{i}', lambda i=i: done.append(i))
+    cancelled = {i for i in range(4, 8) if of.cancel(f'tensor{i}') > 0}
+    # at most one of them is in flight, the others are still queued
+    assert len(cancelled) >= 3
+    of.synchronize()
+    assert sorted(done) == list(range(8))
+    # a cancelled write leaves the key not stored, even if it landed before its completion was reaped
+    keys = set(of.keys())
+    for i, tensor in enumerate(tensors):
+        if i in cancelled:
+            assert f'tensor{i}' not in keys
+            continue
+        result = torch.empty_like(tensor)
+        of.sync_read(result, f'tensor{i}')
+        assert torch.equal(result, tensor)
+    assert of.inflight_stats()['cancelled_requests'] == len(cancelled)
+
+    tensor = torch.rand(1 << 18)
+    handle = of.register(tensor)
+    of.async_write(tensor, handle)
+    of.cancel(handle)
+    of.synchronize()
+    assert of.cancel_all() == 0
+    of.unregister(handle)
+    del of
+
+    of = Offloader('./offload-test-cancel', 8, backend, thread_safe=True)
+    with pytest.raises(RuntimeError):
+        of.cancel('tensor0')
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_cancel_read(backend):
+    of = Offloader('./offload-test-cancel-read', 8, backend)
+    tensors = [torch.rand(1 << 18) for _ in range(8)]
+    for i, tensor in enumerate(tensors):
+        of.sync_write(tensor, f'tensor{i}')
+    value = torch.rand(1 << 18)
+    handle = of.register(value)
+    of.sync_write(value, handle)
+    of.set_deadline_scheduler(depth=1)
+    results = [torch.empty_like(tensor) for tensor in tensors]
+    for i, result in enumerate(results):
+        of.async_read(result, f'tensor{i}')
+    handle_result = torch.empty_like(value)
+    of.async_read(handle_result, handle)
+    # reads take the keys off the disk, a cancelled one puts its key back
+    cancelled = {i for i in range(4, 8) if of.cancel(f'tensor{i}') > 0}
+    assert len(cancelled) >= 3
+    assert of.cancel(handle) == 1
+    of.synchronize()
+    for i, tensor in enumerate(tensors):
+        if i not in cancelled:
+            assert torch.equal(results[i], tensor)
+            continue
+        result = torch.empty_like(tensor)
+        of.sync_read(result, f'tensor{i}')
+        assert torch.equal(result, tensor)
+    of.sync_read(handle_result, handle)
+    assert torch.equal(handle_result, value)
+    of.unregister(handle)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_io_arbiter(backend):
+    arbiter = IOArbiter(max_inflight=4)
+    arbiter.add_class('train', weight=4)
+    arbiter.add_class('checkpoint', weight=1, bytes_per_sec=32 << 20)
+    with pytest.raises(RuntimeError):
+        arbiter.add_class('train')
+    train = Offloader('./offload-test-arbiter-train', 8, backend)
+    checkpoint = Offloader('./offload-test-arbiter-checkpoint', 8, backend)
+    with pytest.raises(RuntimeError):
+        train.set_io_class(arbiter, 'unknown')
+    train.set_io_class(arbiter, 'train')
+    checkpoint.set_io_class(arbiter, 'checkpoint')
+    tensors = [torch.rand(1 << 18) for _ in range(8)]
+    start = time.time()
+    for i, tensor in enumerate(tensors):
+        checkpoint.async_write(tensor, f'tensor{i}')
+        train.async_write(tensor, f'tensor{i}')
+    train.synchronize()
+    checkpoint.synchronize()
+    # 8 MB at 32 MB/s, less the initial burst
+    assert time.time() - start >= 0.15
+    for i, tensor in enumerate(tensors):
+        result = torch.empty_like(tensor)
+        checkpoint.sync_read(result, f'tensor{i}')
+        assert torch.equal(result, tensor)
+    stats = arbiter.stats()
+    assert stats['checkpoint']['ops'] == 16
+    assert stats['checkpoint']['bytes'] == 16 << 20
+    assert stats['checkpoint']['throttled'] > 0
+    assert stats['train']['ops'] == 8
+    assert stats['train']['inflight'] == 0
+    assert stats['train']['max_latency_us'] >= stats['train']['avg_latency_us']
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_shared_engine(backend):
+    engine = SharedEngine(16, backend)
+    offloaders = [Offloader(f'./offload-test-shared-{i}', 8, backend, engine=engine) for i in range(4)]
+    assert engine.n_attached() == 4
+
+    def run(i):
+        of = offloaders[i]
+        tensors = [torch.rand(1 << 16) for _ in range(8)]
+        done = []
+        for j, tensor in enumerate(tensors):
+            of.async_write(tensor, f'tensor{j}', lambda j=j: done.append(j))
+        # only the requests of this offloader are waited for, and its callbacks run here
+        of.synchronize()
+        assert sorted(done) == list(range(8))
+        for j, tensor in enumerate(tensors):
+            result = torch.empty_like(tensor)
+            of.async_read(result, f'tensor{j}')
+            of.synchronize()
+            assert torch.equal(result, tensor)
+
+    run(0)
+    with ThreadPoolExecutor(3) as pool:
+        list(pool.map(run, range(1, 4)))
+    del offloaders
+    assert engine.n_attached() == 0
+    assert SharedEngine.process(backend, 16).n_entries() == SharedEngine.process(backend, 32).n_entries()
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_io_profile(backend):
+    profile_path = os.path.abspath(f'./offload-test-profile-{backend}')
+    old = os.environ.get('TENSORNVME_PROFILE')
+    os.environ['TENSORNVME_PROFILE'] = profile_path
+    try:
+        assert find_io_profile('.') is None
+        result = measure_engine('.', backend, 4, 64 << 10, 1 << 20)
+        assert result['write_bytes_per_sec'] > 0 and result['read_bytes_per_sec'] > 0
+        save_io_profile(IOProfile(os.path.abspath('.'), backend, 8, 64 << 10, result['write_bytes_per_sec'],
+                                  result['read_bytes_per_sec']))
+        # the offload file does not exist yet, its directory is looked up
+        profile = find_io_profile('./offload-test-profile')
+        assert profile.backend == backend and profile.n_entries == 8 and profile.chunk_bytes == 64 << 10
+
+        of = Offloader('./offload-test-profile', 0, 'auto')
+        x = torch.rand(1 << 20)
+        x_copy = x.clone()
+        of.sync_write(x, 'x')
+        of.sync_read(x, 'x')
+        assert torch.equal(x, x_copy)
+        del of
+    finally:
+        if old is None:
+            del os.environ['TENSORNVME_PROFILE']
+        else:
+            os.environ['TENSORNVME_PROFILE'] = old
+        if os.path.exists(profile_path):
+            os.remove(profile_path)
+
+
+@pytest.mark.parametrize('backend', ['uring', 'aio'])
+def test_autotune(backend):
+    of = Offloader('./offload-test-autotune', 16, backend)
+    assert of.autotune_stats() == {}
+    of.set_autotune(min_depth=2)
+    tensors = [torch.rand(1 << 16) for _ in range(64)]
+    for _ in range(4):
+        done = []
+        for i, tensor in enumerate(tensors):
+            of.async_write(tensor, f'tensor{i}', lambda i=i: done.append(i))
+        of.synchronize()
+        assert sorted(done) == list(range(64))
+        results = [torch.empty_like(tensor) for tensor in tensors]
+        for i, result in enumerate(results):
+            of.async_read(result, f'tensor{i}')
+        of.synchronize()
+        assert all(torch.equal(result, tensor) for result, tensor in zip(results, tensors))
+    stats = of.autotune_stats()
+    assert stats['min_depth'] == 2 and stats['max_depth'] == 16
+    assert 2 <= stats['depth'] <= 16
+    assert 1 <= stats['batch'] <= max(1, stats['depth'] // 2)
+    assert stats['increases'] + stats['decreases'] <= stats['epochs']
+    # the controller sits next to the engine, under the other wrappers
+    other = Offloader('./offload-test-autotune-order', 16, backend)
+    other.set_deadline_scheduler(depth=4)
+    with pytest.raises(RuntimeError):
+        other.set_autotune(min_depth=2)
+
+
 if __name__ == '__main__':
     test_sync_io('uring')
     test_async_io('uring')
     test_sync_vec_io('uring')
     test_async_vec_io('uring')
+    test_compaction('uring')
+    test_static_layout('uring')
+    test_handle_io('uring')
+    test_persistent('uring')
+    test_retain('uring')
+    test_mmap('uring')
+    test_host_arena('uring')
+    test_sync_chunked_io('uring')
+    test_storage_key('uring')
+    test_thread_safe('uring')
+    test_batch_io('uring')
+    test_tensor_store('uring', 'lru')
+    test_tensor_store_respill('uring')
+    test_write_back_cache('uring')
+    test_inflight('uring')
+    test_sharded_offloader('uring')
+    test_prefetch_iterator('uring')
+    test_learned_prefetch('uring')
+    test_replay('uring')
+    test_io_priority('uring')
+    test_deadline_scheduler('uring')
+    test_cancel('uring')
+    test_cancel_read('uring')
+    test_io_arbiter('uring')
+    test_shared_engine('uring')
+    test_io_profile('uring')
+    test_autotune('uring')
@@ -0,0 +1,45 @@
+#define CATCH_CONFIG_MAIN
+#include <stdio.h>
+#include "catch.hpp"
+
+#include "handle_table.h"
+
+
+TEST_CASE( "Test handle table function" ) {
+    HandleTable table;
+
+    SECTION( "create and get" ) {
+        handle_t h1 = table.create(4);
+        handle_t h2 = table.create(8);
+        REQUIRE(h1 != h2);
+        REQUIRE(table.size() == 2);
+        REQUIRE(table.get(h1).bytes == 4);
+        REQUIRE(table.get(h2).bytes == 8);
+        REQUIRE(table.get(h1).flags == ENTRY_USED);
+        table.get(h2).offset = 4;
+        table.get(h2).flags |= ENTRY_STORED;
+        REQUIRE(table.get(h2).offset == 4);
+        REQUIRE((table.get(h2).flags & ENTRY_STORED) != 0);
+    }
+
+    SECTION( "remove and reuse slots" ) {
+        handle_t h1 = table.create(4);
+        table.remove(h1);
+        REQUIRE(table.size() == 0);
+        REQUIRE_FALSE(table.contains(h1));
+        REQUIRE_THROWS(table.get(h1));
+        REQUIRE_THROWS(table.remove(h1));
+        handle_t h2 = table.create(16);
+        // the slot is reused, but the stale handle stays invalid
+        REQUIRE(table.capacity() == 1);
+        REQUIRE(h2 != h1);
+        REQUIRE_FALSE(table.contains(h1));
+        REQUIRE(table.get(h2).bytes == 16);
+    }
+
+    SECTION( "invalid handles" ) {
+        REQUIRE_FALSE(table.contains(0));
+        REQUIRE_THROWS(table.get(12345));
+        REQUIRE_THROWS(table.create(HandleTable::max_bytes + 1));
+    }
+}
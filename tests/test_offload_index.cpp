@@ -0,0 +1,101 @@
+#define CATCH_CONFIG_MAIN
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "catch.hpp"
+
+#include "offload_index.h"
+
+
+TEST_CASE( "Test offload index function" ) {
+    const std::string path = "./test_offload_index";
+    remove(path.c_str());
+    SpaceManager space_mgr(0);
+    std::unordered_map<std::string, IndexEntry> entries;
+
+    {
+        OffloadIndex index(path);
+        REQUIRE_FALSE(index.load(space_mgr, entries));
+        // [0, 8) is "a", [8, 24) is "b"
+        entries["a"] = IndexEntry{SpaceInfo(space_mgr.alloc(8), 8), TensorMeta{6, {2}}};
+        entries["b"] = IndexEntry{SpaceInfo(space_mgr.alloc(16), 16), TensorMeta{6, {2, 2}}};
+        index.checkpoint(space_mgr, entries);
+        // journal: "c" is put at [24, 28), "a" is deleted
+        index.put("c", IndexEntry{SpaceInfo(space_mgr.alloc(4), 4), TensorMeta{-1, {}}});
+        index.del("a");
+        index.sync();
+    }
+
+    SECTION( "reload" ) {
+        SpaceManager new_space_mgr(0);
+        std::unordered_map<std::string, IndexEntry> new_entries;
+        OffloadIndex index(path);
+        REQUIRE(index.load(new_space_mgr, new_entries));
+        REQUIRE(new_entries.size() == 2);
+        REQUIRE(new_entries.count("a") == 0);
+        REQUIRE(new_entries["b"].space_info == SpaceInfo(8, 16));
+        REQUIRE(new_entries["b"].meta.dtype == 6);
+        REQUIRE(new_entries["b"].meta.shape == std::vector<int64_t>({2, 2}));
+        REQUIRE(new_entries["c"].space_info == SpaceInfo(24, 4));
+        REQUIRE(new_space_mgr.get_used_bytes() == 28);
+        REQUIRE(new_space_mgr.get_free_bytes() == 8);
+        REQUIRE(new_space_mgr.alloc(8) == 0);
+    }
+
+    SECTION( "drop torn tail" ) {
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        REQUIRE(write(fd, "garbage", 7) == 7);
+        close(fd);
+        SpaceManager new_space_mgr(0);
+        std::unordered_map<std::string, IndexEntry> new_entries;
+        {
+            OffloadIndex index(path);
+            REQUIRE(index.load(new_space_mgr, new_entries));
+            REQUIRE(new_entries.size() == 2);
+            index.put("d", IndexEntry{SpaceInfo(new_space_mgr.alloc(4), 4), TensorMeta{-1, {}}});
+        }
+        OffloadIndex index(path);
+        REQUIRE(index.load(new_space_mgr, new_entries));
+        REQUIRE(new_entries.size() == 3);
+        REQUIRE(new_entries["d"].space_info == SpaceInfo(0, 4));
+    }
+
+    SECTION( "checkpoint again" ) {
+        SpaceManager new_space_mgr(0);
+        std::unordered_map<std::string, IndexEntry> new_entries;
+        {
+            OffloadIndex index(path);
+            REQUIRE(index.load(new_space_mgr, new_entries));
+            index.checkpoint(new_space_mgr, new_entries);
+        }
+        SpaceManager reloaded_space_mgr(0);
+        OffloadIndex index(path);
+        REQUIRE(index.load(reloaded_space_mgr, new_entries));
+        REQUIRE(new_entries.size() == 2);
+        REQUIRE(reloaded_space_mgr.get_used_bytes() == 28);
+        REQUIRE(reloaded_space_mgr.get_free_bytes() == 8);
+    }
+    SECTION( "free map is rebuilt from entries" ) {
+        {
+            // [28, 60) is in use by a request or a handle which the index does not know
+            REQUIRE(space_mgr.alloc(32) == 28);
+            entries.erase("a");
+            entries["c"] = IndexEntry{SpaceInfo(24, 4), TensorMeta{-1, {}}};
+            OffloadIndex index(path);
+            index.checkpoint(space_mgr, entries);
+            // "b" moved to [60, 76) and its old extent went to "d"
+            index.put("b", IndexEntry{SpaceInfo(space_mgr.alloc(16), 16), TensorMeta{6, {2, 2}}});
+            index.put("d", IndexEntry{SpaceInfo(8, 16), TensorMeta{-1, {}}});
+        }
+        SpaceManager new_space_mgr(0);
+        std::unordered_map<std::string, IndexEntry> new_entries;
+        OffloadIndex index(path);
+        REQUIRE(index.load(new_space_mgr, new_entries));
+        REQUIRE(new_entries.size() == 3);
+        REQUIRE(new_space_mgr.get_used_bytes() == 76);
+        // [0, 8) and [28, 60)
+        REQUIRE(new_space_mgr.get_free_bytes() == 40);
+        REQUIRE(new_space_mgr.alloc(32) == 28);
+    }
+    remove(path.c_str());
+}
@@ -171,4 +171,74 @@ TEST_CASE( "Test space manager function" ) {
         }
     }
 
-}
\ No newline at end of file
+}
+TEST_CASE( "Test space manager compaction support" ) {
+    SpaceManager space_mgr(0);
+    ull offset;
+
+    SECTION( "free merges holes into the tail" ) {
+        space_mgr.alloc(4);
+        space_mgr.alloc(4);
+        // [0, 8) is used
+        space_mgr.free(0, 4);
+        // [4, 8) is used
+        REQUIRE(space_mgr.get_free_bytes() == 4);
+        space_mgr.free(4, 4);
+        REQUIRE(space_mgr.used_bytes == 0);
+        REQUIRE(space_mgr.avail_spaces.empty());
+    }
+
+    SECTION( "alloc below a bound" ) {
+        space_mgr.alloc(4);
+        space_mgr.alloc(8);
+        space_mgr.alloc(4);
+        // [0, 16) is used
+        space_mgr.free(0, 4);
+        space_mgr.free(4, 8);
+        // [12, 16) is used
+        REQUIRE(space_mgr.get_used_bytes() == 16);
+        REQUIRE(space_mgr.get_free_bytes() == 12);
+        REQUIRE_FALSE(space_mgr.alloc_below(4, 2, offset));
+        REQUIRE(space_mgr.alloc_below(4, 12, offset));
+        REQUIRE(offset == 0);
+        // [0, 4) and [12, 16) are used
+        REQUIRE(space_mgr.get_free_bytes() == 8);
+        space_mgr.free(12, 4);
+        REQUIRE(space_mgr.get_used_bytes() == 4);
+        REQUIRE(space_mgr.get_free_bytes() == 0);
+    }
+}
+
+TEST_CASE( "Test space manager claim and restore" ) {
+    SpaceManager space_mgr(0);
+
+    SECTION( "claim beyond the end" ) {
+        space_mgr.claim(8, 4);
+        // [8, 12) is used
+        REQUIRE(space_mgr.used_bytes == 12);
+        REQUIRE(space_mgr.get_free_bytes() == 8);
+        REQUIRE(space_mgr.alloc(8) == 0);
+        REQUIRE_THROWS(space_mgr.claim(9, 1));
+    }
+
+    SECTION( "claim inside a hole" ) {
+        space_mgr.alloc(16);
+        space_mgr.free(0, 12);
+        // [12, 16) is used
+        space_mgr.claim(4, 4);
+        // [4, 8) and [12, 16) are used
+        REQUIRE(space_mgr.get_free_bytes() == 8);
+        REQUIRE_THROWS(space_mgr.claim(6, 4));
+        ull offset;
+        REQUIRE(space_mgr.alloc_below(4, 12, offset));
+        REQUIRE(offset == 0);
+    }
+
+    SECTION( "restore" ) {
+        vector<SpaceInfo> holes = {SpaceInfo(0, 4)};
+        space_mgr.restore(8, holes);
+        REQUIRE(space_mgr.get_used_bytes() == 8);
+        REQUIRE(space_mgr.get_avail_spaces().size() == 1);
+        REQUIRE(space_mgr.alloc(4) == 0);
+    }
+}